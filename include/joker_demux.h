@@ -0,0 +1,72 @@
+/*
+ * Joker TV
+ * MPTS to SPTS demultiplexer
+ *
+ * split multiplex to single program transport streams in TS thread
+ * (one pass over data). Every output gets own PAT, original PMT
+ * and program PIDs (ES, PCR, ECM) from PSI parser (see get_programs)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_DEMUX
+#define _JOKER_DEMUX	1
+
+// max outputs (programs) per demux
+#define JOKER_DEMUX_OUTPUTS_MAX 32
+// TS packets collected before sink called
+#define JOKER_DEMUX_BATCH 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct big_pool_t;
+
+/* receive SPTS. data - whole TS packets
+ * called from TS thread. Should not block (queue data to other thread)
+ * return 0 if success */
+typedef int(*joker_demux_sink_t)(void *opaque, const unsigned char *data, int size);
+
+/* demux internals "masked" inside */
+struct joker_demux_t;
+
+/* create demux for pool. Outputs added before joker_demux_start
+ * return NULL if failed */
+struct joker_demux_t * joker_demux_alloc(struct big_pool_t *pool);
+
+/* add output for program. One program can have several outputs
+ * return 0 if success */
+int joker_demux_add_program(struct joker_demux_t *demux, int program_number,
+		joker_demux_sink_t sink, void *opaque);
+
+/* same but SPTS written to file (asynchronous writer, see joker_writer.h)
+ * return 0 if success */
+int joker_demux_add_file(struct joker_demux_t *demux, int program_number,
+		const char *filename);
+
+/* attach demux to TS thread. Programs PIDs routed when PSI parsed
+ * (get_programs should be called). Several demuxes can be attached
+ * return 0 if success */
+int joker_demux_start(struct joker_demux_t *demux);
+
+/* called by TS thread for every packet and after every node
+ * (for all demuxes attached to pool) */
+void joker_demux_packet(struct joker_demux_t *demux, unsigned char *pkt, int pid);
+void joker_demux_flush(struct joker_demux_t *demux);
+
+/* detach from pool and free. Can be called while TS processing running
+ * (waits until TS thread finished current node) */
+void joker_demux_free(struct joker_demux_t *demux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
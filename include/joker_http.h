@@ -0,0 +1,54 @@
+/*
+ * Joker TV
+ * HTTP TS streaming server
+ *
+ * serves /mux.ts (whole TS) and /program/<n>.ts (single program TS)
+ * to many clients from one capture. Data copied once to shared
+ * segments, every client sends from them (no copy per client).
+ * Slow clients evicted when own queue is full
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_HTTP
+#define _JOKER_HTTP	1
+
+// max connected clients
+#define JOKER_HTTP_CLIENTS_MAX 64
+// segments queued per client. Client evicted if queue is full
+#define JOKER_HTTP_CLIENT_QUEUE 256
+// bytes queued per client. Client evicted if more
+#define JOKER_HTTP_CLIENT_BUFFER (8*1024*1024)
+// max size of /mux.ts segment
+#define JOKER_HTTP_SEG_SIZE (TS_SIZE*348)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct big_pool_t;
+
+/* server internals "masked" inside */
+struct joker_http_t;
+
+/* start server for pool (start_ts or start_replay should be called)
+ * programs from PSI parser (get_programs) served as /program/<n>.ts
+ * get_programs should return before this call (programs list not locked)
+ * addr - listen address. NULL - all interfaces
+ * return NULL if failed (or not supported on this platform) */
+struct joker_http_t * joker_http_start(struct big_pool_t *pool, const char *addr, int port);
+
+/* disconnect clients and stop server. Should be called before stop_ts */
+void joker_http_stop(struct joker_http_t *http);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
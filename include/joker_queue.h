@@ -0,0 +1,54 @@
+/* 
+ * Joker TV
+ * lock-free single producer/single consumer queue
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_QUEUE
+#define _JOKER_QUEUE	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* queue internals "masked" inside */
+struct joker_queue_t;
+
+/* allocate queue for at least 'size' pointers
+ * return NULL if no memory */
+struct joker_queue_t * joker_queue_alloc(int size);
+void joker_queue_free(struct joker_queue_t *queue);
+
+/* producer side. never blocks
+ * consumer will be woken up only if it parked in joker_queue_pop_wait
+ * return 0 if success
+ * return -EAGAIN if queue is full */
+int joker_queue_push(struct joker_queue_t *queue, void *item);
+
+/* consumer side. never blocks
+ * return NULL if queue is empty */
+void * joker_queue_pop(struct joker_queue_t *queue);
+
+/* consumer side. park until item arrived, timeout or wakeup
+ * timeout_ms - maximum time to wait. negative for infinite wait
+ * return NULL if no items */
+void * joker_queue_pop_wait(struct joker_queue_t *queue, int timeout_ms);
+
+/* wakeup parked consumer (used for cancellation) */
+void joker_queue_wakeup(struct joker_queue_t *queue);
+
+/* amount of items in queue */
+int joker_queue_count(struct joker_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
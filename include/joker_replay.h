@@ -0,0 +1,73 @@
+/*
+ * Joker TV
+ * Offline replay of raw USB data (see --raw-data)
+ * Feeds capture pipeline without hardware
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdint.h>
+#include "joker_tv.h"
+#include "u_drv_data.h"
+
+#ifndef _JOKER_REPLAY
+#define _JOKER_REPLAY	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* replay state "masked" inside */
+struct replay_opaq_t;
+
+struct joker_replay_t {
+	/* raw data file (saved with --raw-data) */
+	char *filename;
+
+	/* replay speed
+	 * 1.0 - original rate (detected from PCR or 'bitrate')
+	 * N - N times faster
+	 * 0 - as fast as possible */
+	double speed;
+	/* TS bitrate (bits/sec) for speed 1.0. 0 - detect from PCR */
+	int64_t bitrate;
+
+	/* ISOC packet payload size (bytes). 0 - 1024
+	 * if packet_size_max bigger than packet_size then size is random
+	 * between packet_size and packet_size_max */
+	int packet_size;
+	int packet_size_max;
+	/* ISOC packets per transfer. 0 - same as USB (max_isoc_packets_count) */
+	int packets;
+
+	/* loss pattern
+	 * loss_ppm - lost ISOC packets per million
+	 * loss_burst - packets lost in row. 0 - 1 */
+	int loss_ppm;
+	int loss_burst;
+	uint32_t seed; /* random seed. same seed gives same pattern */
+
+	/* start from the beginning at end of file */
+	int loop;
+
+	struct replay_opaq_t *opaque;
+};
+
+/* start replay
+ * pipeline started as for USB (start_ts). TS available with read_ts_data
+ * read_ts_data returns 0 (pool->eof set) when file fully processed
+ * return 0 if success */
+int start_replay(struct joker_t *joker, struct big_pool_t *pool,
+		struct joker_replay_t *replay);
+
+/* stop replay and TS processing */
+int stop_replay(struct joker_replay_t *replay);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
@@ -0,0 +1,82 @@
+/*
+ * Joker TV
+ * shared memory TS ring
+ *
+ * TS published to POSIX shared memory object. Other processes map it
+ * and read at memory speed (see joker_shm_client.h). Writer never waits
+ * for readers, slow reader loses oldest data
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_SHM
+#define _JOKER_SHM	1
+
+#define JOKER_SHM_MAGIC 0x4a4b5453 /* JKTS */
+#define JOKER_SHM_VERSION 1
+// ring size (bytes). 64MB by default
+#define JOKER_SHM_SIZE_DEFAULT (64LL*1024*1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* shared object layout:
+ *  header (one page)
+ *  timestamps. wall-clock (usec) for every packet slot
+ *  TS data. size is multiple of page size and TS_SIZE (can be mapped
+ *  twice in a row, so data never wraps for readers)
+ * packet N stored in slot N % packets */
+struct joker_shm_header_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t packet_size; /* TS_SIZE */
+	uint32_t packets; /* slots in ring */
+	uint64_t times_offset;
+	uint64_t data_offset;
+	uint64_t data_size;
+	uint64_t epoch; /* creation time (usec). Identifies ring instance */
+	uint32_t alive; /* 0 when publisher closed ring */
+	uint32_t pid; /* publisher process. Stale ring if it is gone */
+
+	/* packets written since creation. Updated with atomics
+	 * packets in [reserve_index - packets, write_index) are valid */
+	uint64_t write_index __attribute__((aligned(64)));
+	uint64_t reserve_index; /* writer copies packets below this index */
+
+	/* doorbell (futex). incremented on every write
+	 * publisher wakes readers if 'waiters' is not zero */
+	uint32_t doorbell __attribute__((aligned(64)));
+	uint32_t waiters;
+};
+
+/* publisher internals "masked" inside */
+struct joker_shm_t;
+
+/* create shared memory object '/name'
+ * object left by crashed publisher replaced. Running publisher keeps it
+ * size - ring size. 0 for default
+ * return NULL if failed, name is used (or not supported on this platform) */
+struct joker_shm_t * joker_shm_open(const char *name, int64_t size);
+
+/* publish TS packets. Only one writer thread allowed (TS thread)
+ * size should be multiple of TS_SIZE
+ * return 0 if success */
+int joker_shm_write(struct joker_shm_t *shm, const unsigned char *data, int size);
+
+/* mark ring closed, wakeup readers and remove object name
+ * readers keep their mappings until joker_shm_reader_close */
+void joker_shm_close(struct joker_shm_t *shm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
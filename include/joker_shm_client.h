@@ -0,0 +1,237 @@
+/*
+ * Joker TV
+ * shared memory TS ring reader
+ *
+ * header only (Linux). Reader process does not need libjokertv
+ * (link with -lrt on old glibc for shm_open)
+ *
+ * struct joker_shm_reader_t *r = joker_shm_reader_open("jokertv");
+ * while (joker_shm_reader_wait(r, 1000) != -EPIPE) {
+ *	n = joker_shm_reader_peek(r, &data, 1000);
+ *	... use n packets from 'data' (no copy) ...
+ *	if (joker_shm_reader_release(r))
+ *		... data was overwritten while used (reader too slow) ...
+ * }
+ * joker_shm_reader_close(r);
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <joker_shm.h>
+
+#ifndef _JOKER_SHM_CLIENT
+#define _JOKER_SHM_CLIENT	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct joker_shm_reader_t
+{
+	struct joker_shm_header_t *hdr;
+	size_t hdr_size; /* header and timestamps */
+	const uint64_t *times;
+	const unsigned char *data; /* data mapped twice in a row */
+	uint64_t packets;
+	uint64_t index; /* next packet to read */
+	int peeked; /* packets returned by last peek */
+	uint64_t lost; /* packets overwritten before read */
+	int writable; /* header writable (futex wait). Otherwise polling */
+};
+
+/* map ring published by joker_shm_open
+ * reading starts from newest data
+ * return NULL if failed */
+static inline struct joker_shm_reader_t * joker_shm_reader_open(const char *name)
+{
+	struct joker_shm_reader_t *r = NULL;
+	struct joker_shm_header_t hdr, *h = NULL;
+	char path[NAME_MAX];
+	unsigned char *addr = NULL;
+	int fd = -1;
+
+	snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+	fd = shm_open(path, O_RDWR, 0);
+	if (fd < 0)
+		fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	// layout from header
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			hdr.magic != JOKER_SHM_MAGIC || hdr.version != JOKER_SHM_VERSION ||
+			hdr.packet_size * (uint64_t)hdr.packets != hdr.data_size)
+		goto fail;
+
+	r = (struct joker_shm_reader_t *)calloc(1, sizeof(*r));
+	if (!r)
+		goto fail;
+	r->hdr_size = hdr.data_offset;
+	r->packets = hdr.packets;
+
+	// header and timestamps. Writable for waiters counter only
+	r->writable = 1;
+	h = (struct joker_shm_header_t *)mmap(NULL, r->hdr_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		// object of other user. wait by polling
+		r->writable = 0;
+		h = (struct joker_shm_header_t *)mmap(NULL, r->hdr_size, PROT_READ,
+				MAP_SHARED, fd, 0);
+		if (h == MAP_FAILED)
+			goto fail;
+	}
+	r->hdr = h;
+	r->times = (const uint64_t *)((unsigned char *)h + hdr.times_offset);
+
+	// data twice. Any packets range is contiguous
+	addr = (unsigned char *)mmap(NULL, 2 * hdr.data_size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED ||
+			mmap(addr, hdr.data_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+				fd, hdr.data_offset) == MAP_FAILED ||
+			mmap(addr + hdr.data_size, hdr.data_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+				fd, hdr.data_offset) == MAP_FAILED) {
+		if (addr != MAP_FAILED)
+			munmap(addr, 2 * hdr.data_size);
+		munmap(h, r->hdr_size);
+		goto fail;
+	}
+	r->data = addr;
+	close(fd);
+
+	r->index = __atomic_load_n(&h->write_index, __ATOMIC_ACQUIRE);
+
+	return r;
+fail:
+	free(r);
+	close(fd);
+	return NULL;
+}
+
+/* return packets ready for reading */
+static inline uint64_t joker_shm_reader_available(struct joker_shm_reader_t *r)
+{
+	return __atomic_load_n(&r->hdr->write_index, __ATOMIC_ACQUIRE) - r->index;
+}
+
+/* sleep until data available
+ * return 0 if data available
+ * return -ETIMEDOUT if no data during timeout_ms (-1 - infinite)
+ * return -EPIPE if publisher closed ring */
+static inline int joker_shm_reader_wait(struct joker_shm_reader_t *r, int timeout_ms)
+{
+	struct joker_shm_header_t *h = r->hdr;
+	struct timespec ts, *tsp = NULL;
+	uint32_t bell = 0;
+	int ret = 0;
+
+	while (1) {
+		bell = __atomic_load_n(&h->doorbell, __ATOMIC_SEQ_CST);
+		if (joker_shm_reader_available(r))
+			return 0;
+		if (!__atomic_load_n(&h->alive, __ATOMIC_ACQUIRE))
+			return -EPIPE;
+		if (!timeout_ms)
+			return -ETIMEDOUT;
+
+		if (!r->writable) {
+			usleep(1000);
+			if (timeout_ms > 0)
+				timeout_ms--;
+			continue;
+		}
+
+		if (timeout_ms > 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			tsp = &ts;
+		}
+		__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+		// publisher could write before we incremented 'waiters'
+		if (!joker_shm_reader_available(r))
+			ret = syscall(SYS_futex, &h->doorbell, FUTEX_WAIT, bell, tsp, NULL, 0);
+		__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+
+		if (ret && errno == ETIMEDOUT && !joker_shm_reader_available(r))
+			return -ETIMEDOUT;
+		ret = 0;
+	}
+}
+
+/* get up to 'max' packets without copy
+ * data stays in ring. Check joker_shm_reader_release result after use
+ * return packets count (0 if no data) */
+static inline int joker_shm_reader_peek(struct joker_shm_reader_t *r,
+		const unsigned char **data, int max)
+{
+	struct joker_shm_header_t *h = r->hdr;
+	uint64_t write = __atomic_load_n(&h->write_index, __ATOMIC_ACQUIRE);
+	uint64_t oldest = __atomic_load_n(&h->reserve_index, __ATOMIC_ACQUIRE);
+
+	// reader lapped. Jump to oldest packet still valid
+	oldest = oldest > r->packets ? oldest - r->packets : 0;
+	if (r->index < oldest) {
+		r->lost += oldest - r->index;
+		r->index = oldest;
+	}
+
+	r->peeked = write - r->index < (uint64_t)max ? (int)(write - r->index) : max;
+	*data = r->data + (r->index % r->packets) * h->packet_size;
+
+	return r->peeked;
+}
+
+/* wall-clock time (usec) when i-th packet of last peek was published */
+static inline uint64_t joker_shm_reader_time(struct joker_shm_reader_t *r, int i)
+{
+	return r->times[(r->index + i) % r->packets];
+}
+
+/* done with peeked packets
+ * return 0 if success
+ * return -EOVERFLOW if writer overwrote some of them during use */
+static inline int joker_shm_reader_release(struct joker_shm_reader_t *r)
+{
+	uint64_t reserve = 0, start = r->index;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	reserve = __atomic_load_n(&r->hdr->reserve_index, __ATOMIC_RELAXED);
+
+	r->index += r->peeked;
+	r->peeked = 0;
+
+	// next peek skips overwritten packets
+	return (reserve > r->packets && start < reserve - r->packets) ? -EOVERFLOW : 0;
+}
+
+static inline void joker_shm_reader_close(struct joker_shm_reader_t *r)
+{
+	if (!r)
+		return;
+
+	munmap((void *)r->data, 2 * r->hdr->data_size);
+	munmap(r->hdr, r->hdr_size);
+	free(r);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
@@ -0,0 +1,80 @@
+/*
+ * Joker TV
+ * disk backed timeshift buffer
+ *
+ * TS appended to memory mapped circular file (can be several GB).
+ * Every N packets wall-clock time and last PCR saved to index.
+ * Readers start from any byte offset still in file or from
+ * given time (instant replay) while capture keeps appending
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_TIMESHIFT
+#define _JOKER_TIMESHIFT	1
+
+// file size (bytes). 2GB by default
+#define JOKER_TIMESHIFT_SIZE_DEFAULT (2048LL*1024*1024)
+// TS packets between index entries
+#define JOKER_TIMESHIFT_INTERVAL_DEFAULT 1000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* timeshift internals "masked" inside */
+struct joker_timeshift_t;
+
+/* create (or reuse) file and map it
+ * size - file size. 0 for default
+ * interval - TS packets between index entries. 0 for default
+ * return NULL if failed */
+struct joker_timeshift_t * joker_timeshift_open(const char *filename, int64_t size,
+		int interval);
+
+/* append TS packets. Only one writer thread allowed (TS thread)
+ * size should be multiple of TS_SIZE
+ * oldest data overwritten if file is full
+ * return 0 if success */
+int joker_timeshift_write(struct joker_timeshift_t *ts, const unsigned char *data, int size);
+
+/* offsets are absolute (bytes appended since open)
+ * return offset of oldest data still available */
+int64_t joker_timeshift_start(struct joker_timeshift_t *ts);
+/* return offset where next data will be written ("now") */
+int64_t joker_timeshift_end(struct joker_timeshift_t *ts);
+
+/* find offset by wall-clock time (usec, see getus)
+ * example: getus() - 10000000 - ten seconds ago
+ * return offset of first indexed packet at or after 'time'
+ * return start if 'time' is older than all data, end if newer */
+int64_t joker_timeshift_seek_time(struct joker_timeshift_t *ts, uint64_t time);
+
+/* find offset by PCR (27MHz)
+ * return offset of newest indexed packet with PCR not greater than 'pcr'
+ * return negative error code if not found */
+int64_t joker_timeshift_seek_pcr(struct joker_timeshift_t *ts, int64_t pcr);
+
+/* read data starting from '*offset'. '*offset' moved forward
+ * wait up to timeout_ms for new data if reader reached end
+ * (0 - do not wait, -1 - wait forever)
+ * return bytes copied (0 if no data)
+ * return -ERANGE if data at '*offset' already overwritten
+ * (use joker_timeshift_start to continue) */
+int joker_timeshift_read(struct joker_timeshift_t *ts, int64_t *offset,
+		unsigned char *data, int size, int timeout_ms);
+
+/* unmap and close file. Readers should be finished */
+void joker_timeshift_close(struct joker_timeshift_t *ts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
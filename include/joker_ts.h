@@ -105,6 +105,10 @@ struct program_t {
 	void *generated_sdt_pkt;
 };
 
+/* attach PSI parser and wait for PAT/PMT
+ * parser hooks are per-packet (TS thread). Programs list is not locked:
+ * other threads can walk it only after this call returned
+ * return NULL if failed */
 struct list_head * get_programs(struct big_pool_t *pool);
 
 /* convert name to utf-8
@@ -113,6 +117,11 @@ int dvb_to_utf(char * buf, size_t insize, char * _outbuf, int maxlen);
 
 void * get_next_sdt(struct big_pool_t *pool);
 
+/* PAT with one program (single program TS output)
+ * pkt - TS_SIZE bytes, continuity counter is zero
+ * return 0 if success */
+int generate_spts_pat_pkt(int ts_id, int program_number, int pmt_pid, unsigned char *pkt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,42 @@
+/* 
+ * Joker TV
+ * TS sync byte search (resynchronisation) and PCR extraction
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _JOKER_TS_SYNC
+#define _JOKER_TS_SYNC	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// amount of following sync bytes to check before "lock" on position
+#define TS_SYNC_LOCK_COUNT	3
+
+/* find TS packet start in buffer
+ * 0x47 sync byte should repeat every 188 bytes
+ * confirm - amount of following packets to check (if fits into buffer)
+ *
+ * SSE2/AVX2 used if supported by CPU (runtime detection)
+ *
+ * return offset of TS packet start
+ * return -1 if no TS packets start found */
+int ts_sync_find(const unsigned char *buf, size_t size, int confirm);
+
+/* get PCR from TS packet (27MHz units)
+ * return -1 if no PCR in packet */
+int64_t ts_pcr(const unsigned char *pkt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
@@ -99,9 +99,36 @@ struct stat_t {
 	int64_t avg_count;
 };
 
+/* internal threads (see joker_t threads) */
+enum joker_thread_id_t {
+	JOKER_THREAD_USB = 0, /* libusb events (ISOC completion) */
+	JOKER_THREAD_TS, /* TS processing */
+	JOKER_THREAD_SERVICE, /* frontend status */
+	JOKER_THREAD_WORKER, /* batch hooks (see big_pool_t ts_workers) */
+	JOKER_THREAD_MAX
+};
+
+/* scheduling policy */
+#define JOKER_SCHED_DEFAULT	0
+#define JOKER_SCHED_FIFO	1
+#define JOKER_SCHED_RR		2
+
+/* internal thread scheduling. zero values - OS defaults
+ * applied by thread itself on start. Failures reported and ignored
+ * realtime policy needs CAP_SYS_NICE or rtprio limit (Linux) */
+struct joker_thread_params_t {
+	int policy; /* JOKER_SCHED_* */
+	int priority; /* 1..99 for JOKER_SCHED_FIFO/JOKER_SCHED_RR */
+	int nice; /* nice level. Linux only */
+	uint64_t cpu_mask; /* allowed CPU's (bit 0 - CPU 0). Linux only */
+};
+
 /* main pointer to Joker TV */
 struct joker_t {
 	void *libusb_opaque;
+	/* libusb context owned by this device
+	 * every device has own context and USB events thread */
+	void *libusb_ctx_opaque;
 	void *i2c_opaque;
 	void *fe_opaque;
 	struct service_thread_opaq_t *service_threading;
@@ -172,9 +199,9 @@ struct joker_t {
 	char *diseqc_script;
 	int diseqc_script_len;
 
-	/* Raw data from usb */
+	/* Raw data from usb
+	 * saved by writer thread (see joker_writer.h) */
 	char *raw_data_filename;
-	FILE *raw_data_filename_fd;
 	
 	/* CAM interaction dump file */
 	char *cam_pcap_filename;
@@ -189,6 +216,19 @@ struct joker_t {
 	int max_isoc_packets_size;
 	/* Maximum isochronous packets per URB (used for libusb_submit_transfer) */
 	int max_isoc_packets_count;
+
+	/* adaptive USB transfers
+	 * submitted transfers (URB's) and ISOC packets per transfer
+	 * adjusted at runtime: grow on completion jitter and ISOC errors,
+	 * shrink when stream is quiet. 0 - defaults
+	 * usb_bufs_min == usb_bufs_max disables depth adjustment */
+	int usb_bufs_min;
+	int usb_bufs_max;
+	/* maximum is max_isoc_packets_count */
+	int isoc_packets_min;
+
+	/* internal threads scheduling and CPU affinity */
+	struct joker_thread_params_t threads[JOKER_THREAD_MAX];
 };
 
 #ifdef __cplusplus
@@ -196,7 +236,7 @@ extern "C" {
 #endif
 
 /* open Joker TV on USB
- * return error code if fail
+ * return error code if fail (everything opened is released)
  * or 0 if success
  */
 int joker_open(struct joker_t *joker);
@@ -207,6 +247,31 @@ int joker_close(struct joker_t *joker);
 /* print available USB devices */
 int joker_devices_print(struct joker_t *joker);
 
+// maximum Joker TV devices in one process (enumeration)
+#define JOKER_DEVICES_MAX 32
+
+/* USB device id (bus:port) */
+struct joker_usb_id_t {
+	int bus;
+	int port;
+};
+
+/* enumerate Joker TV devices on USB
+ * ids - output array (can be NULL if only count required)
+ * max - size of ids array
+ * return number of devices found or negative error code */
+int joker_devices_list(struct joker_usb_id_t *ids, int max);
+
+/* open multiple Joker TV devices in one process
+ * jokers - array of zeroed joker_t (libusb_verbose, etc can be set before call)
+ * max - size of jokers array
+ * ids - devices to open. if NULL then all available devices opened
+ * ids_count - size of ids array
+ * return number of opened devices (jokers[0] ... jokers[ret - 1])
+ * or negative error code */
+int joker_open_all(struct joker_t *jokers, int max,
+		const struct joker_usb_id_t *ids, int ids_count);
+
 #ifdef __cplusplus
 }
 #endif
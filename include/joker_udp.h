@@ -0,0 +1,85 @@
+/*
+ * Joker TV
+ * UDP/RTP network output
+ *
+ * TS packets sent in datagrams (7 TS packets per datagram) by own
+ * thread. Datagrams paced by PCR (or by measured input bitrate)
+ * instead of bursts of whole USB transfers
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_UDP
+#define _JOKER_UDP	1
+
+// TS packets per datagram
+#define JOKER_UDP_PACKETS 7
+// queued data (bytes) between producer and sender thread
+#define JOKER_UDP_QUEUE_SIZE (TS_SIZE*JOKER_UDP_PACKETS*4096)
+// datagrams sent with one system call
+#define JOKER_UDP_BATCH 32
+// multicast TTL
+#define JOKER_UDP_TTL 16
+
+/* joker_udp_open flags */
+/* RTP header (RFC 2250. payload type 33 - MP2T) */
+#define JOKER_UDP_RTP		(1 << 0)
+/* send as soon as datagram is full. No pacing */
+#define JOKER_UDP_NO_PACING	(1 << 1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct big_pool_t;
+
+/* output statistics. counters are monotonic */
+struct joker_udp_stats_t {
+	uint64_t packets; /* TS packets sent */
+	uint64_t datagrams; /* datagrams sent */
+	uint64_t bytes; /* TS bytes sent */
+	uint64_t dropped; /* TS packets dropped (queue full or send failed) */
+	uint64_t errors; /* send failures */
+	uint64_t bitrate; /* output bitrate (bit/sec) for last second */
+};
+
+/* output internals "masked" inside */
+struct joker_udp_t;
+
+/* create socket and start sender thread
+ * addr - host or IP (unicast or multicast). port - UDP port
+ * pcr_pid - PID used for pacing. -1 - first PID with PCR
+ * return NULL if failed */
+struct joker_udp_t * joker_udp_open(const char *addr, int port, int flags, int pcr_pid);
+
+/* queue TS packets for sending. Only one producer allowed
+ * never blocks. size should be multiple of TS_SIZE
+ * return 0 if success
+ * return -EAGAIN if queue is full (rest of data dropped) */
+int joker_udp_write(struct joker_udp_t *udp, const unsigned char *data, int size);
+
+/* same as joker_udp_write. Can be used as demux sink (see joker_demux.h) */
+int joker_udp_sink(void *opaque, const unsigned char *data, int size);
+
+/* send all TS from pool (own reader and thread)
+ * return 0 if success */
+int joker_udp_attach(struct joker_udp_t *udp, struct big_pool_t *pool);
+
+/* get statistics. return 0 if success */
+int joker_udp_get_stats(struct joker_udp_t *udp, struct joker_udp_stats_t *stats);
+
+/* stop threads and close socket
+ * should be called before stop_ts if attached to pool */
+void joker_udp_close(struct joker_udp_t *udp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
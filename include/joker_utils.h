@@ -25,6 +25,17 @@ void msleep_msecs(unsigned int msecs);
 
 void hexdump(unsigned char * buf, int size);
 
+/* apply joker->threads[id] to calling thread and name it
+ * id - JOKER_THREAD_*
+ * return 0 if success */
+int joker_thread_setup(struct joker_t *joker, int id);
+
+/* parse thread params string 'name:policy:priority:nice:cpumask'
+ * name - usb, ts, service, worker. policy - fifo, rr, other
+ * example: usb:fifo:50:0:0x4
+ * return 0 if success */
+int joker_thread_parse(struct joker_t *joker, char *str);
+
 /* put chips into reset state
  * chips selected by mask
  * return 0 if success
@@ -72,7 +83,7 @@ xmemmem(const char *hay, const size_t haysize,
 int joker_clean_ts(struct joker_t *joker);
 
 /* get raw TS and save it to output file
-   reading about 18K at once
+   reading about 18K at once. File written by writer thread with big chunks
    limit amount of bytes to save. 0 for unlimited (call is blocked !).
 
    return saved bytes if success
@@ -0,0 +1,63 @@
+/*
+ * Joker TV
+ * asynchronous file writer
+ *
+ * data copied to big preallocated chunks. Full chunks written to file
+ * by dedicated thread. Producer never touches filesystem
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef _JOKER_WRITER
+#define _JOKER_WRITER	1
+
+// chunk size (one write call)
+#define JOKER_WRITER_CHUNK_SIZE (4*1024*1024)
+// chunks count. 64MB buffered by default
+#define JOKER_WRITER_CHUNKS 16
+
+/* joker_writer_open flags */
+/* producer waits for free chunk if writer is too slow
+ * default: data dropped (for USB completion path) */
+#define JOKER_WRITER_BLOCK	(1 << 0)
+/* bypass page cache (O_DIRECT). Linux only
+ * partially filled chunk written only on close */
+#define JOKER_WRITER_DIRECT	(1 << 1)
+/* preallocate file space ahead (fallocate). Linux only */
+#define JOKER_WRITER_PREALLOC	(1 << 2)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* writer internals "masked" inside */
+struct joker_writer_t;
+
+/* create file and start writer thread
+ * chunk_size, chunks - 0 for defaults
+ * return NULL if failed */
+struct joker_writer_t * joker_writer_open(const char *filename, int flags,
+		int chunk_size, int chunks);
+
+/* queue data for writing. Only one producer thread allowed
+ * never blocks unless JOKER_WRITER_BLOCK set
+ * return 0 if success
+ * return -EAGAIN if no free chunks (rest of data dropped)
+ * return -EIO if writing failed */
+int joker_writer_write(struct joker_writer_t *writer, const void *data, int size);
+
+/* write pending data, stop thread and close file
+ * return bytes written to file or negative error code */
+int64_t joker_writer_close(struct joker_writer_t *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end */
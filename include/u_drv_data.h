@@ -9,8 +9,28 @@
 #define _U_DRV_DATA	1
 
 #include "joker_list.h"
+#ifdef __WIN32__
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
 
 #define NUM_USB_BUFS 16
+// zero-copy mode: transfers lent to TS pipeline are not submitted
+// so use bigger rotation. NUM_USB_BUFS always stay submitted
+#define NUM_USB_BUFS_ZC (4*NUM_USB_BUFS)
+// transfers can be lent in zero-copy mode
+#define NUM_USB_BUFS_LENT (NUM_USB_BUFS_ZC - NUM_USB_BUFS)
+#define NUM_USB_BUFS_MAX (8*NUM_USB_BUFS)
+// adaptive depth limits (submitted transfers). see joker_t usb_bufs_min
+#define USB_BUFS_MIN_DEFAULT 4
+#define USB_BUFS_MAX_DEFAULT (4*NUM_USB_BUFS)
+#define ISOC_PACKETS_MIN_DEFAULT 8
+// USB high speed microframe (usec). one ISOC packet per microframe
+#define USB_MICROFRAME_US 125
 // Linux kernel (drivers/usb/core/devio.c) has limit of 128 iso packets at once
 #define NUM_USB_PACKETS 128
 #define NUM_USB_PACKETS_HIGH_BW_ISOC 128
@@ -20,29 +40,96 @@
 
 #define BIG_POOL_GAIN	16
 
-// Max size (in bytes) for TS storage (list)
+// Max size (in bytes) for TS storage (ring buffer)
 #define TS_LIST_SIZE_DEFAULT 1024*1024*128
 
+// retention overflow policies (ring buffer or zero-copy ready list is full)
+// see big_pool_t overflow_policy
+#define TS_OVERFLOW_DROP_OLDEST	0 /* default. keep newest data (realtime consumers) */
+#define TS_OVERFLOW_DROP_NEWEST	1 /* keep oldest data. incoming data dropped */
+#define TS_OVERFLOW_BLOCK	2 /* TS thread waits for readers, drop oldest on timeout */
+#define TS_OVERFLOW_SPILL	3 /* save overflowed data to file. nothing lost (archival consumers) */
+// TS_OVERFLOW_BLOCK default timeout (msec)
+#define TS_OVERFLOW_TIMEOUT_DEFAULT 100
+
+// Nodes available for record_callback (in flight between USB and TS threads)
+#define TS_NODES_IN_FLIGHT (4*NUM_USB_BUFS)
+
 // Maximum size for TS loopback
 #define TS_LOOP_SIZE 16384
 
+// batch hooks worker threads (see big_pool_t ts_workers)
+#define TS_WORKERS_MAX 16
+// jobs (TS nodes) queued per worker. TS thread waits if all are busy
+#define TS_WORKER_JOBS 8
+
 // hook function
 struct big_pool_t;
 struct program_t;
 typedef void(*ts_hook_t)(void *opaque, unsigned char *pkt);
+// batch hook. 'count' packets of one PID (in stream order)
+typedef void(*ts_batch_hook_t)(void *opaque, unsigned char **pkts, int count);
 typedef void(*service_name_callback_t)(struct program_t *program);
+// return lent transfer to its source
+struct libusb_transfer;
+typedef void(*transfer_release_t)(struct libusb_transfer *transfer);
+// retention overflow. bytes - dropped or spilled (see overflow_policy)
+typedef void(*ts_overflow_callback_t)(void *opaque, int policy, int64_t bytes);
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-struct ts_node {
-	int counter;
+/* piece of TS data (always multiple of TS_SIZE) */
+struct ts_seg {
 	unsigned char * data;
 	int size;
-	int read_off;
-	int pat_replaced;
+};
+
+struct ts_node {
+	int counter;
+	unsigned char * data; /* node own storage */
+	int data_size; /* used bytes in 'data' */
+	int size; /* TS bytes in all segments */
+
+	/* TS data. Segments point to 'data' or to lent USB transfer buffer
+	 * (zero-copy mode). In zero-copy mode only packets straddling
+	 * ISOC packets boundary copied to 'data' */
+	struct ts_seg *segs;
+	int segs_count;
+	struct libusb_transfer *transfer; /* resubmitted when last ref dropped */
+	int refs;
+
+	/* ready list (zero-copy mode) */
 	struct list_head list;
+	int64_t pos; /* stream offset of first byte (see big_pool_t stream_head) */
+
+	/* slab bookkeeping. node and data are preallocated */
+	struct big_pool_t *pool;
+	struct ts_node *next_free;
+};
+
+/* capture path statistics
+ * counters are monotonic (never reset). Updated with atomics
+ * use joker_get_capture_stats() for consistent snapshot */
+struct joker_capture_stats_t {
+	uint64_t transfers; /* completed USB transfers */
+	uint64_t isoc_ok; /* ISOC packets with data */
+	uint64_t isoc_error; /* ISOC packets with error status */
+	uint64_t isoc_empty; /* ISOC packets without data */
+	uint64_t bytes; /* received bytes */
+	uint64_t resyncs; /* TS sync byte search (sync lost) */
+	uint64_t tails_dropped; /* incomplete TS packets dropped */
+	uint64_t nodes_dropped; /* nodes dropped (no free nodes, queue full, readers too slow) */
+	uint64_t bytes_dropped; /* bytes dropped because of memory limit */
+	uint64_t resubmit_errors; /* libusb_submit_transfer failures */
+	uint64_t overflows; /* retention overflows (readers too slow) */
+	uint64_t bytes_spilled; /* bytes saved to spill file (TS_OVERFLOW_SPILL) */
+	uint64_t time; /* snapshot time (usec) */
+
+	/* current values (not counters) */
+	uint64_t usb_bufs; /* transfers kept submitted */
+	uint64_t isoc_packets; /* ISOC packets per transfer */
 };
 
 #define BIG_POOL_MAGIC 0xbb0000aa
@@ -50,43 +137,176 @@ struct ts_node {
 /* threading stuff "masked" inside */
 struct thread_opaq_t;
 
+/* TS reader with own position in retained data "masked" inside */
+struct ts_reader_t;
+
+/* PAT/SDT replacement state "masked" inside */
+struct ts_rewrite_t;
+
+/* PID subscribers table (ts_subscribe) "masked" inside */
+struct ts_subs_t;
+/* batch hooks workers "masked" inside */
+struct ts_workers_t;
+
+/* preallocated ts_node storage "masked" inside */
+struct ts_slab_t;
+
+/* lock-free queue (see joker_queue.h) */
+struct joker_queue_t;
+
+/* asynchronous file writer (see joker_writer.h) */
+struct joker_writer_t;
+
+/* disk backed timeshift buffer (see joker_timeshift.h) */
+struct joker_timeshift_t;
+
+/* shared memory ring for other processes (see joker_shm.h) */
+struct joker_shm_t;
+
+/* MPTS to SPTS demultiplexer (see joker_demux.h) */
+struct joker_demux_t;
+
 /* ring buffer for TS data */
 struct big_pool_t {
+	/* ring buffer holds TS packets ready for read_ts_data
+	 * size is multiple of TS_SIZE so packets never split on wrap
+	 * if mirrored then same memory mapped twice (ptr_end ... ptr_end + size)
+	 * and reads/writes can cross ptr_end without wrapping */
 	unsigned char * ptr;
 	unsigned char * ptr_end;
-	unsigned char * read_ptr;
-	unsigned char * write_ptr;
-	int size;
+	unsigned char * read_ptr; /* stream_tail */
+	unsigned char * write_ptr; /* stream_head */
+	int64_t size;
+	int64_t fill; /* retained bytes (stream_head - stream_tail) */
+	/* stream offsets (bytes since start). Readers keep own offset
+	 * data kept until all readers passed it */
+	int64_t stream_head; /* next byte appended here */
+	int64_t stream_tail; /* oldest retained byte */
+	/* readers (ts_reader_open). protected by mux_all */
+	struct list_head readers;
+	/* read_ts_data reader. Detached if ts_reader_open called before
+	 * first read_ts_data */
+	struct ts_reader_t *reader;
+	int readers_active; /* threads inside read calls. protected by mux_all */
+	int mirrored;
 	int node_counter;
 
-	uint8_t *usb_buffers[NUM_USB_BUFS];
-	struct libusb_transfer *transfers[NUM_USB_BUFS];
+	uint8_t *usb_buffers[NUM_USB_BUFS_MAX];
+	struct libusb_transfer *transfers[NUM_USB_BUFS_MAX];
+	int usb_bufs; /* transfers in rotation */
+
+	/* adaptive USB depth
+	 * controller runs in USB events thread (see usb_adapt) */
+	int usb_target; /* transfers to keep submitted */
+	/* transfers submitted now. protected by mux_usb
+	 * only these cancelled by stop_ts (idle and lent are not in flight) */
+	struct libusb_transfer *usb_flying[NUM_USB_BUFS_MAX];
+	int usb_inflight;
+	int usb_stop; /* stop_ts called. no new transfers. protected by mux_usb */
+	int isoc_packets; /* ISOC packets per transfer for next submit */
+	int isoc_packets_max; /* ISOC packets allocated in every transfer */
+	/* transfers not submitted because depth reduced */
+	struct libusb_transfer *usb_idle[NUM_USB_BUFS_MAX];
+	int usb_idle_count;
+	/* controller window */
+	uint64_t adapt_time;
+	uint64_t adapt_completion; /* last completion time */
+	uint64_t adapt_max_interval; /* max time between completions */
+	uint64_t adapt_callback_us; /* callbacks duration */
+	int adapt_callbacks;
+	int adapt_quiet; /* windows without problems */
+	struct joker_capture_stats_t adapt_last;
+
+	/* lend USB transfer buffers to TS pipeline instead of copy
+	 * should be set before start_ts */
+	int zero_copy;
+	/* nodes ready for read_ts_data (zero-copy mode) */
+	struct list_head ready_list;
+	int ready_count;
+	/* return lent transfer to non USB source (replay)
+	 * NULL - resubmit to libusb */
+	transfer_release_t transfer_release;
+
+	/* retention overflow (readers too slow)
+	 * should be set before start_ts. see TS_OVERFLOW_* */
+	int overflow_policy;
+	int overflow_timeout_ms; /* TS_OVERFLOW_BLOCK. 0 - default */
+	char *overflow_spill_filename; /* TS_OVERFLOW_SPILL. NULL - temporary file */
+	/* called from TS thread on every overflow */
+	ts_overflow_callback_t overflow_callback;
+	void *overflow_opaque; /* NULL - pool */
+	/* spill file continues ring buffer (or ready list): it holds stream
+	 * data from 'stream_head'. Reused when all readers got it.
+	 * Offsets protected by mux_all */
+	FILE *spill_file;
+	int64_t spill_write_off; /* reserved by TS thread */
+	int64_t spill_ready_off; /* written and ready for reading */
+	int space_waiters; /* TS thread waits for free space (TS_OVERFLOW_BLOCK) */
+
+	/* source (replay) has no more data */
+	int source_done;
+	/* all data processed. read_ts_data returns what's left */
+	int eof;
 
 	/* threading stuff "masked" inside */
 	struct thread_opaq_t *threading;
 
-	/* hooks */
-	ts_hook_t hooks[8192];
-	void * hooks_opaque[8192];
+	/* preallocated nodes for ISOC completion path */
+	struct ts_slab_t *slab;
+
+	/* PID subscribers (ts_subscribe). bit set if PID has subscribers
+	 * TS thread checks bitmap before subscribers table */
+	uint64_t subs_bitmap[8192 / 64];
+	struct ts_subs_t *subs;
+
+	/* batch hooks (ts_subscribe_batch) called from 'ts_workers' threads
+	 * instead of TS thread. PIDs sharded by hash, PID order kept
+	 * 0 - no workers. Set before start_ts, up to TS_WORKERS_MAX */
+	int ts_workers;
+	struct ts_workers_t *workers;
 
 	/* statistics */
-	int calls_count;
-	int pkt_count;
-	int pkt_count_complete;
-	int bytes;
-	uint64_t start_time;
+	struct joker_capture_stats_t stats;
+	/* console output (every 2 sec) */
+	struct joker_capture_stats_t stats_last;
+	int stats_quiet; /* do not print statistics to stdout */
+
+	/* nodes from record_callback to process_ts (lock-free) */
+	struct joker_queue_t *ts_queue;
+
+	/* raw USB data writer (see joker_t raw_data_filename) */
+	struct joker_writer_t *raw_writer;
+
+	/* all processed TS also appended to timeshift file (if set)
+	 * should be set before start_ts. 0 - defaults
+	 * readers use joker_timeshift_* API with 'timeshift' */
+	char *timeshift_filename;
+	int64_t timeshift_size;
+	int timeshift_interval; /* TS packets between index entries */
+	struct joker_timeshift_t *timeshift;
+
+	/* all processed TS also published to shared memory '/shm_name'
+	 * (if set). should be set before start_ts. 0 - default size */
+	char *shm_name;
+	int64_t shm_size;
+	struct joker_shm_t *shm;
+
+	/* split TS to single program streams in TS thread
+	 * set by joker_demux_start. Several demuxes chained */
+	struct joker_demux_t *demux;
+	/* nodes processed by TS thread (subscribers, demux). See ts_wait_node */
+	uint64_t ts_started;
+	uint64_t ts_finished;
 
 	/* TS list */
-	struct list_head ts_list;
-	struct list_head ts_list_all;
 	int tail_size;
 	unsigned char tail[TS_SIZE];
 	int cancel;
-	int ts_list_size;
-	int ts_list_size_max;
+	int ts_list_size_max; /* ring buffer size (bytes) */
 
 	/* PSI related stuff */
 	struct list_head selected_programs_list;
+	/* filled by PSI parser in TS thread. No lock (see get_programs) */
 	struct list_head programs_list;
 	service_name_callback_t service_name_callback;
 	void *pat_dvbpsi;
@@ -95,6 +315,8 @@ struct big_pool_t {
 	void *sdt_dvbpsi;
 	char *generated_pat;
 	char *generated_pat_pkt;
+	/* PAT/SDT replacement prepared for TS thread */
+	struct ts_rewrite_t *rewrite;
 	uint8_t pat_counter;
 	struct list_head ca_list; // another CA list inside each program
 	void *stored_sdt;
@@ -119,14 +341,46 @@ struct big_pool_t {
 /* init pool */
 int pool_init(struct joker_t *joker, struct big_pool_t * pool);
 
+/* free pool resources (nodes, ring buffer)
+ * opened readers detached: their calls return no data, borrowed data
+ * is released. ts_reader_close still required */
+int pool_uninit(struct big_pool_t * pool);
+
 /* start TS processing thread 
  */
 int start_ts(struct joker_t *joker, struct big_pool_t *pool);
 
-/* stop ts processing */
+/* stop ts processing (calls pool_uninit) */
 int stop_ts(struct joker_t *joker, struct big_pool_t * pool);
 
 int next_ts_off(unsigned char *buf, size_t size);
+
+/* TS pipeline without USB part (nodes, ring buffer, TS thread)
+ * used by start_ts and by offline sources (replay) */
+int ts_pipeline_start(struct joker_t *joker, struct big_pool_t *pool);
+/* source finished. readers get eof when all data processed */
+void ts_pipeline_eof(struct big_pool_t *pool);
+void ts_pipeline_stop(struct big_pool_t *pool);
+
+/* capture core: split completed ISOC transfer to TS packets
+ * and pass it to TS processing thread
+ * return 1 if transfer lent to pipeline (zero-copy mode). It will be
+ * returned later (see transfer_release)
+ * return 0 if transfer can be reused immediately */
+int ts_capture_transfer(struct big_pool_t *pool, struct libusb_transfer *transfer);
+
+/* get capture path statistics snapshot
+ * return 0 if success */
+int joker_get_capture_stats(struct joker_t *joker, struct joker_capture_stats_t *stats);
+
+/* wait till TS thread finish node it is processing now (if any)
+ * call after removing subscriber or demux from TS thread tables */
+void ts_wait_node(struct big_pool_t *pool);
+
+/* take reference to node */
+void ts_node_get(struct ts_node * node);
+/* drop reference. Last reference returns node to the slab
+ * and lent USB transfer (if any) back to libusb */
 void drop_ts_data(struct ts_node * node);
 
 /* read TS data
@@ -138,6 +392,82 @@ void drop_ts_data(struct ts_node * node);
  * no data available) */
 int read_ts_data(struct big_pool_t *pool, unsigned char *data, int size);
 
+/* read TS data. wait for new data without polling
+ * return when at least min_bytes copied, timeout_ms expired
+ * (-1 - wait forever), end of data or TS processing stopped (stop_ts)
+ * return - copied bytes (partial data after timeout, zero if nothing) */
+int read_ts_data_timeout(struct big_pool_t *pool, unsigned char *data, int size,
+		int min_bytes, int timeout_ms);
+
+/* open additional reader. Every reader gets all TS data
+ * from_oldest - 1: start from oldest retained data, 0: from new data
+ * pool should be started (start_ts)
+ * return NULL if failed */
+struct ts_reader_t * ts_reader_open(struct big_pool_t *pool, int from_oldest);
+
+/* same as read_ts_data but reader's own position used
+ * return -EBUSY if borrowed data not released (ts_reader_borrow) */
+int ts_reader_read(struct ts_reader_t *reader, unsigned char *data, int size);
+int ts_reader_read_timeout(struct ts_reader_t *reader, unsigned char *data, int size,
+		int min_bytes, int timeout_ms);
+
+/* interrupt blocking calls of this reader (read, borrow) from other
+ * thread. Calls do not wait for data after this (reader to be closed) */
+void ts_reader_wakeup(struct ts_reader_t *reader);
+
+/* bytes skipped by reader because retained data overflowed */
+int64_t ts_reader_dropped(struct ts_reader_t *reader);
+
+/* borrow TS data without copy (writev, sendmsg, vmsplice directly
+ * from capture buffers)
+ * iov filled with pointers to retained data (ring buffer or lent USB
+ * transfers). Whole TS packets if reader position is packet aligned
+ * spilled data (TS_OVERFLOW_SPILL) copied to reader's own buffer
+ * data stays valid until ts_reader_release. Overflow never overwrites it
+ * (new data dropped instead), so release as soon as possible
+ * size - maximum bytes to borrow. At least TS_SIZE
+ * waits for data like ts_reader_read
+ * return iovecs filled (zero if end of data, TS processing stopped or
+ * ts_reader_wakeup called)
+ * return -EBUSY if previous data not released */
+int ts_reader_borrow(struct ts_reader_t *reader, struct iovec *iov, int iovcnt, int size);
+
+/* same as ts_reader_borrow but waits timeout_ms at most (-1 - forever)
+ * return zero if no data during timeout */
+int ts_reader_borrow_timeout(struct ts_reader_t *reader, struct iovec *iov, int iovcnt,
+		int size, int timeout_ms);
+
+/* give borrowed data back. return 0 if success */
+int ts_reader_release(struct ts_reader_t *reader);
+
+/* same as ts_reader_borrow/ts_reader_release for read_ts_data reader */
+int ts_read_borrow(struct big_pool_t *pool, struct iovec *iov, int iovcnt, int size);
+int ts_read_release(struct big_pool_t *pool);
+
+/* close reader. Can be called after stop_ts (pool_uninit) as well */
+void ts_reader_close(struct ts_reader_t *reader);
+
+/* call 'hook' for every TS packet of 'pid' (from TS thread)
+ * several subscribers per PID allowed. Can be called while TS processing
+ * running (also from hook). pool should be started (start_ts)
+ * return 0 if success
+ * return -EEXIST if same hook and opaque already subscribed */
+int ts_subscribe(struct big_pool_t *pool, int pid, ts_hook_t hook, void *opaque);
+
+/* remove subscriber. Hook is not called after return (unless
+ * ts_unsubscribe called from hook itself)
+ * return 0 if success, -ENOENT if not subscribed */
+int ts_unsubscribe(struct big_pool_t *pool, int pid, ts_hook_t hook, void *opaque);
+
+/* same as ts_subscribe but 'hook' called once per TS node with all
+ * packets of 'pid' from it. Less overhead for payload processing
+ * called after node processed: PAT/SDT already replaced if
+ * generated_pat_pkt set
+ * called from worker thread if ts_workers set (packets are copies).
+ * Hooks of different PIDs can run in parallel then */
+int ts_subscribe_batch(struct big_pool_t *pool, int pid, ts_batch_hook_t hook, void *opaque);
+int ts_unsubscribe_batch(struct big_pool_t *pool, int pid, ts_batch_hook_t hook, void *opaque);
+
 /* start TS loop thread 
  * loop TS traffic
  * send to Joker TV over USB (EP4 OUT, bulk)
@@ -40,6 +40,10 @@
 #include "u_drv_tune.h"
 #include "u_drv_data.h"
 #include "joker_blind_scan.h"
+#include "joker_replay.h"
+#include "joker_demux.h"
+#include "joker_udp.h"
+#include "joker_http.h"
 
 // status & statistics callback
 // will be called periodically after 'tune' call
@@ -92,6 +96,19 @@ void service_name_update(struct program_t *program)
 
 }
 
+// this callback will be called when TS reader is too slow
+void overflow_callback(void *opaque, int policy, int64_t bytes)
+{
+	static uint64_t last = 0;
+
+	// spilled data is not lost
+	if (policy == TS_OVERFLOW_SPILL || getus() - last < 1000000)
+		return;
+	last = getus();
+	printf("callback:%s TS reader too slow. %lld bytes dropped\n",
+			__func__, (long long)bytes);
+}
+
 static const int convert2xml_pol[] = { 18, 13 };
 
 // blind scan callback
@@ -280,6 +297,11 @@ void show_help() {
 	printf("	-k filename.ts	Send TS traffic to Joker TV. TS will return back (loop) Default: none\n");
 	printf("	-r		Send QUERY CA PMT to CAM (check is descrambling possible). Default: disabled\n");
 	printf("	--program num	Save only selected programs (not full TS). Example: --program 1 --program 2\n");
+	printf("	--spts num:file	Save program to own file as single program TS. Example: --spts 1:one.ts --spts 2:two.ts\n");
+	printf("			file can be udp://addr:port or rtp://addr:port. Example: --spts 1:udp://239.0.0.1:1234\n");
+	printf("	--stream url	Send TS to network. Example: --stream rtp://239.0.0.1:1234 \n");
+	printf("	--http [addr:]port	HTTP server. Serves /mux.ts and /program/<num>.ts Example: --http 8080\n");
+	printf("	--shm name	Publish TS to shared memory for other processes (see joker_shm_client.h). Example: --shm jokertv\n");
 	printf("	--in in.xml	XML file with lock instructions. Example: --in ./docs/atsc_north_america_freq.xml \n");
 	printf("	--out out.csv	output CSV file with lock results (BER, etc). Example: --out ant1-result.csv \n");
 	printf("	--blind		Do blind scan (DVB-S/S2 only). Default: disabled\n");
@@ -291,6 +313,15 @@ void show_help() {
 	printf("	--blind-sr-coeff coeff	Symbol rate correction coefficient. Default: %.11f\n", SR_DEFAULT_COEFF);
 	printf("	--diseqc diseqc.txt	File with Diseqc commands. One command per line. Scripting supported.\n");
 	printf("	--raw-data raw.bin	output raw data received from USB\n");
+	printf("	--zero-copy	Do not copy TS from USB buffers (lend buffers to TS processing). Default: disabled\n");
+	printf("	--overflow policy[:arg]	What to do if TS reader is too slow. drop-oldest, drop-newest, block:timeout_ms, spill:file. Default: drop-oldest\n");
+	printf("	--quiet-stats	Do not print USB ISOC statistics. Default: print every 2 seconds\n");
+	printf("	--thread name:policy:prio:nice:cpumask	Thread scheduling. name: usb, ts, service, worker. policy: fifo, rr, other. Example: --thread usb:fifo:50:0:0x4\n");
+	printf("	--replay raw.bin	Replay raw USB data (saved with --raw-data) without hardware. TS saved to -o file\n");
+	printf("	--replay-speed N	Replay speed. 1 - original rate (PCR), N - N times faster, 0 - as fast as possible. Default: 1\n");
+	printf("	--replay-packet-size min:max	ISOC packet size (random between min and max). Default: 1024\n");
+	printf("	--replay-loss ppm:burst	Lost ISOC packets per million and packets lost in row. Example: --replay-loss 100:3\n");
+	printf("	--replay-loop	Replay file in loop\n");
 	printf("	--cam-pcap cam.pcap	dump all CAM interaction to file. Use Wireshark to parse this file.\n");
 	printf("	--list  List available USB devices\n");
 	printf("	--device id   Use specified USB device\n");
@@ -302,6 +333,10 @@ static struct option long_options[] = {
 	{"out",  required_argument, 0, 0},
 	{"blind",  no_argument, 0, 0},
 	{"program",  required_argument, 0, 0},
+	{"spts",  required_argument, 0, 0},
+	{"stream",  required_argument, 0, 0},
+	{"http",  required_argument, 0, 0},
+	{"shm",  required_argument, 0, 0},
 	{"diseqc",  required_argument, 0, 0},
 	{"blind-out",  required_argument, 0, 0},
 	{"blind-sr-coeff",  required_argument, 0, 0},
@@ -310,12 +345,68 @@ static struct option long_options[] = {
 	{"blind-save-ts-size",  required_argument, 0, 0},
 	{"blind-programs",  required_argument, 0, 0},
 	{"raw-data",  required_argument, 0, 0},
+	{"zero-copy",  no_argument, 0, 0},
+	{"overflow",  required_argument, 0, 0},
+	{"quiet-stats",  no_argument, 0, 0},
+	{"thread",  required_argument, 0, 0},
+	{"replay",  required_argument, 0, 0},
+	{"replay-speed",  required_argument, 0, 0},
+	{"replay-packet-size",  required_argument, 0, 0},
+	{"replay-loss",  required_argument, 0, 0},
+	{"replay-loop",  no_argument, 0, 0},
 	{"cam-pcap",  required_argument, 0, 0},
 	{"list",  no_argument, 0, 0},
 	{"device",  required_argument, 0, 0},
 	{ 0, 0, 0, 0}
 };
 
+// add program to selected programs list
+// PIDs of this program allowed in TS PID filtering
+static int select_program(struct joker_t *joker, struct big_pool_t *pool, int number)
+{
+	struct program_t *program = NULL;
+
+	printf("selected program %d \n", number);
+
+	program = (struct program_t*)malloc(sizeof(*program));
+	if (!program)
+		return -ENOMEM;
+
+	program->joker = joker;
+	memset(&program->name, 0, SERVICE_NAME_LEN);
+	program->number = number;
+	list_add_tail(&program->list, &pool->selected_programs_list);
+
+	return 0;
+}
+
+// open network output from url (udp://addr:port or rtp://addr:port)
+// return NULL if url is not network
+static struct joker_udp_t * open_url(char *url)
+{
+	char *addr = NULL, *port = NULL;
+	int flags = 0;
+
+	if (!strncasecmp(url, "rtp://", 6))
+		flags |= JOKER_UDP_RTP;
+	else if (strncasecmp(url, "udp://", 6))
+		return NULL;
+
+	addr = url + 6;
+	port = strrchr(addr, ':');
+	if (!port)
+		return NULL;
+	*port++ = '\0';
+
+	// IPv6 address in brackets
+	if (addr[0] == '[' && addr[strlen(addr) - 1] == ']') {
+		addr[strlen(addr) - 1] = '\0';
+		addr++;
+	}
+
+	return joker_udp_open(addr, atoi(port), flags, -1);
+}
+
 int main (int argc, char **argv)
 {
 	struct tune_info_t info;
@@ -352,6 +443,14 @@ int main (int argc, char **argv)
 	struct tm *t = localtime(&now);
 	char * diseqc = NULL, *pt = NULL;
 	int diseqc_len = 0;
+	struct joker_replay_t replay;
+	struct joker_demux_t *demux = NULL;
+	struct joker_udp_t *stream = NULL;
+	struct joker_udp_t *spts_udp[JOKER_DEMUX_OUTPUTS_MAX];
+	int spts_udp_count = 0;
+	struct joker_http_t *http = NULL;
+	char *http_addr = NULL;
+	int http_port = 0;
 
 	strftime(datetime, sizeof(datetime)-1, "%d %b %Y %H:%M", t);
 
@@ -367,6 +466,9 @@ int main (int argc, char **argv)
 	memset(in_buf, 0, JCMD_BUF_LEN);
 	memset(buf, 0, JCMD_BUF_LEN);
 	memset(&pool, 0, sizeof(struct big_pool_t));
+	pool.overflow_callback = &overflow_callback;
+	memset(&replay, 0, sizeof(struct joker_replay_t));
+	replay.speed = 1;
 
 	// set callbacks
 	pool.service_name_callback = &service_name_update;
@@ -399,16 +501,46 @@ int main (int argc, char **argv)
 					strncpy(joker->csv_out_filename, optarg, len);
 				}
 				if (!strcasecmp(long_options[option_index].name, "program")) {
-					printf("selected program %d \n", atoi(optarg));
-
-					program = (struct program_t*)malloc(sizeof(*program));
-					if (!program)
+					if (select_program(joker, &pool, atoi(optarg)))
 						return -ENOMEM;
-
-					program->joker = joker;
-					memset(&program->name, 0, SERVICE_NAME_LEN);
-					program->number = atoi(optarg);
-					list_add_tail(&program->list, &pool.selected_programs_list);
+				}
+				if (!strcasecmp(long_options[option_index].name, "spts")) {
+					pt = strtok (optarg,":");
+					i = pt ? atoi(pt) : 0;
+					pt = strtok (NULL, "");
+					if (!pt) {
+						show_help();
+						return -1;
+					}
+					if (!demux && !(demux = joker_demux_alloc(&pool)))
+						return -ENOMEM;
+					if (strstr(pt, "://") && spts_udp_count < JOKER_DEMUX_OUTPUTS_MAX) {
+						if (!(spts_udp[spts_udp_count] = open_url(pt)) ||
+								joker_demux_add_program(demux, i, joker_udp_sink,
+									spts_udp[spts_udp_count++]))
+							return -1;
+					} else if (joker_demux_add_file(demux, i, pt)) {
+						return -1;
+					}
+					if (select_program(joker, &pool, i))
+						return -1;
+				}
+				if (!strcasecmp(long_options[option_index].name, "http")) {
+					pt = strrchr(optarg, ':');
+					if (pt) {
+						*pt++ = '\0';
+						http_addr = optarg;
+					}
+					http_port = atoi(pt ? pt : optarg);
+				}
+				if (!strcasecmp(long_options[option_index].name, "shm")) {
+					pool.shm_name = optarg;
+				}
+				if (!strcasecmp(long_options[option_index].name, "stream")) {
+					if (!(stream = open_url(optarg))) {
+						show_help();
+						return -1;
+					}
 				}
 				if (!strcasecmp(long_options[option_index].name, "blind")) {
 					joker->blind_scan = 1;
@@ -472,6 +604,68 @@ int main (int argc, char **argv)
 					joker->raw_data_filename = (char*)calloc(1, len + 1);
 					strncpy(joker->raw_data_filename, optarg, len);
 				}
+				if (!strcasecmp(long_options[option_index].name, "zero-copy")) {
+					pool.zero_copy = 1;
+				}
+				if (!strcasecmp(long_options[option_index].name, "overflow")) {
+					pt = strtok (optarg,":");
+					if (pt != NULL && !strcasecmp(pt, "drop-oldest")) {
+						pool.overflow_policy = TS_OVERFLOW_DROP_OLDEST;
+					} else if (pt != NULL && !strcasecmp(pt, "drop-newest")) {
+						pool.overflow_policy = TS_OVERFLOW_DROP_NEWEST;
+					} else if (pt != NULL && !strcasecmp(pt, "block")) {
+						pool.overflow_policy = TS_OVERFLOW_BLOCK;
+						pt = strtok (NULL, ":");
+						if (pt != NULL)
+							pool.overflow_timeout_ms = atoi(pt);
+					} else if (pt != NULL && !strcasecmp(pt, "spill")) {
+						pool.overflow_policy = TS_OVERFLOW_SPILL;
+						pt = strtok (NULL, "");
+						if (pt != NULL)
+							pool.overflow_spill_filename = strdup(pt);
+					} else {
+						show_help();
+						return -1;
+					}
+				}
+				if (!strcasecmp(long_options[option_index].name, "quiet-stats")) {
+					pool.stats_quiet = 1;
+				}
+				if (!strcasecmp(long_options[option_index].name, "thread")) {
+					if (joker_thread_parse(joker, optarg)) {
+						show_help();
+						return -1;
+					}
+				}
+				if (!strcasecmp(long_options[option_index].name, "replay")) {
+					len = strlen(optarg);
+					replay.filename = (char*)calloc(1, len + 1);
+					strncpy(replay.filename, optarg, len);
+				}
+				if (!strcasecmp(long_options[option_index].name, "replay-speed")) {
+					replay.speed = atof(optarg);
+				}
+				if (!strcasecmp(long_options[option_index].name, "replay-packet-size")) {
+					pt = strtok (optarg,":");
+					if (pt != NULL) {
+						replay.packet_size = atoi(pt);
+						pt = strtok (NULL, ":");
+						if (pt != NULL)
+							replay.packet_size_max = atoi(pt);
+					}
+				}
+				if (!strcasecmp(long_options[option_index].name, "replay-loss")) {
+					pt = strtok (optarg,":");
+					if (pt != NULL) {
+						replay.loss_ppm = atoi(pt);
+						pt = strtok (NULL, ":");
+						if (pt != NULL)
+							replay.loss_burst = atoi(pt);
+					}
+				}
+				if (!strcasecmp(long_options[option_index].name, "replay-loop")) {
+					replay.loop = 1;
+				}
 				if (!strcasecmp(long_options[option_index].name, "cam-pcap")) {
 					len = strlen(optarg);
 					joker->cam_pcap_filename = (char*)calloc(1, len + 1);
@@ -568,6 +762,37 @@ int main (int argc, char **argv)
 		}
 	}
 
+	/* replay raw USB data. no hardware required */
+	if (replay.filename) {
+		if ((ret = start_replay(joker, &pool, &replay))) {
+			printf("start_replay failed. err=%d \n", ret);
+			return ret;
+		}
+
+		if (decode_program || http_port || !list_empty(&pool.selected_programs_list)) {
+			printf("Trying to get programs list ... \n");
+			programs = get_programs(&pool);
+			list_for_each_entry_safe(program, tmp, programs, list)
+				printf("Program number=%d \n", program->number);
+		}
+		joker_demux_start(demux);
+		if (stream)
+			joker_udp_attach(stream, &pool);
+		if (http_port)
+			http = joker_http_start(&pool, http_addr, http_port);
+
+		total_len = save_ts(joker, filename, limit);
+		printf("saved %lld bytes. Stopping replay ... \n", (long long)total_len);
+		joker_http_stop(http);
+		joker_udp_close(stream);
+		stop_replay(&replay);
+		joker_demux_free(demux);
+		for (i = 0; i < spts_udp_count; i++)
+			joker_udp_close(spts_udp[i]);
+		free(joker);
+		return 0;
+	}
+
 	// just show help message if nothing selected by user
 	if (delsys == JOKER_SYS_UNDEFINED && !tsgen &&
 			!joker->loop_ts_filename && !joker->ci_enable &&
@@ -706,9 +931,6 @@ int main (int argc, char **argv)
 	while(disable_data)
 		sleep(3600);
 
-	if (joker->raw_data_filename)
-		joker->raw_data_filename_fd = fopen(joker->raw_data_filename, "w+");
-
 	/* start TS collection */
 	if((ret = start_ts(joker, &pool))) {
 		printf("start_ts failed. err=%d \n", ret);
@@ -720,7 +942,7 @@ int main (int argc, char **argv)
 		start_ts_loop(joker);
 	}
 
-	if (decode_program || descramble_programs || 
+	if (decode_program || descramble_programs || http_port ||
 			!list_empty(&pool.selected_programs_list)) {
 		/* get TV programs list */
 		printf("Trying to get programs list ... \n");
@@ -728,10 +950,20 @@ int main (int argc, char **argv)
 		list_for_each_entry_safe(program, tmp, programs, list)
 			printf("Program number=%d \n", program->number);
 	}
+	joker_demux_start(demux);
+	if (stream)
+		joker_udp_attach(stream, &pool);
+	if (http_port)
+		http = joker_http_start(&pool, http_addr, http_port);
 
 	total_len = save_ts(joker, filename, limit);
 	printf("saved %lld bytes. Stopping TS ... \n", (long long)total_len);
+	joker_http_stop(http);
+	joker_udp_close(stream);
 	stop_ts(joker, &pool);
+	joker_demux_free(demux);
+	for (i = 0; i < spts_udp_count; i++)
+		joker_udp_close(spts_udp[i]);
 
 	printf("Closing device ... \n");
 	joker_close(joker);
@@ -0,0 +1,278 @@
+/*
+ * Joker TV
+ * MPTS to SPTS demultiplexer
+ *
+ * PID routing table (bitmask of outputs for every PID) rebuilt from
+ * programs list on every PAT. PSI parser hooks are per-packet
+ * (ts_subscribe) and run in TS thread as well, so programs list
+ * can be used without locks. Batch hooks can run in worker threads,
+ * PSI parser should not be moved to them
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <joker_tv.h>
+#include <joker_ts.h>
+#include <joker_utils.h>
+#include <joker_writer.h>
+#include <joker_demux.h>
+#include <u_drv_data.h>
+
+struct demux_output_t
+{
+	int number; /* program number */
+	int pmt_pid; /* -1 if program not found yet */
+	joker_demux_sink_t sink;
+	void *opaque;
+	struct joker_writer_t *writer; /* joker_demux_add_file */
+
+	/* own PAT. Continuity counter updated on every copy */
+	unsigned char pat[TS_SIZE];
+	uint8_t pat_cc;
+
+	/* packets collected for sink */
+	unsigned char *buf;
+	int len;
+	int64_t errors; /* sink failures */
+};
+
+struct joker_demux_t
+{
+	struct big_pool_t *pool;
+	struct demux_output_t outputs[JOKER_DEMUX_OUTPUTS_MAX];
+	int count;
+	uint32_t pat_mask; /* outputs with PAT ready */
+	uint32_t route[8192]; /* outputs for every PID */
+	int started;
+	struct joker_demux_t *next; /* next demux attached to pool */
+};
+
+static void demux_send(struct demux_output_t *out)
+{
+	if (!out->len)
+		return;
+
+	if (out->sink(out->opaque, out->buf, out->len))
+		out->errors++;
+	out->len = 0;
+}
+
+static void demux_put(struct demux_output_t *out, const unsigned char *pkt)
+{
+	memcpy(out->buf + out->len, pkt, TS_SIZE);
+	out->len += TS_SIZE;
+	if (out->len == JOKER_DEMUX_BATCH * TS_SIZE)
+		demux_send(out);
+}
+
+static void demux_route(struct joker_demux_t *demux, int pid, int index)
+{
+	if (pid >= 0 && pid < 8192)
+		demux->route[pid] |= 1U << index;
+}
+
+/* rebuild routing table from PSI parser results */
+static void demux_update(struct joker_demux_t *demux)
+{
+	struct demux_output_t *out = NULL;
+	struct program_t *program = NULL;
+	struct program_es_t *es = NULL;
+	struct program_ca_t *ca = NULL;
+	int i = 0;
+
+	memset(demux->route, 0, sizeof(demux->route));
+
+	for (i = 0; i < demux->count; i++) {
+		out = &demux->outputs[i];
+		list_for_each_entry(program, &demux->pool->programs_list, list) {
+			if (program->number != out->number)
+				continue;
+
+			if (out->pmt_pid != program->pmt_pid &&
+					!generate_spts_pat_pkt(demux->pool->ts_id, program->number,
+						program->pmt_pid, out->pat)) {
+				out->pmt_pid = program->pmt_pid;
+				demux->pat_mask |= 1U << i;
+			}
+
+			demux_route(demux, program->pmt_pid, i);
+			demux_route(demux, program->pcr_pid, i);
+			list_for_each_entry(es, &program->es_list, list)
+				demux_route(demux, es->pid, i);
+			list_for_each_entry(ca, &program->ca_list, list)
+				demux_route(demux, ca->pid, i);
+			break;
+		}
+	}
+	// PAT generated for every output
+	demux->route[0] = 0;
+}
+
+static void demux_packet(struct joker_demux_t *demux, unsigned char *pkt, int pid)
+{
+	struct demux_output_t *out = NULL;
+	uint32_t mask = 0;
+	int i = 0;
+
+	if (pid == 0x0 /* PAT */) {
+		// programs could be changed since last PAT
+		demux_update(demux);
+
+		// replace to own PAT
+		for (mask = demux->pat_mask; mask; mask &= mask - 1) {
+			out = &demux->outputs[__builtin_ctz(mask)];
+			out->pat[3] = (out->pat[3] & 0xf0) | (out->pat_cc++ & 0x0f);
+			demux_put(out, out->pat);
+		}
+		return;
+	}
+
+	for (mask = demux->route[pid]; mask; mask &= mask - 1) {
+		i = __builtin_ctz(mask);
+		demux_put(&demux->outputs[i], pkt);
+	}
+}
+
+void joker_demux_packet(struct joker_demux_t *demux, unsigned char *pkt, int pid)
+{
+	for (; demux; demux = __atomic_load_n(&demux->next, __ATOMIC_ACQUIRE))
+		demux_packet(demux, pkt, pid);
+}
+
+void joker_demux_flush(struct joker_demux_t *demux)
+{
+	int i = 0;
+
+	for (; demux; demux = __atomic_load_n(&demux->next, __ATOMIC_ACQUIRE))
+		for (i = 0; i < demux->count; i++)
+			demux_send(&demux->outputs[i]);
+}
+
+struct joker_demux_t * joker_demux_alloc(struct big_pool_t *pool)
+{
+	struct joker_demux_t *demux = NULL;
+
+	if (!pool)
+		return NULL;
+
+	demux = calloc(1, sizeof(*demux));
+	if (!demux)
+		return NULL;
+	demux->pool = pool;
+
+	return demux;
+}
+
+int joker_demux_add_program(struct joker_demux_t *demux, int program_number,
+		joker_demux_sink_t sink, void *opaque)
+{
+	struct demux_output_t *out = NULL;
+
+	if (!demux || !sink || demux->started)
+		return -EINVAL;
+
+	if (demux->count >= JOKER_DEMUX_OUTPUTS_MAX)
+		return -ENOSPC;
+
+	out = &demux->outputs[demux->count];
+	memset(out, 0, sizeof(*out));
+	out->buf = malloc(JOKER_DEMUX_BATCH * TS_SIZE);
+	if (!out->buf)
+		return -ENOMEM;
+	out->number = program_number;
+	out->pmt_pid = -1;
+	out->sink = sink;
+	out->opaque = opaque;
+	demux->count++;
+
+	return 0;
+}
+
+static int demux_file_sink(void *opaque, const unsigned char *data, int size)
+{
+	// never blocks. data dropped if disk is too slow
+	return joker_writer_write((struct joker_writer_t *)opaque, data, size);
+}
+
+int joker_demux_add_file(struct joker_demux_t *demux, int program_number,
+		const char *filename)
+{
+	struct joker_writer_t *writer = NULL;
+	int ret = 0;
+
+	if (!demux || !filename)
+		return -EINVAL;
+
+	writer = joker_writer_open(filename, 0, 0, 0);
+	if (!writer)
+		return -EIO;
+
+	if ((ret = joker_demux_add_program(demux, program_number, demux_file_sink, writer))) {
+		joker_writer_close(writer);
+		return ret;
+	}
+	demux->outputs[demux->count - 1].writer = writer;
+	printf("Program %d SPTS outfile:%s \n", program_number, filename);
+
+	return 0;
+}
+
+int joker_demux_start(struct joker_demux_t *demux)
+{
+	if (!demux || !demux->count || demux->started)
+		return -EINVAL;
+
+	// TS thread picks it up on next node
+	demux->next = demux->pool->demux;
+	__atomic_store_n(&demux->pool->demux, demux, __ATOMIC_SEQ_CST);
+	demux->started = 1;
+
+	return 0;
+}
+
+/* remove from pool chain. TS thread could use demux until current
+ * node processed */
+static void demux_detach(struct joker_demux_t *demux)
+{
+	struct big_pool_t *pool = demux->pool;
+	struct joker_demux_t **prev = &pool->demux;
+
+	while (*prev && *prev != demux)
+		prev = &(*prev)->next;
+	if (*prev)
+		__atomic_store_n(prev, demux->next, __ATOMIC_SEQ_CST);
+
+	ts_wait_node(pool);
+}
+
+void joker_demux_free(struct joker_demux_t *demux)
+{
+	struct demux_output_t *out = NULL;
+	int i = 0;
+
+	if (!demux)
+		return;
+
+	if (demux->started)
+		demux_detach(demux);
+
+	for (i = 0; i < demux->count; i++) {
+		out = &demux->outputs[i];
+		demux_send(out);
+		if (out->errors)
+			printf("%s: program %d. %lld batches not delivered \n",
+					__func__, out->number, (long long)out->errors);
+		if (out->writer)
+			joker_writer_close(out->writer);
+		free(out->buf);
+	}
+	free(demux);
+}
@@ -42,13 +42,15 @@ int joker_open(struct joker_t *joker)
 	if (!joker)
 		return EINVAL;
 
-	ret = libusb_init(NULL);
+	// own context for every device. Devices do not share
+	// libusb events processing
+	ret = libusb_init(&ctx);
 	if (ret < 0) {
 		fprintf(stderr, "libusb_init failed\n");
 		return ENODEV;
 	}
 
-	libusb_set_debug(NULL, joker->libusb_verbose);
+	libusb_set_debug(ctx, joker->libusb_verbose);
 
 	usb_devs = libusb_get_device_list(ctx, &usb_list);
 	for(i = 0 ; i < usb_devs ; ++i) {
@@ -79,8 +81,10 @@ int joker_open(struct joker_t *joker)
 			break; // open first available Joker TV
 		}
 	}
+	libusb_free_device_list(usb_list, 1); // opened device still referenced
 	if (devh <= 0) {
 		fprintf(stderr, "usb device not found\n");
+		libusb_exit(ctx);
 		return ENODEV;
 	}
 
@@ -101,15 +105,19 @@ int joker_open(struct joker_t *joker)
 	if (ret < 0) {
 		fprintf(stderr, "Can't claim interface: %s\n", libusb_error_name(ret));
 		libusb_close(devh);
+		libusb_exit(ctx);
 		return EIO;
 	}
 
 	joker->libusb_opaque = (void *)devh;
+	joker->libusb_ctx_opaque = (void *)ctx;
 	jdebug("open:dev=%p \n", devh);
 
 	joker->io_mux_opaq = malloc(sizeof(pthread_mutex_t));
-	if (!joker->io_mux_opaq)
-		return ENOMEM;
+	if (!joker->io_mux_opaq) {
+		ret = ENOMEM;
+		goto fail_usb;
+	}
 	pthread_mutex_init((pthread_mutex_t*)joker->io_mux_opaq, NULL);
 
 	/* prophylactic cleanup EP1 IN */
@@ -122,20 +130,20 @@ int joker_open(struct joker_t *joker)
 	buf[1] = (isoc_len >> 8) & 0x7;
 	if ((ret = joker_cmd(joker, buf, 2, NULL /* in_buf */, 0 /* in_len */))) {
 		printf("Can't set isoc transfers size (high)\n");
-		return ret;
+		goto fail_mux;
 	}
 
 	buf[0] = J_CMD_ISOC_LEN_WRITE_LO;
 	buf[1] = isoc_len & 0xFF;
 	if ((ret = joker_cmd(joker, buf, 2, NULL /* in_buf */, 0 /* in_len */))) {
 		printf("Can't set isoc transfers size (low)\n");
-		return ret;
+		goto fail_mux;
 	}
 
 	/* i2c core init */
 	if ((ret = joker_i2c_init(joker))) {
 		printf("Can't init i2c bus \n");
-		return ret;
+		goto fail_mux;
 	}
 
 	/* power down all chips
@@ -146,10 +154,26 @@ int joker_open(struct joker_t *joker)
 	// init EN50221 stuff (no actual CAM module processing starts here)
 	if (joker_ci_en50221_init(joker)) {
 		printf("Can't init EN50221 \n");
-		return -EIO;
+		ret = -EIO;
+		goto fail_i2c;
 	}
 
 	return 0;
+
+	// leave joker clean. Can be opened again (see joker_open_all)
+fail_i2c:
+	joker_i2c_close(joker);
+fail_mux:
+	pthread_mutex_destroy((pthread_mutex_t*)joker->io_mux_opaq);
+	free(joker->io_mux_opaq);
+	joker->io_mux_opaq = NULL;
+fail_usb:
+	libusb_release_interface(devh, 0);
+	libusb_close(devh);
+	libusb_exit(ctx);
+	joker->libusb_opaque = NULL;
+	joker->libusb_ctx_opaque = NULL;
+	return ret;
 }
 
 /* release usb device */
@@ -176,28 +200,36 @@ int joker_close(struct joker_t * joker) {
 	if(dev)
 		libusb_close(dev);
 	joker->libusb_opaque = NULL; /* dev not valid anymore */
+
+	if (joker->libusb_ctx_opaque)
+		libusb_exit((struct libusb_context *)joker->libusb_ctx_opaque);
+	joker->libusb_ctx_opaque = NULL;
+
+	if (joker->io_mux_opaq) {
+		pthread_mutex_destroy((pthread_mutex_t*)joker->io_mux_opaq);
+		free(joker->io_mux_opaq);
+		joker->io_mux_opaq = NULL;
+	}
 	printf("%s: done\n", __func__);
 }
 
-/* print available USB devices */
-int joker_devices_print(struct joker_t *joker)
+/* scan USB for Joker TV devices
+ * fill up to 'max' ids
+ * return number of devices found */
+static int usb_devices_list(int verbose, struct joker_usb_id_t *ids, int max)
 {
 	struct libusb_context *ctx = NULL;
 	struct libusb_device **usb_list = NULL;
-	struct libusb_device_handle *devh = NULL;
 	struct libusb_device_descriptor desc;
-	int usb_devs, i, r, ret, transferred;
-
-	if (!joker)
-		return -EINVAL;
+	int usb_devs, i, r, ret, count = 0;
 
-	ret = libusb_init(NULL);
+	ret = libusb_init(&ctx);
 	if (ret < 0) {
 		fprintf(stderr, "libusb_init failed\n");
 		return -ENODEV;
 	}
 
-	libusb_set_debug(NULL, joker->libusb_verbose);
+	libusb_set_debug(ctx, verbose);
 
 	usb_devs = libusb_get_device_list(ctx, &usb_list);
 	for(i = 0 ; i < usb_devs ; ++i) {
@@ -206,19 +238,84 @@ int joker_devices_print(struct joker_t *joker)
 			fprintf(stderr, "couldn't get usb descriptor for dev #%d!\n", i);
 			fprintf(stderr, "desc.idVendor=0x%x desc.idProduct=0x%x\n",
 					desc.idVendor, desc.idProduct);
+			continue;
 		}
 
 		if (desc.idVendor == NETUP_VID && desc.idProduct == JOKER_TV_PID)
 		{
-			printf("  * Joker TV device found. id = %d:%d \n", 
-					libusb_get_bus_number(usb_list[i]),
-					libusb_get_port_number(usb_list[i]));
+			if (ids && count < max) {
+				ids[count].bus = libusb_get_bus_number(usb_list[i]);
+				ids[count].port = libusb_get_port_number(usb_list[i]);
+			}
+			count++;
 		}
 	}
 
+	libusb_free_device_list(usb_list, 1);
+	libusb_exit(ctx);
+
+	return count;
+}
+
+/* print available USB devices */
+int joker_devices_print(struct joker_t *joker)
+{
+	struct joker_usb_id_t ids[JOKER_DEVICES_MAX];
+	int i, count;
+
+	if (!joker)
+		return -EINVAL;
+
+	count = usb_devices_list(joker->libusb_verbose, ids, JOKER_DEVICES_MAX);
+	if (count < 0)
+		return count;
+
+	for (i = 0; i < count && i < JOKER_DEVICES_MAX; i++)
+		printf("  * Joker TV device found. id = %d:%d \n", ids[i].bus, ids[i].port);
+
 	return 0;
 }
 
+int joker_devices_list(struct joker_usb_id_t *ids, int max)
+{
+	return usb_devices_list(0, ids, max);
+}
+
+int joker_open_all(struct joker_t *jokers, int max,
+		const struct joker_usb_id_t *ids, int ids_count)
+{
+	struct joker_usb_id_t found[JOKER_DEVICES_MAX];
+	int i = 0, opened = 0, ret = 0;
+
+	if (!jokers || max <= 0)
+		return -EINVAL;
+
+	// open all available devices
+	if (!ids) {
+		ids_count = usb_devices_list(jokers[0].libusb_verbose, found, JOKER_DEVICES_MAX);
+		if (ids_count < 0)
+			return ids_count;
+		if (ids_count > JOKER_DEVICES_MAX)
+			ids_count = JOKER_DEVICES_MAX;
+		ids = found;
+	}
+
+	for (i = 0; i < ids_count && opened < max; i++) {
+		jokers[opened].force_device_selection = 1;
+		jokers[opened].usb_bus_id = ids[i].bus;
+		jokers[opened].usb_port_id = ids[i].port;
+		// failed joker_open cleans up. slot reused for next device
+		if ((ret = joker_open(&jokers[opened]))) {
+			printf("Can't open Joker TV %d:%d. err=%d \n", ids[i].bus, ids[i].port, ret);
+			continue;
+		}
+		printf("Joker TV %d:%d opened \n", ids[i].bus, ids[i].port);
+		opened++;
+	}
+
+	return opened;
+}
+
 /* exchange with FPGA over USB
  * EP2 OUT EP used as joker commands (jcmd) source
  * EP1 IN EP used as command reply storage
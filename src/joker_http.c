@@ -0,0 +1,662 @@
+/*
+ * Joker TV
+ * HTTP TS streaming server
+ *
+ * one epoll thread serves all clients (non-blocking sockets).
+ * Producers (TS thread for programs, feeder thread for whole TS) copy
+ * data to refcounted segment and queue it to every client of channel.
+ * Clients send directly from segments (sendmsg with iovec)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4 */
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <joker_tv.h>
+#include <joker_ts.h>
+#include <joker_utils.h>
+#include <joker_demux.h>
+#include <joker_http.h>
+#include <u_drv_data.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+#define HTTP_REQUEST_MAX 2048
+#define HTTP_HEADER_MAX 256
+// segments sent with one sendmsg call
+#define HTTP_IOV 64
+#define HTTP_EVENTS 64
+// channel 0 is whole TS (/mux.ts). Others are programs
+#define HTTP_CHANNELS (JOKER_DEMUX_OUTPUTS_MAX + 1)
+
+/* data shared by clients. freed when last client sent it */
+struct http_seg_t
+{
+	int refs;
+	int len;
+	unsigned char data[];
+};
+
+struct http_client_t
+{
+	struct joker_http_t *http;
+	int fd;
+	char name[64]; /* address for messages */
+	struct http_channel_t *channel; /* NULL until request received */
+
+	char req[HTTP_REQUEST_MAX];
+	int req_len;
+	char hdr[HTTP_HEADER_MAX]; /* response header */
+	int hdr_len;
+	int hdr_off;
+	int close_after_hdr; /* error response */
+
+	/* segments queue. One producer (channel) and epoll thread
+	 * indexes are free running, updated with atomics */
+	struct http_seg_t *queue[JOKER_HTTP_CLIENT_QUEUE];
+	unsigned int q_head; /* epoll thread */
+	unsigned int q_tail; /* producer */
+	int queued; /* bytes */
+	int off; /* sent from first segment */
+	int evict; /* set by producer if client is too slow */
+	int blocked; /* socket buffer full. Waiting for EPOLLOUT */
+
+	struct list_head list; /* http->clients. epoll thread only */
+	struct list_head channel_list; /* channel->clients. protected by http->mux */
+};
+
+struct http_channel_t
+{
+	struct joker_http_t *http;
+	int number; /* program number. -1 for /mux.ts */
+	struct list_head clients;
+};
+
+struct joker_http_t
+{
+	struct big_pool_t *pool;
+	int listen_fd;
+	int epoll_fd;
+	int event_fd; /* wakeup epoll thread (new data, evicted clients) */
+	pthread_t thread;
+	int cancel;
+
+	/* protects channels clients lists and queue push */
+	pthread_mutex_t mux;
+	struct http_channel_t channels[HTTP_CHANNELS];
+	int channels_count;
+
+	struct list_head clients;
+	int clients_count;
+
+	/* programs */
+	struct joker_demux_t *demux;
+
+	/* whole TS */
+	struct ts_reader_t *reader;
+	pthread_t feeder;
+	int feeding;
+};
+
+static void http_seg_put(struct http_seg_t *seg)
+{
+	if (!__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL))
+		free(seg);
+}
+
+static void http_wakeup(struct joker_http_t *http)
+{
+	uint64_t one = 1;
+
+	if (write(http->event_fd, &one, sizeof(one)) != sizeof(one))
+		jdebug("%s: eventfd write failed\n", __func__);
+}
+
+/* copy data to new segment and queue it to all channel clients
+ * called by producer thread */
+static int http_publish(struct http_channel_t *channel, const struct iovec *iov, int iovcnt)
+{
+	struct joker_http_t *http = channel->http;
+	struct http_client_t *c = NULL;
+	struct http_seg_t *seg = NULL;
+	unsigned int tail = 0;
+	int i = 0, len = 0, wake = 0;
+
+	// nobody watching. Racy check is fine, client starts from next segment
+	if (list_empty(&channel->clients))
+		return 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (!len)
+		return 0;
+
+	seg = malloc(sizeof(*seg) + len);
+	if (!seg)
+		return -ENOMEM;
+	seg->refs = 1; // own reference
+	seg->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(seg->data + seg->len, iov[i].iov_base, iov[i].iov_len);
+		seg->len += iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&http->mux);
+	list_for_each_entry(c, &channel->clients, channel_list) {
+		if (c->evict)
+			continue;
+
+		tail = c->q_tail;
+		if (tail - __atomic_load_n(&c->q_head, __ATOMIC_ACQUIRE) >= JOKER_HTTP_CLIENT_QUEUE ||
+				__atomic_load_n(&c->queued, __ATOMIC_RELAXED) + len > JOKER_HTTP_CLIENT_BUFFER) {
+			// client can't keep up. Don't let it eat memory
+			c->evict = 1;
+			wake = 1;
+			continue;
+		}
+
+		__atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+		c->queue[tail % JOKER_HTTP_CLIENT_QUEUE] = seg;
+		__atomic_add_fetch(&c->queued, len, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->q_tail, tail + 1, __ATOMIC_SEQ_CST);
+
+		// epoll thread sends only after wakeup or EPOLLOUT
+		if (tail == __atomic_load_n(&c->q_head, __ATOMIC_SEQ_CST) && !c->blocked)
+			wake = 1;
+	}
+	pthread_mutex_unlock(&http->mux);
+
+	http_seg_put(seg);
+	if (wake)
+		http_wakeup(http);
+
+	return 0;
+}
+
+/* demux sink. called from TS thread */
+static int http_program_sink(void *opaque, const unsigned char *data, int size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+
+	return http_publish((struct http_channel_t *)opaque, &iov, 1);
+}
+
+/* whole TS from own pool reader */
+void* http_feeder(void * data)
+{
+	struct joker_http_t *http = (struct joker_http_t *)data;
+	struct iovec iov[64];
+	int n = 0;
+
+	while (!__atomic_load_n(&http->cancel, __ATOMIC_ACQUIRE)) {
+		n = ts_reader_borrow(http->reader, iov, 64, JOKER_HTTP_SEG_SIZE);
+		if (n <= 0)
+			break; // TS processing stopped or reader cancelled
+
+		http_publish(&http->channels[0], iov, n);
+		ts_reader_release(http->reader);
+	}
+
+	return NULL;
+}
+
+static void http_client_close(struct joker_http_t *http, struct http_client_t *c)
+{
+	if (c->channel) {
+		pthread_mutex_lock(&http->mux);
+		list_del(&c->channel_list);
+		pthread_mutex_unlock(&http->mux);
+	}
+
+	// producer can't push anymore
+	for (; c->q_head != c->q_tail; c->q_head++)
+		http_seg_put(c->queue[c->q_head % JOKER_HTTP_CLIENT_QUEUE]);
+
+	epoll_ctl(http->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	list_del(&c->list);
+	http->clients_count--;
+	free(c);
+}
+
+static void http_client_events(struct joker_http_t *http, struct http_client_t *c, int out)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(http->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->blocked = out;
+}
+
+/* send queued data until socket buffer is full
+ * return 0 if success */
+static int http_client_flush(struct joker_http_t *http, struct http_client_t *c)
+{
+	struct iovec iov[HTTP_IOV];
+	struct msghdr msg;
+	struct http_seg_t *seg = NULL;
+	unsigned int head = 0, tail = 0;
+	int n = 0, ret = 0, left = 0;
+
+	if (c->blocked)
+		return 0; // EPOLLOUT will come
+
+	while (1) {
+		n = 0;
+		if (c->hdr_off < c->hdr_len) {
+			iov[n].iov_base = c->hdr + c->hdr_off;
+			iov[n++].iov_len = c->hdr_len - c->hdr_off;
+		}
+
+		tail = c->close_after_hdr ? c->q_head : __atomic_load_n(&c->q_tail, __ATOMIC_SEQ_CST);
+		for (head = c->q_head; head != tail && n < HTTP_IOV; head++) {
+			seg = c->queue[head % JOKER_HTTP_CLIENT_QUEUE];
+			iov[n].iov_base = seg->data + (head == c->q_head ? c->off : 0);
+			iov[n++].iov_len = seg->len - (head == c->q_head ? c->off : 0);
+		}
+		if (!n)
+			return c->close_after_hdr ? -1 : 0;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ret = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				http_client_events(http, c, 1);
+				return 0;
+			}
+			return -1;
+		}
+
+		if (c->hdr_off < c->hdr_len) {
+			left = c->hdr_len - c->hdr_off;
+			c->hdr_off += ret < left ? ret : left;
+			ret -= ret < left ? ret : left;
+		}
+		while (ret > 0) {
+			seg = c->queue[c->q_head % JOKER_HTTP_CLIENT_QUEUE];
+			left = seg->len - c->off;
+			if (ret < left) {
+				c->off += ret;
+				break;
+			}
+			ret -= left;
+			c->off = 0;
+			__atomic_sub_fetch(&c->queued, seg->len, __ATOMIC_RELAXED);
+			http_seg_put(seg);
+			__atomic_store_n(&c->q_head, c->q_head + 1, __ATOMIC_SEQ_CST);
+		}
+	}
+}
+
+static void http_response(struct http_client_t *c, const char *status, int error)
+{
+	c->hdr_len = snprintf(c->hdr, HTTP_HEADER_MAX,
+			"HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Connection: close\r\n\r\n",
+			status, error ? "text/plain" : "video/mp2t");
+	c->close_after_hdr = error;
+}
+
+/* parse request line and subscribe client to channel
+ * return 0 if request is incomplete */
+static int http_client_request(struct joker_http_t *http, struct http_client_t *c)
+{
+	char method[8], path[256];
+	struct http_channel_t *channel = NULL;
+	int number = -1, i = 0;
+
+	c->req[c->req_len] = '\0';
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+		if (c->req_len < HTTP_REQUEST_MAX - 1)
+			return 0;
+		http_response(c, "400 Bad Request", 1);
+		return 1;
+	}
+
+	if (sscanf(c->req, "%7s %255s", method, path) != 2) {
+		http_response(c, "400 Bad Request", 1);
+		return 1;
+	}
+	if (strcmp(method, "GET")) {
+		http_response(c, "405 Method Not Allowed", 1);
+		return 1;
+	}
+	path[strcspn(path, "?")] = '\0';
+
+	if (!strcmp(path, "/mux.ts")) {
+		channel = &http->channels[0];
+	} else if (sscanf(path, "/program/%d.ts", &number) == 1) {
+		for (i = 1; i < http->channels_count; i++)
+			if (http->channels[i].number == number)
+				channel = &http->channels[i];
+	}
+
+	if (!channel) {
+		http_response(c, "404 Not Found", 1);
+		return 1;
+	}
+
+	printf("HTTP client %s: %s \n", c->name, path);
+	http_response(c, "200 OK", 0);
+	pthread_mutex_lock(&http->mux);
+	c->channel = channel;
+	list_add_tail(&c->channel_list, &channel->clients);
+	pthread_mutex_unlock(&http->mux);
+
+	return 1;
+}
+
+/* return 0 if client still connected */
+static int http_client_read(struct joker_http_t *http, struct http_client_t *c)
+{
+	char buf[512];
+	int ret = 0;
+
+	if (c->channel || c->close_after_hdr) {
+		// only watching for disconnect. Ignore anything else
+		ret = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		return (ret > 0 || (ret < 0 && (errno == EAGAIN || errno == EINTR))) ? 0 : -1;
+	}
+
+	ret = recv(c->fd, c->req + c->req_len, HTTP_REQUEST_MAX - 1 - c->req_len, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (ret <= 0)
+		return -1;
+	c->req_len += ret;
+
+	if (http_client_request(http, c))
+		return http_client_flush(http, c);
+
+	return 0;
+}
+
+static void http_accept(struct joker_http_t *http)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct http_client_t *c = NULL;
+	struct epoll_event ev;
+	char host[48] = "", serv[8] = "";
+	int fd = 0, one = 1;
+
+	fd = accept4(http->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	if (http->clients_count >= JOKER_HTTP_CLIENTS_MAX) {
+		printf("%s: too many clients. Connection dropped\n", __func__);
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return;
+	}
+	c->http = http;
+	c->fd = fd;
+	getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host),
+			serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV);
+	snprintf(c->name, sizeof(c->name), "%s:%s", host, serv);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		free(c);
+		return;
+	}
+	list_add_tail(&c->list, &http->clients);
+	http->clients_count++;
+}
+
+void* http_worker(void * data)
+{
+	struct joker_http_t *http = (struct joker_http_t *)data;
+	struct epoll_event events[HTTP_EVENTS];
+	struct http_client_t *c = NULL, *tmp = NULL;
+	uint64_t count = 0;
+	int n = 0, i = 0, err = 0;
+
+	while (!__atomic_load_n(&http->cancel, __ATOMIC_ACQUIRE)) {
+		n = epoll_wait(http->epoll_fd, events, HTTP_EVENTS, 1000);
+		if (n < 0 && errno != EINTR) {
+			printf("%s: epoll_wait failed. error=%s \n", __func__, strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == http) {
+				http_accept(http);
+				continue;
+			}
+
+			if (events[i].data.ptr == &http->event_fd) {
+				// new data for some clients. Check all of them below
+				if (read(http->event_fd, &count, sizeof(count)) != sizeof(count))
+					jdebug("%s: eventfd read failed\n", __func__);
+				continue;
+			}
+
+			c = (struct http_client_t *)events[i].data.ptr;
+			err = 0;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				err = http_client_read(http, c);
+			if (!err && (events[i].events & EPOLLOUT)) {
+				http_client_events(http, c, 0);
+				err = http_client_flush(http, c);
+			}
+			if (err)
+				c->evict = 2; // closed below
+		}
+
+		list_for_each_entry_safe(c, tmp, &http->clients, list) {
+			if (c->evict == 1)
+				printf("HTTP client %s: too slow. Disconnected\n", c->name);
+			if (!c->evict && !c->blocked && c->channel &&
+					c->q_head != __atomic_load_n(&c->q_tail, __ATOMIC_ACQUIRE) &&
+					http_client_flush(http, c))
+				c->evict = 2;
+			if (c->evict)
+				http_client_close(http, c);
+		}
+	}
+
+	return NULL;
+}
+
+static int http_listen(const char *addr, int port)
+{
+	struct addrinfo hints, *res = NULL;
+	char service[16];
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(addr, service, &hints, &res) || !res) {
+		printf("Can't resolve HTTP listen address '%s'\n", addr ? addr : "");
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 128)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0)
+		printf("%s: Could not listen on port %d. error=%s \n",
+				__func__, port, strerror(errno));
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static void http_free(struct joker_http_t *http)
+{
+	struct http_client_t *c = NULL, *tmp = NULL;
+
+	if (http->feeding) {
+		ts_reader_wakeup(http->reader);
+		pthread_join(http->feeder, NULL);
+	}
+	if (http->reader)
+		ts_reader_close(http->reader);
+	// waits while TS thread uses sinks
+	joker_demux_free(http->demux);
+
+	list_for_each_entry_safe(c, tmp, &http->clients, list)
+		http_client_close(http, c);
+
+	if (http->listen_fd >= 0)
+		close(http->listen_fd);
+	if (http->epoll_fd >= 0)
+		close(http->epoll_fd);
+	if (http->event_fd >= 0)
+		close(http->event_fd);
+	pthread_mutex_destroy(&http->mux);
+	free(http);
+}
+
+struct joker_http_t * joker_http_start(struct big_pool_t *pool, const char *addr, int port)
+{
+	struct joker_http_t *http = NULL;
+	struct http_channel_t *channel = NULL;
+	struct program_t *program = NULL;
+	struct epoll_event ev;
+	int ret = 0, i = 0;
+
+	if (!pool || port <= 0 || port > 65535)
+		return NULL;
+
+	http = calloc(1, sizeof(*http));
+	if (!http)
+		return NULL;
+	http->pool = pool;
+	http->listen_fd = http->epoll_fd = http->event_fd = -1;
+	pthread_mutex_init(&http->mux, NULL);
+	INIT_LIST_HEAD(&http->clients);
+	for (i = 0; i < HTTP_CHANNELS; i++) {
+		http->channels[i].http = http;
+		http->channels[i].number = -1;
+		INIT_LIST_HEAD(&http->channels[i].clients);
+	}
+	http->channels_count = 1;
+
+	http->listen_fd = http_listen(addr, port);
+	http->epoll_fd = epoll_create1(0);
+	http->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (http->listen_fd < 0 || http->epoll_fd < 0 || http->event_fd < 0)
+		goto fail;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = http;
+	epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->listen_fd, &ev);
+	ev.data.ptr = &http->event_fd;
+	epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->event_fd, &ev);
+
+	// single program streams for every known program
+	// caller already waited for get_programs. list not locked
+	list_for_each_entry(program, &pool->programs_list, list) {
+		if (http->channels_count >= HTTP_CHANNELS)
+			break;
+		if (!http->demux && !(http->demux = joker_demux_alloc(pool)))
+			goto fail;
+		channel = &http->channels[http->channels_count];
+		if (joker_demux_add_program(http->demux, program->number,
+					http_program_sink, channel))
+			break;
+		channel->number = program->number;
+		http->channels_count++;
+	}
+	if (http->demux && joker_demux_start(http->demux))
+		goto fail;
+
+	http->reader = ts_reader_open(pool, 0);
+	if (!http->reader)
+		goto fail;
+	if (pthread_create(&http->feeder, NULL, http_feeder, (void *)http))
+		goto fail;
+	http->feeding = 1;
+
+	ret = pthread_create(&http->thread, NULL, http_worker, (void *)http);
+	if (ret) {
+		printf("ERROR: can't start HTTP server thread. code=%d\n", ret);
+		goto fail;
+	}
+	printf("HTTP server is listening on %s:%d (/mux.ts and %d programs)\n",
+			addr ? addr : "*", port, http->channels_count - 1);
+
+	return http;
+fail:
+	__atomic_store_n(&http->cancel, 1, __ATOMIC_RELEASE);
+	http_free(http);
+	return NULL;
+}
+
+void joker_http_stop(struct joker_http_t *http)
+{
+	if (!http)
+		return;
+
+	__atomic_store_n(&http->cancel, 1, __ATOMIC_RELEASE);
+	http_wakeup(http);
+	pthread_join(http->thread, NULL);
+
+	http_free(http);
+}
+
+#else /* __linux__ */
+
+struct joker_http_t * joker_http_start(struct big_pool_t *pool, const char *addr, int port)
+{
+	printf("HTTP server is not supported on this platform\n");
+	return NULL;
+}
+
+void joker_http_stop(struct joker_http_t *http)
+{
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,210 @@
+/* 
+ * Joker TV
+ * lock-free single producer/single consumer queue
+ *
+ * producer and consumer never take locks on the fast path.
+ * consumer can "park" when queue is empty. Producer rings doorbell
+ * only if consumer parked (futex under Linux, cond var elsewhere)
+ * 
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <joker_queue.h>
+
+#define CACHE_LINE 64
+
+struct joker_queue_t
+{
+	void **items;
+	uint32_t mask;
+
+	/* written by producer only */
+	uint32_t head __attribute__((aligned(CACHE_LINE)));
+
+	/* written by consumer only */
+	uint32_t tail __attribute__((aligned(CACHE_LINE)));
+	int parked;
+
+	/* doorbell. incremented by producer when consumer parked */
+	uint32_t bell __attribute__((aligned(CACHE_LINE)));
+#ifndef __linux__
+	pthread_mutex_t mux;
+	pthread_cond_t cond;
+#endif
+};
+
+struct joker_queue_t * joker_queue_alloc(int size)
+{
+	struct joker_queue_t *queue = NULL;
+	uint32_t slots = 2;
+	void *mem = NULL;
+
+	while (slots < (uint32_t)size)
+		slots <<= 1;
+
+	if (posix_memalign(&mem, CACHE_LINE, sizeof(*queue)))
+		return NULL;
+	queue = (struct joker_queue_t *)mem;
+	memset(queue, 0, sizeof(*queue));
+
+	queue->items = calloc(slots, sizeof(void *));
+	if (!queue->items) {
+		free(queue);
+		return NULL;
+	}
+	queue->mask = slots - 1;
+
+#ifndef __linux__
+	pthread_mutex_init(&queue->mux, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+#endif
+
+	return queue;
+}
+
+void joker_queue_free(struct joker_queue_t *queue)
+{
+	if (!queue)
+		return;
+
+#ifndef __linux__
+	pthread_mutex_destroy(&queue->mux);
+	pthread_cond_destroy(&queue->cond);
+#endif
+	free(queue->items);
+	free(queue);
+}
+
+static void ring_bell(struct joker_queue_t *queue)
+{
+#ifdef __linux__
+	__atomic_add_fetch(&queue->bell, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &queue->bell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&queue->mux);
+	__atomic_add_fetch(&queue->bell, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->mux);
+#endif
+}
+
+/* sleep while bell not changed */
+static void wait_bell(struct joker_queue_t *queue, uint32_t bell, int timeout_ms)
+{
+#ifdef __linux__
+	struct timespec ts, *tsp = NULL;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	syscall(SYS_futex, &queue->bell, FUTEX_WAIT_PRIVATE, bell, tsp, NULL, 0);
+#else
+	struct timeval now;
+	struct timespec deadline;
+	int ret = 0;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&queue->mux);
+	while (__atomic_load_n(&queue->bell, __ATOMIC_SEQ_CST) == bell && !ret) {
+		if (timeout_ms >= 0)
+			ret = pthread_cond_timedwait(&queue->cond, &queue->mux, &deadline);
+		else
+			ret = pthread_cond_wait(&queue->cond, &queue->mux);
+	}
+	pthread_mutex_unlock(&queue->mux);
+#endif
+}
+
+int joker_queue_push(struct joker_queue_t *queue, void *item)
+{
+	uint32_t head = queue->head;
+	uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > queue->mask)
+		return -EAGAIN;
+
+	queue->items[head & queue->mask] = item;
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	// pairs with fence in joker_queue_pop_wait
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->parked, __ATOMIC_RELAXED))
+		ring_bell(queue);
+
+	return 0;
+}
+
+void * joker_queue_pop(struct joker_queue_t *queue)
+{
+	uint32_t tail = queue->tail;
+	uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	void *item = NULL;
+
+	if (head == tail)
+		return NULL;
+
+	item = queue->items[tail & queue->mask];
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+void * joker_queue_pop_wait(struct joker_queue_t *queue, int timeout_ms)
+{
+	void *item = NULL;
+	uint32_t bell = 0;
+
+	if ((item = joker_queue_pop(queue)))
+		return item;
+
+	// park. producer will ring the bell after next push
+	__atomic_store_n(&queue->parked, 1, __ATOMIC_RELAXED);
+	bell = __atomic_load_n(&queue->bell, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// recheck. item can be pushed before producer noticed parking
+	if (!(item = joker_queue_pop(queue))) {
+		wait_bell(queue, bell, timeout_ms);
+		item = joker_queue_pop(queue);
+	}
+	__atomic_store_n(&queue->parked, 0, __ATOMIC_RELAXED);
+
+	return item;
+}
+
+void joker_queue_wakeup(struct joker_queue_t *queue)
+{
+	ring_bell(queue);
+}
+
+int joker_queue_count(struct joker_queue_t *queue)
+{
+	return (int)(__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE));
+}
@@ -0,0 +1,359 @@
+/*
+ * Joker TV
+ * Offline replay of raw USB data (see --raw-data)
+ *
+ * Raw file read and split to synthetic ISOC transfers.
+ * Transfers go through same capture path as USB transfers
+ * (tail, resync, nodes, hooks, read_ts_data)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libusb.h>
+#include "joker_tv.h"
+#include "joker_fpga.h"
+#include "joker_utils.h"
+#include "joker_replay.h"
+#include "joker_ts_sync.h"
+
+// amount of data to scan for PCR (bitrate detection)
+#define REPLAY_PROBE_SIZE (8*1024*1024)
+
+struct replay_opaq_t
+{
+	pthread_t thread;
+	pthread_mutex_t mux;
+	pthread_cond_t cond;
+	int cancel;
+
+	struct joker_t *joker;
+	struct big_pool_t *pool;
+	FILE *fd;
+	int slot_size; /* buffer space for one ISOC packet */
+
+	/* synthetic transfers */
+	struct libusb_transfer *transfers[NUM_USB_BUFS_MAX];
+	int count;
+	/* transfers not in use (not lent to TS pipeline) */
+	struct libusb_transfer *free[NUM_USB_BUFS_MAX];
+	int free_count;
+
+	uint32_t rand;
+	int lost; /* packets to loose in current burst */
+};
+
+/* xorshift. same on all platforms */
+static uint32_t replay_rand(struct replay_opaq_t *r)
+{
+	r->rand ^= r->rand << 13;
+	r->rand ^= r->rand >> 17;
+	r->rand ^= r->rand << 5;
+	return r->rand;
+}
+
+/* estimate bitrate using PCR of first PCR PID
+ * return bits/sec or 0 if not detected */
+static int64_t replay_detect_bitrate(FILE *fd)
+{
+	unsigned char *buf = NULL;
+	int64_t pcr = 0, first_pcr = -1, last_pcr = -1;
+	int64_t first_off = 0, last_off = 0;
+	int pcr_pid = -1, pid = 0, skip = 0;
+	size_t size = 0, off = 0;
+
+	buf = malloc(REPLAY_PROBE_SIZE);
+	if (!buf)
+		return 0;
+
+	size = fread(buf, 1, REPLAY_PROBE_SIZE, fd);
+	rewind(fd);
+
+	while (off + TS_SIZE <= size) {
+		if (buf[off] != TS_SYNC) {
+			skip = ts_sync_find(buf + off, size - off, TS_SYNC_LOCK_COUNT);
+			if (skip <= 0)
+				break;
+			off += skip;
+			continue;
+		}
+
+		pid = (buf[off + 1] & 0x1f) << 8 | buf[off + 2];
+		if ((pcr_pid < 0 || pid == pcr_pid) && (pcr = ts_pcr(buf + off)) >= 0) {
+			pcr_pid = pid;
+			if (first_pcr < 0) {
+				first_pcr = pcr;
+				first_off = off;
+			} else if (pcr > first_pcr) {
+				last_pcr = pcr;
+				last_off = off;
+			}
+		}
+		off += TS_SIZE;
+	}
+	free(buf);
+
+	if (last_pcr <= first_pcr || last_off <= first_off)
+		return 0;
+
+	// PCR clock is 27MHz
+	return (last_off - first_off) * 8 * 27000000 / (last_pcr - first_pcr);
+}
+
+/* get free transfer. wait if all transfers lent */
+static struct libusb_transfer * replay_get(struct replay_opaq_t *r)
+{
+	struct libusb_transfer *transfer = NULL;
+
+	pthread_mutex_lock(&r->mux);
+	while (!r->free_count && !r->cancel)
+		pthread_cond_wait(&r->cond, &r->mux);
+	if (!r->cancel)
+		transfer = r->free[--r->free_count];
+	pthread_mutex_unlock(&r->mux);
+
+	return transfer;
+}
+
+/* transfer returned from TS pipeline (see drop_ts_data) */
+static void replay_put(struct libusb_transfer *transfer)
+{
+	struct joker_replay_t *replay = (struct joker_replay_t *)transfer->user_data;
+	struct replay_opaq_t *r = replay->opaque;
+
+	pthread_mutex_lock(&r->mux);
+	r->free[r->free_count++] = transfer;
+	pthread_mutex_unlock(&r->mux);
+	pthread_cond_signal(&r->cond);
+}
+
+/* fill transfer with data from file
+ * return bytes consumed from file. 0 if end of file */
+static int replay_fill(struct joker_replay_t *replay, struct libusb_transfer *transfer)
+{
+	struct replay_opaq_t *r = replay->opaque;
+	unsigned char *buf = NULL;
+	int i = 0, len = 0, n = 0, total = 0;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		buf = transfer->buffer + i * r->slot_size;
+		len = replay->packet_size;
+		if (replay->packet_size_max > len)
+			len += replay_rand(r) % (replay->packet_size_max - len + 1);
+
+		n = fread(buf, 1, len, r->fd);
+		if (n < len && replay->loop) {
+			rewind(r->fd);
+			n += fread(buf + n, 1, len - n, r->fd);
+		}
+		total += n;
+
+		// loss pattern. data lost as on real USB bus
+		if (!r->lost && replay->loss_ppm &&
+				(replay_rand(r) % 1000000) < (uint32_t)replay->loss_ppm)
+			r->lost = replay->loss_burst > 0 ? replay->loss_burst : 1;
+
+		if (r->lost) {
+			r->lost--;
+			transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_ERROR;
+			transfer->iso_packet_desc[i].actual_length = 0;
+		} else {
+			transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+			transfer->iso_packet_desc[i].actual_length = n;
+		}
+	}
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+
+	return total;
+}
+
+void* replay_worker(void * data)
+{
+	struct joker_replay_t *replay = (struct joker_replay_t *)data;
+	struct replay_opaq_t *r = replay->opaque;
+	struct libusb_transfer *transfer = NULL;
+	uint64_t start = getus(), target = 0, now = 0;
+	int64_t bytes = 0;
+	int len = 0;
+
+	while (!r->cancel) {
+		transfer = replay_get(r);
+		if (!transfer)
+			break;
+
+		len = replay_fill(replay, transfer);
+		if (!len) {
+			replay_put(transfer);
+			break;
+		}
+		bytes += len;
+
+		// keep rate
+		if (replay->speed > 0 && replay->bitrate > 0) {
+			target = start + (uint64_t)(bytes * 8 * 1000000.0 /
+					(replay->bitrate * replay->speed));
+			now = getus();
+			if (target > now)
+				usleep(target - now);
+		}
+
+		// same path as USB completion
+		if (!ts_capture_transfer(r->pool, transfer))
+			replay_put(transfer);
+	}
+
+	printf("%s: replay done. %lld bytes \n", __func__, (long long)bytes);
+	ts_pipeline_eof(r->pool);
+
+	return 0;
+}
+
+static void replay_free(struct joker_replay_t *replay)
+{
+	struct replay_opaq_t *r = replay->opaque;
+	int i = 0;
+
+	if (!r)
+		return;
+
+	for (i = 0; i < r->count; i++) {
+		r->transfers[i]->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+		libusb_free_transfer(r->transfers[i]);
+	}
+	if (r->fd)
+		fclose(r->fd);
+	pthread_mutex_destroy(&r->mux);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+	replay->opaque = NULL;
+}
+
+int start_replay(struct joker_t *joker, struct big_pool_t *pool,
+		struct joker_replay_t *replay)
+{
+	struct replay_opaq_t *r = NULL;
+	struct libusb_transfer *transfer = NULL;
+	unsigned char *buf = NULL;
+	int i = 0, ret = 0;
+
+	if (!joker || !pool || !replay || !replay->filename)
+		return -EINVAL;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	pthread_mutex_init(&r->mux, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->joker = joker;
+	r->pool = pool;
+	r->rand = replay->seed ? replay->seed : 1;
+	replay->opaque = r;
+
+	r->fd = fopen(replay->filename, "rb");
+	if (!r->fd) {
+		printf("Can't open replay file '%s' \n", replay->filename);
+		replay_free(replay);
+		return -EIO;
+	}
+
+	// same geometry as high bandwidth USB by default
+	if (!joker->max_isoc_packets_count) {
+		joker->max_isoc_packets_count = NUM_USB_PACKETS_HIGH_BW_ISOC;
+		joker->max_isoc_packets_size = USB_PACKET_SIZE_HIGH_BW_ISOC;
+	}
+	if (replay->packet_size <= 0)
+		replay->packet_size = ISOC_TRANSFER_SIZE;
+	if (replay->packets <= 0)
+		replay->packets = joker->max_isoc_packets_count;
+
+	// node size depends on this
+	r->slot_size = replay->packet_size_max > replay->packet_size ?
+		replay->packet_size_max : replay->packet_size;
+	if (r->slot_size > joker->max_isoc_packets_size)
+		joker->max_isoc_packets_size = r->slot_size;
+	if (replay->packets > joker->max_isoc_packets_count)
+		joker->max_isoc_packets_count = replay->packets;
+
+	if (replay->speed > 0 && !replay->bitrate) {
+		replay->bitrate = replay_detect_bitrate(r->fd);
+		if (!replay->bitrate)
+			printf("%s: no PCR found. replay as fast as possible \n", __func__);
+	}
+	printf("%s: %s packet size %d-%d, %d packets per transfer, speed %.2f, bitrate %lld \n",
+			__func__, replay->filename, replay->packet_size, r->slot_size,
+			replay->packets, replay->speed, (long long)replay->bitrate);
+
+	// nodes, ring buffer and TS thread. lent transfers returned to us
+	pool->transfer_release = replay_put;
+	if ((ret = ts_pipeline_start(joker, pool))) {
+		replay_free(replay);
+		return ret;
+	}
+
+	for (i = 0; i < pool->usb_bufs; i++) {
+		transfer = libusb_alloc_transfer(replay->packets);
+		buf = malloc(replay->packets * r->slot_size);
+		if (!transfer || !buf) {
+			libusb_free_transfer(transfer);
+			free(buf);
+			break;
+		}
+
+		libusb_fill_iso_transfer(transfer, NULL, USB_EP3_IN, buf,
+				replay->packets * r->slot_size, replay->packets,
+				NULL, (void *)replay, 0);
+		libusb_set_iso_packet_lengths(transfer, r->slot_size);
+		r->transfers[r->count++] = transfer;
+		r->free[r->free_count++] = transfer;
+	}
+
+	if (!r->count) {
+		ts_pipeline_stop(pool);
+		pool_uninit(pool);
+		replay_free(replay);
+		return -ENOMEM;
+	}
+
+	ret = pthread_create(&r->thread, NULL, replay_worker, (void *)replay);
+	if (ret) {
+		printf("ERROR: can't start replay thread. code=%d\n", ret);
+		ts_pipeline_stop(pool);
+		pool_uninit(pool);
+		replay_free(replay);
+		return ret;
+	}
+
+	return 0;
+}
+
+int stop_replay(struct joker_replay_t *replay)
+{
+	struct replay_opaq_t *r = NULL;
+
+	if (!replay || !replay->opaque)
+		return -EINVAL;
+
+	r = replay->opaque;
+
+	pthread_mutex_lock(&r->mux);
+	r->cancel = 1;
+	pthread_mutex_unlock(&r->mux);
+	pthread_cond_broadcast(&r->cond);
+	pthread_join(r->thread, NULL);
+
+	// all lent transfers returned here
+	ts_pipeline_stop(r->pool);
+	pool_uninit(r->pool);
+	replay_free(replay);
+
+	return 0;
+}
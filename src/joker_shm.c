@@ -0,0 +1,239 @@
+/*
+ * Joker TV
+ * shared memory TS ring
+ *
+ * object mapped once. Writer copies data to the mapping, readers in
+ * other processes read without lock and check that writer did not
+ * overwrite data meanwhile (like seqlock, see joker_timeshift.c)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include <joker_tv.h>
+#include <joker_utils.h>
+#include <joker_shm.h>
+
+#ifdef __linux__
+
+struct joker_shm_t
+{
+	char name[NAME_MAX];
+	struct joker_shm_header_t *hdr;
+	uint64_t *times;
+	unsigned char *data;
+	size_t map_size;
+	uint64_t packets;
+};
+
+static void shm_copy_in(struct joker_shm_t *shm, uint64_t index,
+		const unsigned char *data, uint64_t count, uint64_t now)
+{
+	uint64_t slot = index % shm->packets;
+	uint64_t part = shm->packets - slot;
+	uint64_t i = 0;
+
+	if (count <= part) {
+		memcpy(shm->data + slot * TS_SIZE, data, count * TS_SIZE);
+	} else {
+		memcpy(shm->data + slot * TS_SIZE, data, part * TS_SIZE);
+		memcpy(shm->data, data + part * TS_SIZE, (count - part) * TS_SIZE);
+	}
+
+	for (i = 0; i < count; i++)
+		shm->times[(index + i) % shm->packets] = now;
+}
+
+int joker_shm_write(struct joker_shm_t *shm, const unsigned char *data, int size)
+{
+	struct joker_shm_header_t *hdr = NULL;
+	uint64_t index = 0;
+	uint64_t count = 0;
+
+	if (!shm || !data || size < 0 || size % TS_SIZE)
+		return -EINVAL;
+
+	hdr = shm->hdr;
+	count = size / TS_SIZE;
+	// keep only newest data if chunk is bigger than whole ring
+	if (count > shm->packets) {
+		data += (count - shm->packets) * TS_SIZE;
+		count = shm->packets;
+	}
+	index = hdr->write_index; // only writer changes it
+
+	// readers check this after use
+	__atomic_store_n(&hdr->reserve_index, index + count, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm_copy_in(shm, index, data, count, getus());
+
+	__atomic_store_n(&hdr->write_index, index + count, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+
+	// other processes. Not private futex
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &hdr->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return 0;
+}
+
+/* check that object 'name' has running publisher
+ * object of crashed publisher stays 'alive' but its process is gone */
+static int shm_alive(const char *name)
+{
+	struct joker_shm_header_t *hdr = NULL;
+	struct stat st;
+	int fd = -1, alive = 0;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return 0;
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == JOKER_SHM_MAGIC &&
+			__atomic_load_n(&hdr->alive, __ATOMIC_ACQUIRE) && hdr->pid &&
+			(!kill(hdr->pid, 0) || errno == EPERM))
+		alive = 1;
+	munmap(hdr, sizeof(*hdr));
+
+	return alive;
+}
+
+struct joker_shm_t * joker_shm_open(const char *name, int64_t size)
+{
+	struct joker_shm_t *shm = NULL;
+	struct joker_shm_header_t *hdr = NULL;
+	int64_t page = sysconf(_SC_PAGESIZE), unit = 0, times_size = 0;
+	int fd = -1;
+
+	if (!name || !name[0] || strchr(name + 1, '/'))
+		return NULL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return NULL;
+	// POSIX name starts with '/'
+	snprintf(shm->name, sizeof(shm->name), "%s%s", name[0] == '/' ? "" : "/", name);
+
+	// 188 = 4 * 47. page size is multiple of 4
+	unit = page * 47;
+	if (size <= 0)
+		size = JOKER_SHM_SIZE_DEFAULT;
+	size = (size + unit - 1) / unit * unit;
+	shm->packets = size / TS_SIZE;
+	times_size = (shm->packets * sizeof(uint64_t) + page - 1) / page * page;
+	shm->map_size = page + times_size + size;
+
+	// never steal name from running publisher
+	// stale object (crashed publisher) replaced
+	fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST && !shm_alive(shm->name)) {
+		shm_unlink(shm->name);
+		fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	if (fd < 0) {
+		if (errno == EEXIST)
+			printf("Shared memory %s used by other publisher\n", shm->name);
+		else
+			printf("Can't create shared memory %s. error=%s \n", shm->name, strerror(errno));
+		free(shm);
+		return NULL;
+	}
+
+	if (ftruncate(fd, shm->map_size)) {
+		printf("Can't resize shared memory %s to %lld bytes\n",
+				shm->name, (long long)shm->map_size);
+		goto fail;
+	}
+
+	hdr = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		printf("Can't map shared memory %s\n", shm->name);
+		goto fail;
+	}
+	close(fd);
+
+	hdr->version = JOKER_SHM_VERSION;
+	hdr->packet_size = TS_SIZE;
+	hdr->packets = shm->packets;
+	hdr->times_offset = page;
+	hdr->data_offset = page + times_size;
+	hdr->data_size = size;
+	hdr->epoch = getus();
+	hdr->pid = getpid();
+	hdr->alive = 1;
+	// readers check magic last
+	__atomic_store_n(&hdr->magic, JOKER_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm->hdr = hdr;
+	shm->times = (uint64_t *)((unsigned char *)hdr + hdr->times_offset);
+	shm->data = (unsigned char *)hdr + hdr->data_offset;
+	printf("TS published to shared memory %s (%lld bytes)\n",
+			shm->name, (long long)size);
+
+	return shm;
+fail:
+	close(fd);
+	shm_unlink(shm->name);
+	free(shm);
+	return NULL;
+}
+
+void joker_shm_close(struct joker_shm_t *shm)
+{
+	if (!shm)
+		return;
+
+	__atomic_store_n(&shm->hdr->alive, 0, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&shm->hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &shm->hdr->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	munmap(shm->hdr, shm->map_size);
+	shm_unlink(shm->name);
+	free(shm);
+}
+
+#else /* __linux__ */
+
+struct joker_shm_t * joker_shm_open(const char *name, int64_t size)
+{
+	printf("Shared memory output is not supported on this platform\n");
+	return NULL;
+}
+
+int joker_shm_write(struct joker_shm_t *shm, const unsigned char *data, int size)
+{
+	return -ENOSYS;
+}
+
+void joker_shm_close(struct joker_shm_t *shm)
+{
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,389 @@
+/*
+ * Joker TV
+ * disk backed timeshift buffer
+ *
+ * file mapped once. Writer copies data to the mapping, page cache
+ * writes it to disk. Readers copy without lock and check that
+ * writer did not overwrite data during copy (like seqlock)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+#include <joker_tv.h>
+#include <joker_utils.h>
+#include <joker_ts_sync.h>
+#include <joker_timeshift.h>
+
+struct timeshift_index_t
+{
+	int64_t offset; /* first packet after this point */
+	uint64_t time; /* wall-clock (usec) */
+	int64_t pcr; /* last PCR before this point. -1 if unknown */
+};
+
+struct joker_timeshift_t
+{
+	int fd;
+	unsigned char *ptr;
+	int64_t size; /* multiple of TS_SIZE. packets never split on wrap */
+
+	/* absolute offsets. updated with atomics
+	 * data in [reserve_off - size, write_off) is valid */
+	int64_t write_off;
+	int64_t reserve_off; /* writer copies data up to this offset */
+
+	/* writer side */
+	int interval;
+	int packets; /* since last index entry */
+	int pcr_pid;
+	int64_t pcr;
+
+	/* index ring. protected by mux */
+	struct timeshift_index_t *index;
+	int index_size;
+	int64_t index_count; /* entries added since open */
+
+	/* readers waiting for data */
+	pthread_mutex_t mux;
+	pthread_cond_t cond;
+	int waiters;
+};
+
+/* index entry 'n' (logical number). caller holds mux */
+static struct timeshift_index_t * ts_index(struct joker_timeshift_t *ts, int64_t n)
+{
+	return &ts->index[n % ts->index_size];
+}
+
+/* first entry which points to data still in file. caller holds mux */
+static int64_t ts_index_first(struct joker_timeshift_t *ts)
+{
+	int64_t n = ts->index_count > ts->index_size ?
+		ts->index_count - ts->index_size : 0;
+	int64_t start = joker_timeshift_start(ts);
+
+	while (n < ts->index_count && ts_index(ts, n)->offset < start)
+		n++;
+
+	return n;
+}
+
+static void ts_copy_in(struct joker_timeshift_t *ts, int64_t off,
+		const unsigned char *data, int64_t len)
+{
+	int64_t pos = off % ts->size, part = ts->size - pos;
+
+	if (len <= part) {
+		memcpy(ts->ptr + pos, data, len);
+	} else {
+		memcpy(ts->ptr + pos, data, part);
+		memcpy(ts->ptr, data + part, len - part);
+	}
+}
+
+static void ts_copy_out(struct joker_timeshift_t *ts, int64_t off,
+		unsigned char *data, int64_t len)
+{
+	int64_t pos = off % ts->size, part = ts->size - pos;
+
+	if (len <= part) {
+		memcpy(data, ts->ptr + pos, len);
+	} else {
+		memcpy(data, ts->ptr + pos, part);
+		memcpy(data + part, ts->ptr, len - part);
+	}
+}
+
+int joker_timeshift_write(struct joker_timeshift_t *ts, const unsigned char *data, int size)
+{
+	struct timeshift_index_t *entry = NULL;
+	const unsigned char *pkt = NULL;
+	int64_t off = 0, pcr = 0;
+	uint64_t now = 0;
+	int i = 0, pid = 0;
+
+	if (!ts || !data || size < 0 || size % TS_SIZE)
+		return -EINVAL;
+
+	// keep only newest data if chunk is bigger than whole file
+	if (size > ts->size) {
+		data += size - ts->size;
+		size = ts->size;
+	}
+	off = ts->write_off; // only writer changes it
+
+	// index. PCR of first PCR PID (as replay does)
+	pthread_mutex_lock(&ts->mux);
+	for (i = 0; i < size; i += TS_SIZE) {
+		pkt = data + i;
+		pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+		if ((ts->pcr_pid < 0 || pid == ts->pcr_pid) && (pcr = ts_pcr(pkt)) >= 0) {
+			ts->pcr_pid = pid;
+			ts->pcr = pcr;
+		}
+
+		if (ts->packets++ % ts->interval)
+			continue;
+
+		if (!now)
+			now = getus();
+		entry = ts_index(ts, ts->index_count++);
+		entry->offset = off + i;
+		entry->time = now;
+		entry->pcr = ts->pcr;
+	}
+	pthread_mutex_unlock(&ts->mux);
+
+	// readers check this after copy
+	__atomic_store_n(&ts->reserve_off, off + size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ts_copy_in(ts, off, data, size);
+
+	__atomic_store_n(&ts->write_off, off + size, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ts->mux);
+	if (ts->waiters)
+		pthread_cond_broadcast(&ts->cond);
+	pthread_mutex_unlock(&ts->mux);
+
+	return 0;
+}
+
+int64_t joker_timeshift_start(struct joker_timeshift_t *ts)
+{
+	int64_t start = 0;
+
+	if (!ts)
+		return -EINVAL;
+
+	start = __atomic_load_n(&ts->reserve_off, __ATOMIC_ACQUIRE) - ts->size;
+	return start > 0 ? start : 0;
+}
+
+int64_t joker_timeshift_end(struct joker_timeshift_t *ts)
+{
+	if (!ts)
+		return -EINVAL;
+
+	return __atomic_load_n(&ts->write_off, __ATOMIC_ACQUIRE);
+}
+
+int64_t joker_timeshift_seek_time(struct joker_timeshift_t *ts, uint64_t time)
+{
+	int64_t lo = 0, hi = 0, mid = 0, off = 0;
+
+	if (!ts)
+		return -EINVAL;
+
+	// entries sorted by time. find first entry not older than 'time'
+	pthread_mutex_lock(&ts->mux);
+	lo = ts_index_first(ts);
+	hi = ts->index_count;
+	if (lo < hi && ts_index(ts, lo)->time >= time) {
+		off = joker_timeshift_start(ts);
+	} else {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (ts_index(ts, mid)->time < time)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		off = lo < ts->index_count ? ts_index(ts, lo)->offset : joker_timeshift_end(ts);
+	}
+	pthread_mutex_unlock(&ts->mux);
+
+	return off;
+}
+
+int64_t joker_timeshift_seek_pcr(struct joker_timeshift_t *ts, int64_t pcr)
+{
+	struct timeshift_index_t *entry = NULL;
+	int64_t n = 0, first = 0, off = -ENOENT;
+
+	if (!ts || pcr < 0)
+		return -EINVAL;
+
+	// PCR can jump (discontinuity). Search from newest data
+	pthread_mutex_lock(&ts->mux);
+	first = ts_index_first(ts);
+	for (n = ts->index_count - 1; n >= first; n--) {
+		entry = ts_index(ts, n);
+		if (entry->pcr >= 0 && entry->pcr <= pcr) {
+			off = entry->offset;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ts->mux);
+
+	return off;
+}
+
+/* wait until data after 'offset' written */
+static void ts_wait(struct joker_timeshift_t *ts, int64_t offset, int timeout_ms)
+{
+	struct timeval now;
+	struct timespec deadline;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ts->mux);
+	ts->waiters++;
+	while (joker_timeshift_end(ts) <= offset) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&ts->cond, &ts->mux);
+		else if (pthread_cond_timedwait(&ts->cond, &ts->mux, &deadline) == ETIMEDOUT)
+			break;
+	}
+	ts->waiters--;
+	pthread_mutex_unlock(&ts->mux);
+}
+
+int joker_timeshift_read(struct joker_timeshift_t *ts, int64_t *offset,
+		unsigned char *data, int size, int timeout_ms)
+{
+	int64_t end = 0, len = 0;
+
+	if (!ts || !offset || !data || size < 0 || *offset < 0)
+		return -EINVAL;
+
+	end = joker_timeshift_end(ts);
+	if (*offset >= end && timeout_ms) {
+		ts_wait(ts, *offset, timeout_ms);
+		end = joker_timeshift_end(ts);
+	}
+
+	if (*offset < joker_timeshift_start(ts))
+		return -ERANGE;
+
+	len = end - *offset;
+	if (len > size)
+		len = size;
+	if (len <= 0)
+		return 0;
+
+	ts_copy_out(ts, *offset, data, len);
+
+	// writer could overwrite data during copy
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (*offset < __atomic_load_n(&ts->reserve_off, __ATOMIC_RELAXED) - ts->size)
+		return -ERANGE;
+
+	*offset += len;
+	return len;
+}
+
+static void timeshift_free(struct joker_timeshift_t *ts)
+{
+#ifndef __WIN32__
+	if (ts->ptr)
+		munmap(ts->ptr, ts->size);
+#endif
+	if (ts->fd >= 0)
+		close(ts->fd);
+	free(ts->index);
+	pthread_mutex_destroy(&ts->mux);
+	pthread_cond_destroy(&ts->cond);
+	free(ts);
+}
+
+struct joker_timeshift_t * joker_timeshift_open(const char *filename, int64_t size,
+		int interval)
+{
+	struct joker_timeshift_t *ts = NULL;
+
+	if (!filename)
+		return NULL;
+
+	ts = calloc(1, sizeof(*ts));
+	if (!ts)
+		return NULL;
+	ts->fd = -1;
+	pthread_mutex_init(&ts->mux, NULL);
+	pthread_cond_init(&ts->cond, NULL);
+	ts->pcr_pid = -1;
+	ts->pcr = -1;
+	ts->interval = interval > 0 ? interval : JOKER_TIMESHIFT_INTERVAL_DEFAULT;
+	ts->size = size > 0 ? size : JOKER_TIMESHIFT_SIZE_DEFAULT;
+	ts->size = ts->size / TS_SIZE * TS_SIZE;
+	if (ts->size <= 0)
+		goto fail;
+
+#ifdef __WIN32__
+	printf("%s: timeshift not supported on this platform \n", __func__);
+	goto fail;
+#else
+	// enough entries to cover whole file
+	ts->index_size = ts->size / ((int64_t)ts->interval * TS_SIZE) + 2;
+	ts->index = calloc(ts->index_size, sizeof(*ts->index));
+	if (!ts->index)
+		goto fail;
+
+	ts->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (ts->fd < 0) {
+		printf("Can't open timeshift file '%s' error=%s (%d)\n",
+				filename, strerror(errno), errno);
+		goto fail;
+	}
+
+	if (ftruncate(ts->fd, ts->size)) {
+		printf("Can't resize timeshift file '%s' to %lld bytes error=%s (%d)\n",
+				filename, (long long)ts->size, strerror(errno), errno);
+		goto fail;
+	}
+#ifdef __linux__
+	// reserve space. Otherwise writing to mapping fails with SIGBUS
+	// if filesystem is full
+	if (posix_fallocate(ts->fd, 0, ts->size))
+		printf("%s: can't preallocate '%s'. Using sparse file \n", __func__, filename);
+#endif
+
+	ts->ptr = mmap(NULL, ts->size, PROT_READ | PROT_WRITE, MAP_SHARED, ts->fd, 0);
+	if (ts->ptr == MAP_FAILED) {
+		ts->ptr = NULL;
+		printf("Can't map timeshift file '%s' error=%s (%d)\n",
+				filename, strerror(errno), errno);
+		goto fail;
+	}
+
+	jdebug("%s: %s size=%lld interval=%d\n",
+			__func__, filename, (long long)ts->size, ts->interval);
+
+	return ts;
+#endif
+fail:
+	timeshift_free(ts);
+	return NULL;
+}
+
+void joker_timeshift_close(struct joker_timeshift_t *ts)
+{
+	if (!ts)
+		return;
+
+	timeshift_free(ts);
+}
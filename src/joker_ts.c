@@ -406,6 +406,40 @@ int generate_pat_pkt(struct big_pool_t *pool)
 	return 0;
 }
 
+/* PAT with one program (single program TS output)
+ * pkt - TS_SIZE bytes, continuity counter is zero
+ * return 0 if success */
+int generate_spts_pat_pkt(int ts_id, int program_number, int pmt_pid, unsigned char *pkt)
+{
+	dvbpsi_t *p_dvbpsi = NULL;
+	dvbpsi_pat_t pat;
+	dvbpsi_psi_section_t* p_section = NULL;
+	uint8_t *packet = NULL;
+	int allocated = 0;
+
+	if (!pkt)
+		return -EINVAL;
+
+	p_dvbpsi = dvbpsi_new(&message, DVBPSI_MSG_DEBUG);
+	if (p_dvbpsi == NULL)
+		return -ENOMEM;
+
+	dvbpsi_pat_init(&pat, ts_id, 0, 1 /* b_current_next high - PAT active now */ );
+	if (dvbpsi_pat_program_add(&pat, program_number, pmt_pid)) {
+		p_section = dvbpsi_pat_sections_generate(p_dvbpsi, &pat, 250);
+		allocated = psi_pkts_generate(&packet, p_section, 0x00 /* PAT */);
+		dvbpsi_DeletePSISections(p_section);
+	}
+	if (allocated > 0 && packet)
+		memcpy(pkt, packet, TS_SIZE);
+
+	free(packet);
+	dvbpsi_pat_empty(&pat);
+	dvbpsi_delete(p_dvbpsi);
+
+	return allocated > 0 ? 0 : -ENOMEM;
+}
+
 int is_program_selected (struct big_pool_t *pool, int program_number)
 {
 	struct program_t *program = NULL;
@@ -488,8 +522,8 @@ static void DumpPAT(void* data, dvbpsi_pat_t* p_pat)
 			add_program_to_pat(pool, p_program->i_number, p_program->i_pid);
 		}
 
-		pool->hooks[p_program->i_pid] = &pmt_hook;
-		pool->hooks_opaque[p_program->i_pid] = program;
+		// PMT PID can be shared by several programs
+		ts_subscribe(pool, p_program->i_pid, &pmt_hook, program);
 		p_program = p_program->p_next;
 	}
 	jdebug(  "  active              : %d\n", p_pat->b_current_next);
@@ -1163,10 +1197,10 @@ struct list_head * get_programs(struct big_pool_t *pool)
 		goto out;
 
 	// install hooks
-	pool->hooks[J_TRANSPORT_PAT_PID] = &pat_hook;
-	pool->hooks[J_TRANSPORT_CAT_PID] = &cat_hook;
-	pool->hooks[J_TRANSPORT_TDT_PID] = &si_hook;
-	pool->hooks[J_TRANSPORT_NIT_PID] = &si_hook;
+	ts_subscribe(pool, J_TRANSPORT_PAT_PID, &pat_hook, pool);
+	ts_subscribe(pool, J_TRANSPORT_CAT_PID, &cat_hook, pool);
+	ts_subscribe(pool, J_TRANSPORT_TDT_PID, &si_hook, pool);
+	ts_subscribe(pool, J_TRANSPORT_NIT_PID, &si_hook, pool);
 
 	// check program list (PAT parse)
 	while (cnt-- > 0 && list_empty(&pool->programs_list))
@@ -1191,10 +1225,11 @@ struct list_head * get_programs(struct big_pool_t *pool)
 	printf("All PAT/PMT parse done. Program list is ready now.\n");
 
 	// parse SDT only after PAT and PMT !
-	pool->hooks[J_TRANSPORT_SDT_PID] = &sdt_hook;
+	// SDT and BAT share PID. Other subscribers of it are kept
+	ts_subscribe(pool, J_TRANSPORT_SDT_PID, &sdt_hook, pool);
 
 	// parse ATSC channels
-	pool->hooks[0x1FFB] = &atsc_hook;
+	ts_subscribe(pool, 0x1FFB, &atsc_hook, pool);
 
 	if (!list_empty(&pool->selected_programs_list))
 		generate_pat_pkt(pool);
@@ -0,0 +1,152 @@
+/* 
+ * Joker TV
+ * TS sync byte search (resynchronisation) and PCR extraction
+ *
+ * candidates (0x47 followed by 0x47 after 188 bytes) checked
+ * 16 (SSE2) or 32 (AVX2) positions at once. Only candidates
+ * confirmed with scalar code
+ * 
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <joker_tv.h>
+#include <joker_ts_sync.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TS_SYNC_X86 1
+#include <immintrin.h>
+#endif
+
+typedef int (*ts_sync_find_t)(const unsigned char *buf, size_t size, int confirm);
+
+/* check sync bytes of next 'confirm' packets. packets outside of buffer
+ * are not checked */
+static int sync_confirm(const unsigned char *buf, size_t size, size_t off, int confirm)
+{
+	int k = 0;
+
+	if (off + TS_SIZE > size || buf[off] != TS_SYNC)
+		return 0;
+
+	for (k = 1; k <= confirm && off + k * TS_SIZE < size; k++)
+		if (buf[off + k * TS_SIZE] != TS_SYNC)
+			return 0;
+
+	return 1;
+}
+
+static int sync_find_scalar_from(const unsigned char *buf, size_t size, size_t off, int confirm)
+{
+	for (; off + TS_SIZE <= size; off++)
+		if (sync_confirm(buf, size, off, confirm))
+			return (int)off;
+
+	return -1;
+}
+
+static int sync_find_scalar(const unsigned char *buf, size_t size, int confirm)
+{
+	return sync_find_scalar_from(buf, size, 0, confirm);
+}
+
+#ifdef TS_SYNC_X86
+__attribute__((target("sse2")))
+static int sync_find_sse2(const unsigned char *buf, size_t size, int confirm)
+{
+	const __m128i sync = _mm_set1_epi8(TS_SYNC);
+	__m128i a, b;
+	unsigned int mask = 0;
+	size_t off = 0;
+	int bit = 0;
+
+	for (off = 0; off + TS_SIZE + 16 <= size; off += 16) {
+		a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + off)), sync);
+		if (confirm > 0) {
+			b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + off + TS_SIZE)), sync);
+			a = _mm_and_si128(a, b);
+		}
+		mask = _mm_movemask_epi8(a);
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (sync_confirm(buf, size, off + bit, confirm))
+				return (int)(off + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return sync_find_scalar_from(buf, size, off, confirm);
+}
+
+__attribute__((target("avx2")))
+static int sync_find_avx2(const unsigned char *buf, size_t size, int confirm)
+{
+	const __m256i sync = _mm256_set1_epi8(TS_SYNC);
+	__m256i a, b;
+	unsigned int mask = 0;
+	size_t off = 0;
+	int bit = 0;
+
+	for (off = 0; off + TS_SIZE + 32 <= size; off += 32) {
+		a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + off)), sync);
+		if (confirm > 0) {
+			b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + off + TS_SIZE)), sync);
+			a = _mm256_and_si256(a, b);
+		}
+		mask = (unsigned int)_mm256_movemask_epi8(a);
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (sync_confirm(buf, size, off + bit, confirm))
+				return (int)(off + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return sync_find_scalar_from(buf, size, off, confirm);
+}
+#endif
+
+/* choose best implementation for this CPU */
+static ts_sync_find_t sync_find_select()
+{
+#ifdef TS_SYNC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return sync_find_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return sync_find_sse2;
+#endif
+	return sync_find_scalar;
+}
+
+int ts_sync_find(const unsigned char *buf, size_t size, int confirm)
+{
+	static ts_sync_find_t impl = NULL;
+
+	if (!buf || size < TS_SIZE)
+		return -1;
+
+	// all threads select same implementation. race is harmless
+	if (!impl)
+		impl = sync_find_select();
+
+	return impl(buf, size, confirm);
+}
+
+int64_t ts_pcr(const unsigned char *pkt)
+{
+	int64_t base = 0;
+
+	// adaptation field with PCR flag
+	if (!(pkt[3] & 0x20) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return -1;
+
+	base = ((int64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) |
+		(pkt[9] << 1) | (pkt[10] >> 7);
+
+	return base * 300 + (((pkt[10] & 1) << 8) | pkt[11]);
+}
@@ -0,0 +1,585 @@
+/*
+ * Joker TV
+ * UDP/RTP network output
+ *
+ * producer copies TS to lock-free queue (single producer, single
+ * consumer). Sender thread takes datagrams when they are due and
+ * sends them in batches (sendmmsg on Linux) directly from the queue
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* sendmmsg */
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef __WIN32__
+#include <winsock2.h>
+#include <WS2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#include <joker_tv.h>
+#include <joker_utils.h>
+#include <joker_ts_sync.h>
+#include <joker_udp.h>
+#include <u_drv_data.h>
+
+#define UDP_DATAGRAM (TS_SIZE*JOKER_UDP_PACKETS)
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_MP2T 33
+// datagrams sent if due in this time (usec)
+#define UDP_SLACK_US 1000
+// pacing restarted if stream is behind or ahead of clock more than this (usec)
+#define UDP_WINDOW_US 500000
+// partially filled datagram sent if no more data during this time (usec)
+#define UDP_FLUSH_US 20000
+#define UDP_SNDBUF (4*1024*1024)
+// PCR clock (27MHz) ticks in usec
+#define PCR_TICKS_US 27
+
+struct joker_udp_t
+{
+	int fd;
+	int flags;
+
+	/* queue. offsets are absolute, updated with atomics
+	 * size is multiple of TS_SIZE so packets never split on wrap */
+	unsigned char *buf;
+	int64_t size;
+	int64_t head; /* producer */
+	int64_t tail; /* sender thread */
+	int64_t in_bytes; /* written by producer (input bitrate) */
+
+	/* sender thread sleeps if queue is empty */
+	pthread_t thread;
+	pthread_mutex_t mux;
+	pthread_cond_t cond;
+	int waiting;
+	int cancel;
+
+	/* pool feeder (joker_udp_attach) */
+	struct ts_reader_t *reader;
+	pthread_t feeder;
+	int feeding;
+
+	/* pacing. sender thread only */
+	int pcr_pid;
+	int64_t pcr_base; /* PCR at time_base. -1 if unknown */
+	int64_t pcr_last;
+	int64_t pcr_bytes; /* sent since pcr_last */
+	double pcr_rate; /* bytes per PCR tick */
+	uint64_t time_base;
+	uint64_t last_due;
+	int last_len;
+	int64_t due_off; /* datagram at this offset is due at due_time */
+	uint64_t due_time;
+	uint64_t partial_time; /* incomplete datagram in queue since */
+	double in_rate; /* measured input (bytes per usec) */
+	int64_t in_last;
+	uint64_t in_time;
+
+	/* RTP */
+	uint16_t seq;
+	uint32_t ssrc;
+
+	struct joker_udp_stats_t stats;
+	uint64_t rate_time;
+	uint64_t rate_bytes;
+};
+
+// statistics counters. updated lock-free
+#define UDP_STAT_ADD(u, name, val) \
+	__atomic_add_fetch(&(u)->stats.name, (uint64_t)(val), __ATOMIC_RELAXED)
+
+int joker_udp_write(struct joker_udp_t *u, const unsigned char *data, int size)
+{
+	int64_t head = 0, free_space = 0, pos = 0, part = 0;
+	int ret = 0;
+
+	if (!u || !data || size < 0)
+		return -EINVAL;
+
+	head = u->head; // only producer changes it
+	free_space = u->size - (head - __atomic_load_n(&u->tail, __ATOMIC_ACQUIRE));
+	__atomic_add_fetch(&u->in_bytes, size, __ATOMIC_RELAXED);
+	if (size > free_space) {
+		UDP_STAT_ADD(u, dropped, (size - free_space) / TS_SIZE);
+		size = free_space;
+		ret = -EAGAIN;
+	}
+	size = size / TS_SIZE * TS_SIZE;
+
+	pos = head % u->size;
+	part = u->size - pos;
+	if (size <= part) {
+		memcpy(u->buf + pos, data, size);
+	} else {
+		memcpy(u->buf + pos, data, part);
+		memcpy(u->buf, data + part, size - part);
+	}
+	__atomic_store_n(&u->head, head + size, __ATOMIC_SEQ_CST);
+
+	// wakeup sender. It checks head after setting 'waiting'
+	if (__atomic_load_n(&u->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&u->mux);
+		pthread_cond_signal(&u->cond);
+		pthread_mutex_unlock(&u->mux);
+	}
+
+	return ret;
+}
+
+int joker_udp_sink(void *opaque, const unsigned char *data, int size)
+{
+	return joker_udp_write((struct joker_udp_t *)opaque, data, size);
+}
+
+/* sleep until more data queued (or timeout) */
+static void udp_wait(struct joker_udp_t *u, int64_t avail, int timeout_us)
+{
+	struct timeval now;
+	struct timespec deadline;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_us / 1000000;
+	deadline.tv_nsec = (now.tv_usec + timeout_us % 1000000) * 1000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&u->mux);
+	__atomic_store_n(&u->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&u->head, __ATOMIC_SEQ_CST) - u->tail == avail &&
+			!__atomic_load_n(&u->cancel, __ATOMIC_ACQUIRE))
+		pthread_cond_timedwait(&u->cond, &u->mux, &deadline);
+	__atomic_store_n(&u->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&u->mux);
+}
+
+static unsigned char * udp_ptr(struct joker_udp_t *u, int64_t off)
+{
+	return u->buf + off % u->size;
+}
+
+/* measure input bitrate (used for pacing if no PCR) */
+static void udp_measure(struct joker_udp_t *u, uint64_t now)
+{
+	int64_t in = __atomic_load_n(&u->in_bytes, __ATOMIC_RELAXED);
+
+	if (!u->in_time) {
+		u->in_time = now;
+		u->in_last = in;
+	} else if (now - u->in_time >= 1000000) {
+		u->in_rate = (double)(in - u->in_last) / (now - u->in_time);
+		u->in_time = now;
+		u->in_last = in;
+	}
+
+	// output bitrate for statistics
+	if (!u->rate_time) {
+		u->rate_time = now;
+	} else if (now - u->rate_time >= 1000000) {
+		__atomic_store_n(&u->stats.bitrate,
+				(u->stats.bytes - u->rate_bytes) * 8 * 1000000 / (now - u->rate_time),
+				__ATOMIC_RELAXED);
+		u->rate_time = now;
+		u->rate_bytes = u->stats.bytes;
+	}
+}
+
+/* when datagram at 'off' should be sent (usec, see getus)
+ * datagram with PCR sent at PCR time. Others spread by PCR bitrate
+ * (bytes between two last PCRs) or by measured input bitrate */
+static uint64_t udp_due(struct joker_udp_t *u, int64_t off, int len, uint64_t now)
+{
+	unsigned char *pkt = NULL;
+	int64_t pcr = -1, p = 0;
+	uint64_t due = now;
+	int i = 0, pid = 0;
+
+	if (u->flags & JOKER_UDP_NO_PACING)
+		return now;
+
+	for (i = 0; i < len; i += TS_SIZE) {
+		pkt = udp_ptr(u, off + i);
+		pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+		if ((u->pcr_pid < 0 || pid == u->pcr_pid) && (p = ts_pcr(pkt)) >= 0) {
+			u->pcr_pid = pid;
+			pcr = p;
+			break;
+		}
+	}
+
+	if (pcr >= 0) {
+		if (u->pcr_base < 0 || pcr < u->pcr_last ||
+				pcr - u->pcr_last > UDP_WINDOW_US * PCR_TICKS_US) {
+			// first PCR, wrap or discontinuity. start new timeline
+			u->pcr_base = pcr;
+			u->time_base = now;
+		} else if (pcr > u->pcr_last) {
+			u->pcr_rate = (double)u->pcr_bytes / (pcr - u->pcr_last);
+		}
+		u->pcr_last = pcr;
+		u->pcr_bytes = 0;
+		due = u->time_base + (pcr - u->pcr_base) / PCR_TICKS_US;
+	} else if (u->pcr_base >= 0 && u->pcr_rate > 0) {
+		due = u->time_base + (u->pcr_last - u->pcr_base +
+				(int64_t)(u->pcr_bytes / u->pcr_rate)) / PCR_TICKS_US;
+	} else if (u->in_rate > 0 && u->last_due) {
+		due = u->last_due + (uint64_t)(u->last_len / u->in_rate);
+	}
+	u->pcr_bytes += len;
+
+	// too late (input stalled) or too early (clock drift). catch up
+	if (due + UDP_WINDOW_US < now || due > now + UDP_WINDOW_US) {
+		u->time_base += now - due;
+		due = now;
+	}
+	// queue almost full. send as fast as possible
+	if (__atomic_load_n(&u->head, __ATOMIC_ACQUIRE) - off > u->size / 2)
+		due = now;
+
+	u->last_due = due;
+	u->last_len = len;
+
+	return due;
+}
+
+static void udp_rtp_header(struct joker_udp_t *u, unsigned char *hdr, uint64_t due)
+{
+	uint32_t ts = (uint32_t)(due * 9 / 100); // 90kHz
+
+	hdr[0] = 0x80; // version 2
+	hdr[1] = RTP_PAYLOAD_MP2T;
+	hdr[2] = u->seq >> 8;
+	hdr[3] = u->seq & 0xff;
+	hdr[4] = ts >> 24;
+	hdr[5] = ts >> 16;
+	hdr[6] = ts >> 8;
+	hdr[7] = ts;
+	hdr[8] = u->ssrc >> 24;
+	hdr[9] = u->ssrc >> 16;
+	hdr[10] = u->ssrc >> 8;
+	hdr[11] = u->ssrc;
+	u->seq++;
+}
+
+/* send prepared datagrams. Failed datagrams are dropped */
+static void udp_send(struct joker_udp_t *u, struct iovec (*iov)[3], int *iovcnt,
+		int *lens, int count)
+{
+	int i = 0, sent = 0, ret = 0;
+#ifdef __linux__
+	struct mmsghdr msgs[JOKER_UDP_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < count; i++) {
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = iovcnt[i];
+	}
+
+	while (sent < count) {
+		ret = sendmmsg(u->fd, msgs + sent, count - sent, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			// no receiver (ECONNREFUSED), buffer full, etc. drop datagram
+			UDP_STAT_ADD(u, errors, 1);
+			UDP_STAT_ADD(u, dropped, lens[sent] / TS_SIZE);
+			sent++;
+			continue;
+		}
+		for (i = sent; i < sent + ret; i++) {
+			UDP_STAT_ADD(u, datagrams, 1);
+			UDP_STAT_ADD(u, packets, lens[i] / TS_SIZE);
+			UDP_STAT_ADD(u, bytes, lens[i]);
+		}
+		sent += ret;
+	}
+#else
+	unsigned char dgram[RTP_HEADER_SIZE + UDP_DATAGRAM];
+	int len = 0, j = 0;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0, len = 0; j < iovcnt[i]; j++) {
+			memcpy(dgram + len, iov[i][j].iov_base, iov[i][j].iov_len);
+			len += iov[i][j].iov_len;
+		}
+		if (send(u->fd, (const char *)dgram, len, 0) != len) {
+			UDP_STAT_ADD(u, errors, 1);
+			UDP_STAT_ADD(u, dropped, lens[i] / TS_SIZE);
+			continue;
+		}
+		UDP_STAT_ADD(u, datagrams, 1);
+		UDP_STAT_ADD(u, packets, lens[i] / TS_SIZE);
+		UDP_STAT_ADD(u, bytes, lens[i]);
+	}
+#endif
+}
+
+void* udp_worker(void * data)
+{
+	struct joker_udp_t *u = (struct joker_udp_t *)data;
+	unsigned char rtp[JOKER_UDP_BATCH][RTP_HEADER_SIZE];
+	struct iovec iov[JOKER_UDP_BATCH][3];
+	int iovcnt[JOKER_UDP_BATCH], lens[JOKER_UDP_BATCH];
+	int64_t head = 0, off = 0, len = 0, part = 0;
+	uint64_t now = 0;
+	int n = 0, j = 0;
+
+	while (!__atomic_load_n(&u->cancel, __ATOMIC_ACQUIRE)) {
+		head = __atomic_load_n(&u->head, __ATOMIC_ACQUIRE);
+		now = getus();
+		udp_measure(u, now);
+
+		if (head == u->tail) {
+			u->partial_time = 0;
+			udp_wait(u, 0, 100000);
+			continue;
+		}
+		if (head - u->tail < UDP_DATAGRAM) {
+			// wait for full datagram. Send what we have if stream stopped
+			if (!u->partial_time)
+				u->partial_time = now;
+			if (now - u->partial_time < UDP_FLUSH_US) {
+				udp_wait(u, head - u->tail, UDP_FLUSH_US);
+				continue;
+			}
+		}
+		u->partial_time = 0;
+
+		// collect datagrams which are due
+		for (n = 0, off = u->tail; n < JOKER_UDP_BATCH && off < head; n++) {
+			len = head - off;
+			if (len > UDP_DATAGRAM)
+				len = UDP_DATAGRAM;
+			if (len < UDP_DATAGRAM && n)
+				break; // partial datagram only alone
+
+			if (u->due_off != off) {
+				u->due_time = udp_due(u, off, len, now);
+				u->due_off = off;
+			}
+			if (u->due_time > now + UDP_SLACK_US)
+				break;
+
+			j = 0;
+			if (u->flags & JOKER_UDP_RTP) {
+				udp_rtp_header(u, rtp[n], u->due_time);
+				iov[n][j].iov_base = rtp[n];
+				iov[n][j++].iov_len = RTP_HEADER_SIZE;
+			}
+			// datagram can cross end of queue
+			part = u->size - off % u->size;
+			iov[n][j].iov_base = udp_ptr(u, off);
+			iov[n][j++].iov_len = len < part ? len : part;
+			if (len > part) {
+				iov[n][j].iov_base = u->buf;
+				iov[n][j++].iov_len = len - part;
+			}
+			iovcnt[n] = j;
+			lens[n] = len;
+			off += len;
+		}
+
+		if (n) {
+			udp_send(u, iov, iovcnt, lens, n);
+			__atomic_store_n(&u->tail, off, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		// next datagram is not due yet
+		if (u->due_time > now)
+			usleep(u->due_time - now);
+	}
+
+	return NULL;
+}
+
+/* joker_udp_attach: copy TS from own pool reader to queue */
+void* udp_feeder(void * data)
+{
+	struct joker_udp_t *u = (struct joker_udp_t *)data;
+	struct iovec iov[64];
+	int n = 0, i = 0;
+
+	while (!__atomic_load_n(&u->cancel, __ATOMIC_ACQUIRE)) {
+		n = ts_reader_borrow(u->reader, iov, 64, TS_SIZE * 1000);
+		if (n <= 0)
+			break; // TS processing stopped or reader cancelled
+
+		for (i = 0; i < n; i++)
+			joker_udp_write(u, iov[i].iov_base, iov[i].iov_len);
+		ts_reader_release(u->reader);
+	}
+
+	return NULL;
+}
+
+int joker_udp_attach(struct joker_udp_t *u, struct big_pool_t *pool)
+{
+	int ret = 0;
+
+	if (!u || !pool || u->reader)
+		return -EINVAL;
+
+	u->reader = ts_reader_open(pool, 0);
+	if (!u->reader)
+		return -ENOMEM;
+
+	ret = pthread_create(&u->feeder, NULL, udp_feeder, (void *)u);
+	if (ret) {
+		printf("ERROR: can't start UDP feeder thread. code=%d\n", ret);
+		ts_reader_close(u->reader);
+		u->reader = NULL;
+		return -EIO;
+	}
+	u->feeding = 1;
+
+	return 0;
+}
+
+int joker_udp_get_stats(struct joker_udp_t *u, struct joker_udp_stats_t *stats)
+{
+	if (!u || !stats)
+		return -EINVAL;
+
+	stats->packets = __atomic_load_n(&u->stats.packets, __ATOMIC_RELAXED);
+	stats->datagrams = __atomic_load_n(&u->stats.datagrams, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&u->stats.bytes, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&u->stats.dropped, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&u->stats.errors, __ATOMIC_RELAXED);
+	stats->bitrate = __atomic_load_n(&u->stats.bitrate, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void udp_free(struct joker_udp_t *u)
+{
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u->buf);
+	pthread_mutex_destroy(&u->mux);
+	pthread_cond_destroy(&u->cond);
+	free(u);
+}
+
+/* connected UDP socket. Datagrams sent without address */
+static int udp_socket(const char *addr, int port)
+{
+	struct addrinfo hints, *res = NULL;
+	char service[16];
+	int fd = -1, ttl = JOKER_UDP_TTL, sndbuf = UDP_SNDBUF;
+
+#ifdef __WIN32__
+	WORD versionWanted = MAKEWORD(2, 2);
+	WSADATA wsaData;
+	WSAStartup(versionWanted, &wsaData);
+#endif
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(addr, service, &hints, &res) || !res) {
+		printf("Can't resolve UDP output address '%s'\n", addr);
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen)) {
+		printf("Can't open UDP output %s:%d error=%s (%d)\n",
+				addr, port, strerror(errno), errno);
+		if (fd >= 0)
+			close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	// ignored for unicast
+	if (res->ai_family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (const char *)&ttl, sizeof(ttl));
+	else
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&ttl, sizeof(ttl));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&sndbuf, sizeof(sndbuf));
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+struct joker_udp_t * joker_udp_open(const char *addr, int port, int flags, int pcr_pid)
+{
+	struct joker_udp_t *u = NULL;
+	int ret = 0;
+
+	if (!addr || port <= 0 || port > 65535)
+		return NULL;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+	pthread_mutex_init(&u->mux, NULL);
+	pthread_cond_init(&u->cond, NULL);
+	u->flags = flags;
+	u->pcr_pid = pcr_pid;
+	u->pcr_base = -1;
+	u->due_off = -1;
+	u->ssrc = (uint32_t)getus() ^ (uint32_t)getpid();
+	u->size = JOKER_UDP_QUEUE_SIZE;
+
+	u->fd = udp_socket(addr, port);
+	if (u->fd < 0)
+		goto fail;
+
+	u->buf = malloc(u->size);
+	if (!u->buf)
+		goto fail;
+
+	ret = pthread_create(&u->thread, NULL, udp_worker, (void *)u);
+	if (ret) {
+		printf("ERROR: can't start UDP output thread. code=%d\n", ret);
+		goto fail;
+	}
+	printf("UDP%s output: %s:%d \n", flags & JOKER_UDP_RTP ? "/RTP" : "", addr, port);
+
+	return u;
+fail:
+	udp_free(u);
+	return NULL;
+}
+
+void joker_udp_close(struct joker_udp_t *u)
+{
+	if (!u)
+		return;
+
+	__atomic_store_n(&u->cancel, 1, __ATOMIC_RELEASE);
+	if (u->feeding) {
+		ts_reader_wakeup(u->reader);
+		pthread_join(u->feeder, NULL);
+	}
+	if (u->reader)
+		ts_reader_close(u->reader);
+
+	pthread_mutex_lock(&u->mux);
+	pthread_cond_signal(&u->cond);
+	pthread_mutex_unlock(&u->mux);
+	pthread_join(u->thread, NULL);
+
+	udp_free(u);
+}
@@ -7,6 +7,9 @@
  * GPLv2
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU affinity, thread names */
+#endif
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,9 +18,21 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #include <joker_tv.h>
 #include <joker_ci.h>
 #include <joker_fpga.h>
+#include <u_drv_data.h>
+#include <joker_writer.h>
+
+// save_ts: iovecs borrowed at once
+#define SAVE_TS_IOV 64
 
 /* get current time in usec */
 uint64_t getus() {
@@ -26,6 +41,112 @@ uint64_t getus() {
 	return tv.tv_sec*(uint64_t)1000000+tv.tv_usec;
 }
 
+static const char *thread_names[JOKER_THREAD_MAX] = {
+	"usb", "ts", "service", "worker"
+};
+
+int joker_thread_setup(struct joker_t *joker, int id)
+{
+	struct joker_thread_params_t *params = NULL;
+	struct sched_param param;
+	char name[16];
+	int ret = 0, rc = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	int cpu = 0;
+#endif
+
+	if (!joker || id < 0 || id >= JOKER_THREAD_MAX)
+		return -EINVAL;
+
+	params = &joker->threads[id];
+
+	// name visible in top, gdb, etc. 15 chars max
+	snprintf(name, sizeof(name), "joker-%s", thread_names[id]);
+#if defined(__linux__)
+	pthread_setname_np(pthread_self(), name);
+#elif defined(__APPLE__)
+	pthread_setname_np(name);
+#endif
+
+#ifdef __linux__
+	if (params->cpu_mask) {
+		CPU_ZERO(&set);
+		for (cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++)
+			if (params->cpu_mask & (1ULL << cpu))
+				CPU_SET(cpu, &set);
+		if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+			printf("%s: can't set CPU mask 0x%llx for %s thread. error=%s (%d)\n",
+					__func__, (unsigned long long)params->cpu_mask,
+					name, strerror(rc), rc);
+			ret = -rc;
+		}
+	}
+
+	// nice is per thread under Linux
+	if (params->nice &&
+			setpriority(PRIO_PROCESS, syscall(SYS_gettid), params->nice)) {
+		rc = errno;
+		printf("%s: can't set nice %d for %s thread. error=%s (%d)\n",
+				__func__, params->nice, name, strerror(rc), rc);
+		ret = -rc;
+	}
+#endif
+
+	if (params->policy != JOKER_SCHED_DEFAULT) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = params->priority;
+		rc = pthread_setschedparam(pthread_self(),
+				params->policy == JOKER_SCHED_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+		if (rc) {
+			printf("%s: can't set realtime priority %d for %s thread. error=%s (%d)\n",
+					__func__, params->priority, name, strerror(rc), rc);
+			ret = -rc;
+		}
+	}
+
+	return ret;
+}
+
+int joker_thread_parse(struct joker_t *joker, char *str)
+{
+	struct joker_thread_params_t *params = NULL;
+	char *pt = NULL;
+	int id = 0;
+
+	if (!joker || !str)
+		return -EINVAL;
+
+	pt = strtok(str, ":");
+	if (!pt)
+		return -EINVAL;
+	for (id = 0; id < JOKER_THREAD_MAX; id++)
+		if (!strcasecmp(pt, thread_names[id]))
+			break;
+	if (id == JOKER_THREAD_MAX) {
+		printf("unknown thread '%s'. Use usb, ts, service or worker\n", pt);
+		return -EINVAL;
+	}
+	params = &joker->threads[id];
+
+	if ((pt = strtok(NULL, ":"))) {
+		if (!strcasecmp(pt, "fifo"))
+			params->policy = JOKER_SCHED_FIFO;
+		else if (!strcasecmp(pt, "rr"))
+			params->policy = JOKER_SCHED_RR;
+		else
+			params->policy = JOKER_SCHED_DEFAULT;
+	}
+	if ((pt = strtok(NULL, ":")))
+		params->priority = atoi(pt);
+	if ((pt = strtok(NULL, ":")))
+		params->nice = atoi(pt);
+	if ((pt = strtok(NULL, ":")))
+		params->cpu_mask = strtoull(pt, NULL, 0);
+
+	return 0;
+}
+
 void hexdump(unsigned char * buf, int size)
 {
 	int i = 0, printed = 0, padding = 0;
@@ -122,11 +243,12 @@ int validate_ts(struct joker_t * joker, int timeout, int min_count, int max_err)
 	err_count = 0;
 	total_count = 0;
 	while((start + timeout) > time(0)) {
-		buf_len = read_ts_data(joker->pool, buf, read_once);
-		if (buf_len < 0) {
-			usleep(1000);
-			continue;
-		}
+		// wakeup at least every 100ms to check timeout
+		buf_len = read_ts_data_timeout(joker->pool, buf, read_once, read_once, 100);
+		if (buf_len < 0)
+			break;
+		if (!buf_len && (joker->pool->eof || joker->pool->cancel))
+			break; // TS processing stopped
 
 		for (i = 0; i < buf_len; ) {
 			pkt = buf + i;
@@ -152,7 +274,8 @@ int validate_ts(struct joker_t * joker, int timeout, int min_count, int max_err)
 }
 
 /* get raw TS and save it to output file
-   reading about 18K at once
+   TS borrowed from capture buffers (no copy) and written by writer thread
+   with big chunks
    limit amount of bytes to save. 0 for unlimited (call is blocked !).
 
    return saved bytes if success
@@ -160,48 +283,53 @@ int validate_ts(struct joker_t * joker, int timeout, int min_count, int max_err)
    */
 int64_t save_ts(struct joker_t *joker, char *filename, int64_t limit)
 {
-	FILE * out = NULL;
+	struct joker_writer_t *out = NULL;
 	struct big_pool_t *pool;
-	unsigned char *res = NULL;
-	int res_len = 0, read_once = 0;
-	int64_t total_len = 0;
+	struct iovec iov[SAVE_TS_IOV];
+	int res_len = 0, read_once = 0, n = 0, i = 0;
+	int64_t total_len = 0, ret = 0;
 
 	if (!joker || !joker->pool || !filename )
 		return -EINVAL;
 
 	pool = joker->pool;
 
-	out = fopen((char*)filename, "w+b");
-	if (!out){
-		printf("Can't open out file '%s' error=%s (%d)\n",
-				filename, errno, strerror(errno));
+	// TS reader can wait for disk. ring buffer absorbs it
+	out = joker_writer_open(filename, JOKER_WRITER_BLOCK, 0, 0);
+	if (!out)
 		return -EIO;
-	} else {
-		printf("TS outfile:%s \n", filename);
-	}
+	printf("TS outfile:%s \n", filename);
 
 	/* get raw TS and save it to output file */
-	/* reading about 18K at once */
-	read_once = TS_SIZE * 100;
-	res = (unsigned char*)malloc(read_once);
-	if (!res) {
-		printf("Can't alloc mem for TS \n");
-		return -1;
-	}
+	/* borrowing about 188K at once */
+	read_once = TS_SIZE * 1000;
 
 	while( limit == 0 || (limit > 0 && total_len < limit) ) {
-		res_len = read_ts_data(pool, res, read_once);
-		jdebug("%s: %d bytes read \n", __func__, res_len);
+		n = ts_read_borrow(pool, iov, SAVE_TS_IOV, read_once);
+		jdebug("%s: %d iovecs borrowed \n", __func__, n);
 
 		/* save to output file */
-		if (res_len > 0)
-			fwrite(res, res_len, 1, out);
-		else
-			usleep(1000); // TODO: rework this (condwait ?)
+		if (n > 0) {
+			res_len = 0;
+			for (i = 0; i < n; i++) {
+				if (joker_writer_write(out, iov[i].iov_base, iov[i].iov_len))
+					break; // write failed
+				res_len += iov[i].iov_len;
+			}
+			ts_read_release(pool);
+			if (i < n)
+				break;
+		} else {
+			// source finished (replay) or TS processing stopped
+			break;
+		}
 
 		total_len += res_len;
+		res_len = 0;
 	}
-	fclose(out);
+
+	if ((ret = joker_writer_close(out)) < 0)
+		return ret;
 
 	return total_len;
 }
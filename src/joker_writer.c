@@ -0,0 +1,350 @@
+/*
+ * Joker TV
+ * asynchronous file writer
+ *
+ * chunks circulate between two lock-free queues:
+ * free chunks (writer thread -> producer) and
+ * full chunks (producer -> writer thread)
+ * partial chunk of idle producer taken by writer thread (cur_mux)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT, fallocate */
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <joker_queue.h>
+#include <joker_utils.h>
+#include <joker_writer.h>
+
+// buffers alignment (required for O_DIRECT)
+#define WRITER_ALIGN 4096
+// preallocate file space by this step
+#define WRITER_PREALLOC_STEP (256*1024*1024LL)
+// write partially filled chunk if it is older (usec)
+#define WRITER_FLUSH_US 1000000
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct writer_chunk_t
+{
+	unsigned char *data;
+	int size;
+};
+
+struct joker_writer_t
+{
+	int fd;
+	int flags;
+	int direct; /* O_DIRECT active */
+	int chunk_size;
+	int count;
+	struct writer_chunk_t *chunks;
+
+	/* producer side
+	 * writer thread takes stale partial chunk (see writer_flush_stale) */
+	pthread_mutex_t cur_mux;
+	struct writer_chunk_t *cur;
+	uint64_t cur_time; /* first byte in current chunk */
+	int64_t dropped;
+
+	/* chunks ready for producer */
+	struct joker_queue_t *free_queue;
+	/* chunks ready for writing */
+	struct joker_queue_t *full_queue;
+
+	/* writer thread side */
+	pthread_t thread;
+	int cancel;
+	int error;
+	int64_t written;
+	int64_t prealloc_end;
+};
+
+static int writer_write_all(struct joker_writer_t *w, unsigned char *data, int size)
+{
+	ssize_t ret = 0;
+
+	while (size > 0) {
+		ret = write(w->fd, data, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -EIO;
+		data += ret;
+		size -= ret;
+		w->written += ret;
+	}
+
+	return 0;
+}
+
+static void writer_flush_chunk(struct joker_writer_t *w, struct writer_chunk_t *chunk)
+{
+	int off = 0;
+
+	if (w->error)
+		return;
+
+#ifdef __linux__
+	if (w->flags & JOKER_WRITER_PREALLOC && w->written + chunk->size > w->prealloc_end) {
+		// keep file size. space reserved only
+		if (!fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->prealloc_end, WRITER_PREALLOC_STEP))
+			w->prealloc_end += WRITER_PREALLOC_STEP;
+		else
+			w->flags &= ~JOKER_WRITER_PREALLOC; // not supported by filesystem
+	}
+
+	if (w->direct && chunk->size % WRITER_ALIGN) {
+		// last chunk. write aligned part directly and rest through page cache
+		off = chunk->size - chunk->size % WRITER_ALIGN;
+		if (off && writer_write_all(w, chunk->data, off))
+			goto err;
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		w->direct = 0;
+	}
+#endif
+
+	if (writer_write_all(w, chunk->data + off, chunk->size - off))
+		goto err;
+
+	return;
+err:
+	printf("%s: write failed. error=%s (%d)\n", __func__, strerror(errno), errno);
+	__atomic_store_n(&w->error, -EIO, __ATOMIC_RELEASE);
+}
+
+/* low bitrate or producer stopped writing
+ * do not keep partial chunk in memory for too long
+ * O_DIRECT needs aligned writes so only full chunks written */
+static void writer_flush_stale(struct joker_writer_t *w)
+{
+	struct writer_chunk_t *chunk = NULL;
+
+	// busy producer checks it itself
+	if (w->direct || pthread_mutex_trylock(&w->cur_mux))
+		return;
+	if (w->cur && w->cur->size && getus() - w->cur_time > WRITER_FLUSH_US) {
+		chunk = w->cur;
+		w->cur = NULL;
+	}
+	pthread_mutex_unlock(&w->cur_mux);
+
+	if (chunk) {
+		writer_flush_chunk(w, chunk);
+		chunk->size = 0;
+		joker_queue_push(w->free_queue, chunk);
+	}
+}
+
+void* writer_worker(void * data)
+{
+	struct joker_writer_t *w = (struct joker_writer_t *)data;
+	struct writer_chunk_t *chunk = NULL;
+
+	while (1) {
+		chunk = joker_queue_pop_wait(w->full_queue, 100 /* ms */);
+		if (!chunk) {
+			if (__atomic_load_n(&w->cancel, __ATOMIC_ACQUIRE) &&
+					!joker_queue_count(w->full_queue))
+				break;
+			writer_flush_stale(w);
+			continue;
+		}
+
+		writer_flush_chunk(w, chunk);
+		chunk->size = 0;
+		joker_queue_push(w->free_queue, chunk);
+	}
+
+	return NULL;
+}
+
+/* get free chunk for producer */
+static struct writer_chunk_t * writer_get_chunk(struct joker_writer_t *w)
+{
+	struct writer_chunk_t *chunk = NULL;
+
+	chunk = joker_queue_pop(w->free_queue);
+	while (!chunk && w->flags & JOKER_WRITER_BLOCK &&
+			!__atomic_load_n(&w->error, __ATOMIC_ACQUIRE))
+		chunk = joker_queue_pop_wait(w->free_queue, 100 /* ms */);
+
+	return chunk;
+}
+
+/* pass current chunk to writer thread */
+static void writer_submit(struct joker_writer_t *w)
+{
+	// never fails. queue can hold all chunks
+	joker_queue_push(w->full_queue, w->cur);
+	w->cur = NULL;
+}
+
+int joker_writer_write(struct joker_writer_t *w, const void *data, int size)
+{
+	const unsigned char *ptr = (const unsigned char *)data;
+	int part = 0;
+
+	if (!w || !data || size < 0)
+		return -EINVAL;
+
+	if (__atomic_load_n(&w->error, __ATOMIC_ACQUIRE))
+		return -EIO;
+
+	// writer thread only try-locks it. Never waits for producer
+	pthread_mutex_lock(&w->cur_mux);
+	while (size > 0) {
+		if (!w->cur) {
+			w->cur = writer_get_chunk(w);
+			if (!w->cur) {
+				w->dropped += size;
+				pthread_mutex_unlock(&w->cur_mux);
+				return -EAGAIN;
+			}
+			w->cur_time = getus();
+		}
+
+		part = w->chunk_size - w->cur->size;
+		if (part > size)
+			part = size;
+		memcpy(w->cur->data + w->cur->size, ptr, part);
+		w->cur->size += part;
+		ptr += part;
+		size -= part;
+
+		if (w->cur->size == w->chunk_size)
+			writer_submit(w);
+	}
+
+	// low bitrate. do not keep data in memory for too long
+	// O_DIRECT needs aligned writes so only full chunks written
+	if (w->cur && !w->direct && getus() - w->cur_time > WRITER_FLUSH_US)
+		writer_submit(w);
+	pthread_mutex_unlock(&w->cur_mux);
+
+	return 0;
+}
+
+static void writer_free(struct joker_writer_t *w)
+{
+	int i = 0;
+
+	if (w->chunks) {
+		for (i = 0; i < w->count; i++)
+			free(w->chunks[i].data);
+		free(w->chunks);
+	}
+	joker_queue_free(w->free_queue);
+	joker_queue_free(w->full_queue);
+	if (w->fd >= 0)
+		close(w->fd);
+	pthread_mutex_destroy(&w->cur_mux);
+	free(w);
+}
+
+struct joker_writer_t * joker_writer_open(const char *filename, int flags,
+		int chunk_size, int chunks)
+{
+	struct joker_writer_t *w = NULL;
+	void *mem = NULL;
+	int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+	int i = 0, ret = 0;
+
+	if (!filename)
+		return NULL;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->fd = -1;
+	pthread_mutex_init(&w->cur_mux, NULL);
+	w->flags = flags;
+	w->chunk_size = chunk_size > 0 ? chunk_size : JOKER_WRITER_CHUNK_SIZE;
+	w->count = chunks > 0 ? chunks : JOKER_WRITER_CHUNKS;
+	// O_DIRECT needs aligned size
+	w->chunk_size = (w->chunk_size + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+
+#ifdef __linux__
+	if (flags & JOKER_WRITER_DIRECT) {
+		w->fd = open(filename, open_flags | O_DIRECT, 0644);
+		if (w->fd >= 0)
+			w->direct = 1;
+		else
+			printf("%s: O_DIRECT not supported for '%s'. Using page cache \n",
+					__func__, filename);
+	}
+#endif
+	if (w->fd < 0)
+		w->fd = open(filename, open_flags, 0644);
+	if (w->fd < 0) {
+		printf("Can't open out file '%s' error=%s (%d)\n",
+				filename, strerror(errno), errno);
+		goto fail;
+	}
+
+	w->free_queue = joker_queue_alloc(w->count);
+	w->full_queue = joker_queue_alloc(w->count);
+	w->chunks = calloc(w->count, sizeof(*w->chunks));
+	if (!w->free_queue || !w->full_queue || !w->chunks)
+		goto fail;
+
+	for (i = 0; i < w->count; i++) {
+		if (posix_memalign(&mem, WRITER_ALIGN, w->chunk_size))
+			goto fail;
+		w->chunks[i].data = mem;
+		joker_queue_push(w->free_queue, &w->chunks[i]);
+	}
+
+	ret = pthread_create(&w->thread, NULL, writer_worker, (void *)w);
+	if (ret) {
+		printf("ERROR: can't start writer thread. code=%d\n", ret);
+		goto fail;
+	}
+
+	return w;
+fail:
+	writer_free(w);
+	return NULL;
+}
+
+int64_t joker_writer_close(struct joker_writer_t *w)
+{
+	int64_t ret = 0;
+
+	if (!w)
+		return -EINVAL;
+
+	pthread_mutex_lock(&w->cur_mux);
+	if (w->cur && w->cur->size)
+		writer_submit(w);
+	pthread_mutex_unlock(&w->cur_mux);
+
+	__atomic_store_n(&w->cancel, 1, __ATOMIC_RELEASE);
+	joker_queue_wakeup(w->full_queue);
+	pthread_join(w->thread, NULL);
+
+	if (w->dropped)
+		printf("%s: writer too slow. %lld bytes dropped \n",
+				__func__, (long long)w->dropped);
+
+	ret = w->error ? w->error : w->written;
+	writer_free(w);
+
+	return ret;
+}
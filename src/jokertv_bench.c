@@ -0,0 +1,551 @@
+/*
+ * Joker TV
+ * capture pipeline micro-benchmark
+ *
+ * Synthetic ISOC transfers (tsgen-style pattern TS) generated in-process
+ * and pushed through capture core (same as record_callback) -> process_ts
+ * -> hooks -> read_ts_data. No hardware required.
+ *
+ * Reports ns/packet, allocations/sec, p50/p99 callback latency
+ * and maximum sustainable rate (Mbps)
+ *
+ * https://jokersys.com
+ * (c) Abylay Ospan, 2017
+ * aospan@jokersys.com
+ * GPLv2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <libusb.h>
+#include "joker_tv.h"
+#include "joker_utils.h"
+#include "u_drv_data.h"
+
+#define PATTERN_PID 0x177
+// pattern repeats every 256 packets. one PAT packet inside
+#define PATTERN_PKTS 256
+#define PATTERN_SIZE (PATTERN_PKTS * TS_SIZE)
+// max latency samples stored
+#define MAX_SAMPLES (1024*1024)
+// max sustainable rate search
+#define SEARCH_START_MBPS 100
+#define SEARCH_STEPS 6
+
+/* count heap allocations (glibc only) */
+#if defined(__GLIBC__)
+#define BENCH_ALLOC_COUNT 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static int count_allocs = 0;
+static uint64_t allocs = 0;
+
+void *malloc(size_t size)
+{
+	if (count_allocs)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (count_allocs)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (count_allocs)
+		__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+struct bench_opts_t {
+	double mbps; /* 0 - search maximum sustainable rate */
+	double seconds;
+	int packets; /* ISOC packets per transfer */
+	int packet_size; /* ISOC packet payload */
+	int misalign; /* random payload size (not aligned to TS_SIZE) */
+	int loss_ppm;
+	int zero_copy;
+	int replace_pat;
+	int hooks;
+	int workers; /* batch hooks worker threads */
+	int quiet;
+};
+
+struct bench_result_t {
+	double mbps_in; /* generated */
+	double mbps_out; /* received by reader */
+	double ns_per_pkt; /* capture core cost per TS packet */
+	double allocs_per_sec;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t pkts;
+	uint64_t errors; /* pattern errors seen by reader */
+	uint64_t dropped; /* dropped nodes/bytes in pipeline */
+	int behind; /* producer can't keep requested rate */
+};
+
+struct bench_t {
+	struct bench_opts_t *opts;
+	struct joker_t joker;
+	struct big_pool_t pool;
+	unsigned char pattern[PATTERN_SIZE];
+	int64_t pattern_off;
+
+	/* transfers ready for generator */
+	struct libusb_transfer *transfers[NUM_USB_BUFS_MAX];
+	struct libusb_transfer *free[NUM_USB_BUFS_MAX];
+	int count;
+	int free_count;
+	pthread_mutex_t mux;
+	pthread_cond_t cond;
+
+	uint32_t rand;
+	uint64_t *samples;
+	int samples_count;
+
+	/* reader */
+	pthread_t reader;
+	volatile int done;
+	uint64_t rd_bytes;
+	uint64_t rd_pkts;
+	uint64_t rd_errors;
+	uint64_t hook_pkts;
+};
+
+static uint64_t getns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t bench_rand(struct bench_t *b)
+{
+	b->rand ^= b->rand << 13;
+	b->rand ^= b->rand >> 17;
+	b->rand ^= b->rand << 5;
+	return b->rand;
+}
+
+/* tsgen-style pattern: payload filled with packet counter */
+static void pattern_init(struct bench_t *b)
+{
+	unsigned char *pkt = NULL;
+	int i = 0;
+
+	for (i = 0; i < PATTERN_PKTS; i++) {
+		pkt = b->pattern + i * TS_SIZE;
+		memset(pkt, i, TS_SIZE);
+		pkt[0] = TS_SYNC;
+		pkt[3] = 0x10 | (i & 0x0f);
+		if (i == PATTERN_PKTS - 1) {
+			// PAT (pid 0). for PAT replace path
+			pkt[1] = 0x40;
+			pkt[2] = 0x00;
+		} else {
+			pkt[1] = (PATTERN_PID >> 8) & 0x1f;
+			pkt[2] = PATTERN_PID & 0xff;
+		}
+	}
+}
+
+static void bench_hook(void *opaque, unsigned char *pkt)
+{
+	struct bench_t *b = (struct bench_t *)opaque;
+
+	b->hook_pkts++;
+}
+
+static void bench_batch_hook(void *opaque, unsigned char **pkts, int count)
+{
+	struct bench_t *b = (struct bench_t *)opaque;
+
+	b->hook_pkts += count;
+}
+
+/* transfer returned by TS pipeline (zero-copy mode) */
+static void bench_put(struct libusb_transfer *transfer)
+{
+	struct bench_t *b = (struct bench_t *)transfer->user_data;
+
+	pthread_mutex_lock(&b->mux);
+	b->free[b->free_count++] = transfer;
+	pthread_mutex_unlock(&b->mux);
+	pthread_cond_signal(&b->cond);
+}
+
+static struct libusb_transfer * bench_get(struct bench_t *b)
+{
+	struct libusb_transfer *transfer = NULL;
+
+	pthread_mutex_lock(&b->mux);
+	while (!b->free_count)
+		pthread_cond_wait(&b->cond, &b->mux);
+	transfer = b->free[--b->free_count];
+	pthread_mutex_unlock(&b->mux);
+
+	return transfer;
+}
+
+/* fill transfer like FPGA does. return generated bytes */
+static int bench_fill(struct bench_t *b, struct libusb_transfer *transfer)
+{
+	struct bench_opts_t *o = b->opts;
+	unsigned char *buf = NULL;
+	int i = 0, len = 0, part = 0, done = 0, total = 0;
+	int64_t off = 0;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		buf = transfer->buffer + i * o->packet_size;
+		len = o->packet_size;
+		if (o->misalign)
+			len = o->packet_size / 2 + bench_rand(b) % (o->packet_size / 2 + 1);
+
+		for (done = 0; done < len; done += part) {
+			off = b->pattern_off % PATTERN_SIZE;
+			part = PATTERN_SIZE - off;
+			if (part > len - done)
+				part = len - done;
+			memcpy(buf + done, b->pattern + off, part);
+			b->pattern_off += part;
+		}
+		total += len;
+
+		if (o->loss_ppm && (bench_rand(b) % 1000000) < (uint32_t)o->loss_ppm) {
+			transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_ERROR;
+			transfer->iso_packet_desc[i].actual_length = 0;
+		} else {
+			transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+			transfer->iso_packet_desc[i].actual_length = len;
+		}
+	}
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+
+	return total;
+}
+
+void* bench_reader(void * data)
+{
+	struct bench_t *b = (struct bench_t *)data;
+	unsigned char buf[TS_SIZE * 100];
+	unsigned char *pkt = NULL;
+	int n = 0, i = 0, pid = 0, last = -1;
+
+	while ((n = read_ts_data(&b->pool, buf, sizeof(buf))) > 0) {
+		for (i = 0; i + TS_SIZE <= n; i += TS_SIZE) {
+			pkt = buf + i;
+			pid = (pkt[1] & 0x1f) << 8 | pkt[2];
+			b->rd_pkts++;
+			if (pkt[0] != TS_SYNC) {
+				b->rd_errors++;
+				continue;
+			}
+			if (pid != PATTERN_PID)
+				continue;
+			// pattern continuity (PAT packet skipped)
+			if (last >= 0 && pkt[4] != (last + 1) % (PATTERN_PKTS - 1))
+				b->rd_errors++;
+			last = pkt[4];
+		}
+		b->rd_bytes += n;
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* one benchmark run with fixed rate (mbps 0 - unlimited) */
+static int bench_run(struct bench_opts_t *o, double mbps, struct bench_result_t *res)
+{
+	struct bench_t *b = NULL;
+	struct libusb_transfer *transfer = NULL;
+	struct joker_capture_stats_t st;
+	uint64_t start = 0, end = 0, t0 = 0, t1 = 0, target = 0, now = 0;
+	uint64_t gen_bytes = 0, capture_ns = 0, allocs_start = 0;
+	unsigned char *buf = NULL;
+	static unsigned char pat[TS_SIZE];
+	int i = 0, ret = 0;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	b->samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+	if (!b->samples) {
+		free(b);
+		return -ENOMEM;
+	}
+
+	b->opts = o;
+	b->rand = 1;
+	pthread_mutex_init(&b->mux, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	pattern_init(b);
+
+	b->joker.max_isoc_packets_count = o->packets;
+	b->joker.max_isoc_packets_size = o->packet_size;
+	INIT_LIST_HEAD(&b->pool.selected_programs_list);
+	b->pool.zero_copy = o->zero_copy;
+	b->pool.ts_workers = o->workers;
+	b->pool.stats_quiet = 1;
+	b->pool.transfer_release = bench_put;
+
+	if ((ret = ts_pipeline_start(&b->joker, &b->pool))) {
+		printf("Can't start TS pipeline. err=%d\n", ret);
+		goto out;
+	}
+
+	if (o->hooks == 1)
+		ts_subscribe(&b->pool, PATTERN_PID, bench_hook, b);
+	else if (o->hooks == 2)
+		ts_subscribe_batch(&b->pool, PATTERN_PID, bench_batch_hook, b);
+	if (o->replace_pat) {
+		memcpy(pat, b->pattern + (PATTERN_PKTS - 1) * TS_SIZE, TS_SIZE);
+		b->pool.generated_pat_pkt = (char *)pat;
+	}
+
+	for (i = 0; i < b->pool.usb_bufs; i++) {
+		transfer = libusb_alloc_transfer(o->packets);
+		buf = malloc(o->packets * o->packet_size);
+		if (!transfer || !buf) {
+			libusb_free_transfer(transfer);
+			free(buf);
+			break;
+		}
+		libusb_fill_iso_transfer(transfer, NULL, 0, buf, o->packets * o->packet_size,
+				o->packets, NULL, (void *)b, 0);
+		libusb_set_iso_packet_lengths(transfer, o->packet_size);
+		b->transfers[b->count++] = transfer;
+		b->free[b->free_count++] = transfer;
+	}
+
+	pthread_create(&b->reader, NULL, bench_reader, (void *)b);
+
+#ifdef BENCH_ALLOC_COUNT
+	allocs_start = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+	count_allocs = 1;
+#endif
+	start = getns();
+	end = start + (uint64_t)(o->seconds * 1000000000);
+	while ((now = getns()) < end) {
+		transfer = bench_get(b);
+		gen_bytes += bench_fill(b, transfer);
+
+		// capture core. same as record_callback
+		t0 = getns();
+		if (!ts_capture_transfer(&b->pool, transfer))
+			bench_put(transfer);
+		t1 = getns();
+		capture_ns += t1 - t0;
+		if (b->samples_count < MAX_SAMPLES)
+			b->samples[b->samples_count++] = t1 - t0;
+
+		if (mbps > 0) {
+			target = start + (uint64_t)(gen_bytes * 8 * 1000.0 / mbps);
+			now = getns();
+			if (target > now + 1000)
+				usleep((target - now) / 1000);
+		}
+	}
+	end = getns();
+#ifdef BENCH_ALLOC_COUNT
+	count_allocs = 0;
+	res->allocs_per_sec = (double)(__atomic_load_n(&allocs, __ATOMIC_RELAXED) -
+			allocs_start) * 1000000000 / (end - start);
+#else
+	res->allocs_per_sec = -1;
+#endif
+
+	// wait until everything delivered to reader
+	ts_pipeline_eof(&b->pool);
+	pthread_join(b->reader, NULL);
+
+	joker_get_capture_stats(&b->joker, &st);
+
+	qsort(b->samples, b->samples_count, sizeof(uint64_t), cmp_u64);
+	res->p50_ns = b->samples_count ? b->samples[b->samples_count / 2] : 0;
+	res->p99_ns = b->samples_count ? b->samples[(uint64_t)b->samples_count * 99 / 100] : 0;
+	res->mbps_in = (double)gen_bytes * 8 * 1000 / (end - start);
+	res->mbps_out = (double)b->rd_bytes * 8 * 1000 / (end - start);
+	res->pkts = b->rd_pkts;
+	res->ns_per_pkt = b->rd_pkts ? (double)capture_ns / b->rd_pkts : 0;
+	res->errors = b->rd_errors;
+	res->dropped = st.nodes_dropped + st.bytes_dropped;
+	res->behind = mbps > 0 && res->mbps_in < mbps * 0.95;
+
+	ts_pipeline_stop(&b->pool);
+	pool_uninit(&b->pool);
+
+out:
+	for (i = 0; i < b->count; i++) {
+		b->transfers[i]->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+		libusb_free_transfer(b->transfers[i]);
+	}
+	free(b->samples);
+	free(b);
+
+	return ret;
+}
+
+static void bench_print(const char *name, struct bench_result_t *res)
+{
+	printf("%-12s in %8.1f Mbps out %8.1f Mbps | capture %6.1f ns/pkt |"
+			" latency p50 %6.1f us p99 %6.1f us | allocs/sec %.1f | err %llu drop %llu%s\n",
+			name, res->mbps_in, res->mbps_out, res->ns_per_pkt,
+			res->p50_ns / 1000.0, res->p99_ns / 1000.0, res->allocs_per_sec,
+			(unsigned long long)res->errors, (unsigned long long)res->dropped,
+			res->behind ? " (behind)" : "");
+}
+
+static int sustainable(struct bench_opts_t *o, struct bench_result_t *res)
+{
+	// losses from -l option are expected. only pipeline drops count
+	return !res->dropped && !res->behind && (o->loss_ppm || !res->errors);
+}
+
+void help()
+{
+	printf("jokertv_bench: capture pipeline benchmark (no hardware required)\n");
+	printf("Usage:\n");
+	printf("	-b mbps		input rate. 0 - search max sustainable rate. Default: 0\n");
+	printf("	-t seconds	run time (one step if searching). Default: 2\n");
+	printf("	-n packets	ISOC packets per transfer. Default: %d\n", NUM_USB_PACKETS_HIGH_BW_ISOC);
+	printf("	-s size		ISOC packet size. Default: %d\n", USB_PACKET_SIZE_HIGH_BW_ISOC);
+	printf("	-m		misalign (random ISOC packet payload size)\n");
+	printf("	-l ppm		lost ISOC packets per million\n");
+	printf("	-z		zero-copy mode\n");
+	printf("	-r		replace PAT\n");
+	printf("	-k		disable hooks\n");
+	printf("	-B		batch hooks (one call per node)\n");
+	printf("	-w workers	call batch hooks from worker threads. Default: 0\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts_t o;
+	struct bench_result_t res;
+	double lo = 0, hi = 0, mid = 0, limit = 0;
+	char name[64];
+	int c = 0, i = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.seconds = 2;
+	o.packets = NUM_USB_PACKETS_HIGH_BW_ISOC;
+	o.packet_size = USB_PACKET_SIZE_HIGH_BW_ISOC;
+	o.hooks = 1;
+
+	while ((c = getopt (argc, argv, "b:t:n:s:ml:zrkBw:h")) != -1) {
+		switch (c)
+		{
+			case 'b':
+				o.mbps = atof(optarg);
+				break;
+			case 't':
+				o.seconds = atof(optarg);
+				break;
+			case 'n':
+				o.packets = atoi(optarg);
+				break;
+			case 's':
+				o.packet_size = atoi(optarg);
+				break;
+			case 'm':
+				o.misalign = 1;
+				break;
+			case 'l':
+				o.loss_ppm = atoi(optarg);
+				break;
+			case 'z':
+				o.zero_copy = 1;
+				break;
+			case 'r':
+				o.replace_pat = 1;
+				break;
+			case 'k':
+				o.hooks = 0;
+				break;
+			case 'B':
+				o.hooks = 2;
+				break;
+			case 'w':
+				o.workers = atoi(optarg);
+				break;
+			default:
+				help();
+				return 0;
+		}
+	}
+
+	if (o.packets <= 0 || o.packet_size < TS_SIZE) {
+		help();
+		return -1;
+	}
+
+	printf("transfer %dx%d bytes, misalign %d, loss %d ppm, zero-copy %d, PAT replace %d, hooks %d, workers %d\n",
+			o.packets, o.packet_size, o.misalign, o.loss_ppm, o.zero_copy, o.replace_pat, o.hooks,
+			o.workers);
+
+	if (o.mbps > 0) {
+		if (bench_run(&o, o.mbps, &res))
+			return -1;
+		bench_print("fixed", &res);
+		return 0;
+	}
+
+	// unlimited run gives upper bound
+	if (bench_run(&o, 0, &res))
+		return -1;
+	bench_print("unlimited", &res);
+	limit = res.mbps_in;
+
+	// find max sustainable rate
+	// double rate until drops then bisect
+	lo = 0;
+	hi = SEARCH_START_MBPS;
+	while (hi < limit) {
+		if (bench_run(&o, hi, &res))
+			return -1;
+		snprintf(name, sizeof(name), "%.0f Mbps", hi);
+		bench_print(name, &res);
+		if (!sustainable(&o, &res))
+			break;
+		lo = hi;
+		hi *= 2;
+	}
+
+	if (hi > limit)
+		hi = limit;
+	for (i = 0; i < SEARCH_STEPS && lo < hi; i++) {
+		mid = (lo + hi) / 2;
+		if (bench_run(&o, mid, &res))
+			return -1;
+		snprintf(name, sizeof(name), "%.0f Mbps", mid);
+		bench_print(name, &res);
+		if (sustainable(&o, &res))
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	printf("max sustainable rate: %.1f Mbps\n", lo);
+
+	return 0;
+}
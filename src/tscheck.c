@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include "joker_ts_sync.h"
 
 #define TS_SIZE 188
 #define TS_SIZE_ONCE 188000
@@ -64,7 +65,7 @@ int main(int argc, char **argv) {
 	int nbytes = 0;
 	int pid = 0;
 	int64_t off = 0;
-	int tail = 0;
+	int tail = 0, skip = 0;
 	int check_pattern = 0, check_counter = 0;
 	int64_t success_pattern = 0, success_counter = 0;
 	int64_t fail_pattern = 0, fail_counter = 0;
@@ -139,8 +140,12 @@ int main(int argc, char **argv) {
 				// printf("tail=%d i=%d \n", tail, i);
 				i+= tail;
 			} else {
-				off++;
-				i++;
+				// lost sync. jump to next packet start
+				skip = ts_sync_find(&pkt[i], nbytes - i, TS_SYNC_LOCK_COUNT);
+				if (skip <= 0) // keep possible partial packet for next round
+					skip = nbytes - i - TS_SIZE + 1;
+				off += skip;
+				i += skip;
 			}
 		}
 	}
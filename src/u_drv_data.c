@@ -14,6 +14,9 @@
  * https://tv.jokersys.com
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* memfd_create */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -23,12 +26,22 @@
 #include <stdint.h>
 #include <libusb.h>
 #include <pthread.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "joker_tv.h"
 #include "joker_ts.h"
 #include "joker_ts_filter.h"
 #include "joker_fpga.h"
 #include "u_drv_data.h"
 #include "joker_utils.h"
+#include "joker_queue.h"
+#include "joker_ts_sync.h"
+#include "joker_writer.h"
+#include "joker_timeshift.h"
+#include "joker_shm.h"
+#include "joker_demux.h"
 
 struct thread_opaq_t
 {
@@ -38,10 +51,146 @@ struct thread_opaq_t
 	pthread_t ts_thread;
 	pthread_cond_t cond_all;
 	pthread_mutex_t mux_all;
-	pthread_cond_t cond;
-	pthread_mutex_t mux;
+	/* readers freed space (TS_OVERFLOW_BLOCK) */
+	pthread_cond_t cond_space;
+	/* idle USB transfers */
+	pthread_mutex_t mux_usb;
+	/* pool and readers from ts_reader_open. Freed by last one
+	 * (reader can be closed after pool_uninit) */
+	int refs;
+};
+
+/* every reader has own position in retained data */
+struct ts_reader_t
+{
+	struct list_head list;
+	struct big_pool_t *pool; /* NULL after pool_uninit */
+	struct thread_opaq_t *threading; /* pool's one. Valid till reader closed */
+	int64_t off; /* stream offset of next byte to read */
+	int64_t dropped; /* skipped because of overflow */
+	int attached; /* in pool readers list */
+	int used;
+	int cancel; /* blocking calls return (ts_reader_wakeup) */
+
+	/* borrowed data (ts_reader_borrow) */
+	int borrowed;
+	int64_t hold; /* ring buffer kept from this offset. -1 if nothing held */
+	struct ts_node **held; /* zero-copy nodes referenced */
+	int held_count;
+	int held_max;
+	unsigned char *bounce; /* spilled data copied here */
+	int bounce_size;
+};
+
+/* PAT/SDT replacement used by TS thread (see ts_rewrite_prepare)
+ * copy of pool tables. rebuilt only when tables changed */
+struct ts_rewrite_t
+{
+	char *pat_src; /* pool generated_pat_pkt */
+	unsigned char pat[TS_SIZE];
+	unsigned char *sdt; /* copy of pool sdt_pkt_array */
+	int sdt_count;
+	int sdt_cur;
+};
+
+/* subscribers of one PID. Never changed after publishing
+ * (copy-on-write), so TS thread reads it without locks */
+struct ts_pid_subs_t
+{
+	int count;
+	int hooks; /* subs[0..hooks) per packet, subs[hooks..count) batch */
+	struct ts_pid_subs_t *next; /* retired list */
+	struct {
+		ts_hook_t hook;
+		ts_batch_hook_t batch;
+		void *opaque;
+	} subs[];
+};
+
+/* packets gathered for batch hooks (node order) */
+struct ts_batch_t
+{
+	unsigned char **pkts;
+	uint16_t *pids;
+	unsigned char *data; /* packets copy (worker jobs only) */
+	int size; /* capacity (packets) */
+	int count;
+};
+
+/* batch grouped by PID before calling hooks
+ * one per thread calling batch hooks */
+struct ts_group_t
+{
+	unsigned char **grouped;
+	int size; /* capacity (packets) */
+	uint16_t active[8192]; /* PIDs of batch */
+	int active_count;
+	int offsets[8192]; /* packets count, then PID group position */
+};
+
+struct ts_subs_t
+{
+	pthread_mutex_t mux; /* serialize ts_subscribe/ts_unsubscribe */
+	struct ts_pid_subs_t *pids[8192];
+	/* replaced arrays. freed by TS thread between nodes */
+	struct ts_pid_subs_t *retired;
+	/* replaced arrays workers could still use. freed when every
+	 * worker finished jobs started before (pending_seq) */
+	struct ts_pid_subs_t *pending;
+	uint64_t pending_seq[TS_WORKERS_MAX];
+	int batch_subs; /* batch hooks subscribed (all PIDs) */
+	/* batch hooks called by TS thread (no workers) */
+	struct ts_batch_t batch;
+	struct ts_group_t group;
+};
+
+/* batch hooks worker. Jobs (packets of one node) come from TS thread
+ * and go back to it when done (two SPSC queues) */
+struct ts_worker_t
+{
+	struct big_pool_t *pool;
+	pthread_t thread;
+	int running;
+	struct joker_queue_t *todo;
+	struct joker_queue_t *free;
+	struct ts_batch_t jobs[TS_WORKER_JOBS];
+	struct ts_batch_t *job; /* filled by TS thread now */
+	struct ts_group_t group;
+	/* jobs counters. See ts_workers_wait */
+	uint64_t started;
+	uint64_t finished;
+};
+
+struct ts_workers_t
+{
+	int count;
+	int need; /* packets in current node */
+	struct ts_worker_t *w;
 };
 
+/* preallocated node storage
+ * free nodes kept in lock-free stack (LIFO)
+ * nodes taken only by record_callback (libusb serialize callbacks)
+ * nodes returned by any thread (drop_ts_data) */
+struct ts_slab_t
+{
+	struct ts_node *nodes;
+	unsigned char *arena;
+	struct ts_seg *segs_arena;
+	int block_size; /* data bytes available in one node */
+	int segs_size; /* segments available in one node */
+	int count;
+	struct ts_node *free_head;
+	int free_count;
+};
+
+// statistics counters. updated lock-free
+#define STAT_ADD(pool, name, val) \
+	__atomic_add_fetch(&(pool)->stats.name, (uint64_t)(val), __ATOMIC_RELAXED)
+
+// iovecs used by read calls (data copied outside of lock)
+#define TS_READ_IOV 16
+
 struct loop_thread_opaq_t
 {
 	/* TS loopback thread */
@@ -51,6 +200,575 @@ struct loop_thread_opaq_t
 	int cancel;
 };
 
+/* room for 'need' packets. 'copy' - packets copied to batch storage
+ * return 0 if success */
+static int ts_batch_reserve(struct ts_batch_t *b, int need, int copy)
+{
+	if (need <= b->size)
+		return 0;
+
+	// first node or bigger node. rare
+	free(b->pkts);
+	free(b->pids);
+	free(b->data);
+	b->pkts = malloc(need * sizeof(*b->pkts));
+	b->pids = malloc(need * sizeof(*b->pids));
+	b->data = copy ? malloc(need * TS_SIZE) : NULL;
+	b->size = need;
+	if (!b->pkts || !b->pids || (copy && !b->data)) {
+		printf("%s: can't allocate %d packets. Batch hooks skipped\n", __func__, need);
+		free(b->pkts);
+		free(b->pids);
+		free(b->data);
+		b->pkts = NULL;
+		b->pids = NULL;
+		b->data = NULL;
+		b->size = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ts_batch_free(struct ts_batch_t *b)
+{
+	free(b->pkts);
+	free(b->pids);
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+/* worker for PID. Hash keeps neighbour PIDs on different workers */
+static inline struct ts_worker_t * ts_worker_of(struct ts_workers_t *ws, int pid)
+{
+	return &ws->w[(((uint32_t)pid * 2654435761U) >> 16) % ws->count];
+}
+
+/* job of worker for current node. TS thread
+ * return NULL if job not available (cancelled or no memory) */
+static struct ts_batch_t * ts_worker_job(struct big_pool_t *pool, struct ts_worker_t *w)
+{
+	struct ts_workers_t *ws = pool->workers;
+
+	// all jobs busy: worker is too slow. wait for it
+	while (!w->job) {
+		if (pool->cancel)
+			return NULL;
+		w->job = joker_queue_pop_wait(w->free, 100 /* ms */);
+		if (w->job)
+			ts_batch_reserve(w->job, ws->need, 1);
+	}
+
+	return w->job->size >= ws->need ? w->job : NULL;
+}
+
+/* gather packet for batch hooks. TS thread */
+static inline void ts_batch_add(struct big_pool_t *pool, unsigned char *pkt, int pid)
+{
+	struct ts_batch_t *b = &pool->subs->batch;
+
+	b->pkts[b->count] = pkt;
+	b->pids[b->count++] = pid;
+}
+
+/* call per packet hooks. Gather packet for batch hooks if 'batch' */
+static inline void ts_dispatch(struct big_pool_t *pool, unsigned char *pkt, int pid, int batch)
+{
+	struct ts_pid_subs_t *p = __atomic_load_n(&pool->subs->pids[pid], __ATOMIC_ACQUIRE);
+	int i = 0;
+
+	if (!p)
+		return;
+
+	for (i = 0; i < p->hooks; i++)
+		p->subs[i].hook(p->subs[i].opaque, pkt);
+
+	if (batch && p->hooks < p->count)
+		ts_batch_add(pool, pkt, pid);
+}
+
+/* prepare gathering for node
+ * return 1 if packets should be gathered for batch hooks */
+static int ts_batch_prepare(struct big_pool_t *pool, struct ts_node *node)
+{
+	int need = node->size / TS_SIZE;
+
+	if (!__atomic_load_n(&pool->subs->batch_subs, __ATOMIC_RELAXED))
+		return 0;
+
+	// worker jobs reserved when taken
+	if (pool->workers)
+		pool->workers->need = need;
+
+	return !ts_batch_reserve(&pool->subs->batch, need, 0);
+}
+
+/* call batch hooks for gathered packets
+ * one call per subscriber and PID */
+static void ts_batch_call(struct big_pool_t *pool, struct ts_batch_t *b, struct ts_group_t *g)
+{
+	struct ts_pid_subs_t *p = NULL;
+	unsigned char **pkts = b->pkts;
+	int i = 0, k = 0, pid = 0, start = 0, end = 0;
+
+	if (!b->count)
+		return;
+
+	for (i = 0; i < b->count; i++)
+		if (!g->offsets[b->pids[i]]++)
+			g->active[g->active_count++] = b->pids[i];
+
+	// group by PID (counting sort). Single PID already grouped
+	if (g->active_count > 1) {
+		if (g->size < b->count) {
+			free(g->grouped);
+			g->grouped = malloc(b->count * sizeof(*g->grouped));
+			g->size = g->grouped ? b->count : 0;
+		}
+		if (!g->grouped) {
+			printf("%s: can't allocate %d packets. Batch hooks skipped\n", __func__, b->count);
+			for (k = 0; k < g->active_count; k++)
+				g->offsets[g->active[k]] = 0;
+			b->count = 0;
+			g->active_count = 0;
+			return;
+		}
+
+		for (k = 0; k < g->active_count; k++) {
+			pid = g->active[k];
+			end = start + g->offsets[pid];
+			g->offsets[pid] = start;
+			start = end;
+		}
+		for (i = 0; i < b->count; i++)
+			g->grouped[g->offsets[b->pids[i]]++] = b->pkts[i];
+		pkts = g->grouped;
+	}
+
+	// offsets[pid] is end of PID group now
+	start = 0;
+	for (k = 0; k < g->active_count; k++) {
+		pid = g->active[k];
+		end = g->offsets[pid];
+		g->offsets[pid] = 0;
+
+		p = __atomic_load_n(&pool->subs->pids[pid], __ATOMIC_ACQUIRE);
+		for (i = p ? p->hooks : 0; p && i < p->count; i++) {
+			jdebug("calling batch hook pid=0x%x count=%d\n", pid, end - start);
+			p->subs[i].batch(p->subs[i].opaque, pkts + start, end - start);
+		}
+		start = end;
+	}
+
+	b->count = 0;
+	g->active_count = 0;
+}
+
+/* node processed. Call batch hooks or pass jobs to workers */
+static void ts_batch_flush(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	struct ts_batch_t *b = &pool->subs->batch, *job = NULL;
+	struct ts_worker_t *w = NULL;
+	int i = 0;
+
+	if (!ws) {
+		ts_batch_call(pool, b, &pool->subs->group);
+		return;
+	}
+
+	// copy packets to jobs: node could be reused before workers done.
+	// PAT/SDT already rewritten here
+	for (i = 0; i < b->count; i++) {
+		job = ts_worker_job(pool, ts_worker_of(ws, b->pids[i]));
+		if (!job)
+			continue;
+		memcpy(job->data + job->count * TS_SIZE, b->pkts[i], TS_SIZE);
+		job->pkts[job->count] = job->data + job->count * TS_SIZE;
+		job->pids[job->count++] = b->pids[i];
+	}
+	b->count = 0;
+
+	for (i = 0; i < ws->count; i++) {
+		w = &ws->w[i];
+		if (!w->job)
+			continue;
+		// never full. Queue holds all jobs of worker
+		joker_queue_push(w->todo, w->job);
+		w->job = NULL;
+	}
+}
+
+static void* ts_worker(void *data)
+{
+	struct ts_worker_t *w = (struct ts_worker_t *)data;
+	struct big_pool_t *pool = w->pool;
+	struct ts_batch_t *job = NULL;
+
+	joker_thread_setup(pool->joker, JOKER_THREAD_WORKER);
+
+	while (!pool->cancel) {
+		job = joker_queue_pop_wait(w->todo, 100 /* ms */);
+		if (!job)
+			continue;
+
+		// ts_unsubscribe waits for started jobs (hooks loaded old subscribers)
+		__atomic_add_fetch(&w->started, 1, __ATOMIC_SEQ_CST);
+		ts_batch_call(pool, job, &w->group);
+		__atomic_add_fetch(&w->finished, 1, __ATOMIC_SEQ_CST);
+
+		joker_queue_push(w->free, job);
+	}
+
+	return NULL;
+}
+
+/* wait till TS thread finish node started before this call
+ * new nodes do not delay us (see subscribers table swap) */
+void ts_wait_node(struct big_pool_t *pool)
+{
+	uint64_t started = __atomic_load_n(&pool->ts_started, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&pool->ts_finished, __ATOMIC_SEQ_CST) < started && !pool->cancel)
+		usleep(100);
+}
+
+/* wait till workers finish jobs started before this call */
+static void ts_workers_wait(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	uint64_t started = 0;
+	int i = 0;
+
+	for (i = 0; ws && i < ws->count; i++) {
+		started = __atomic_load_n(&ws->w[i].started, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&ws->w[i].finished, __ATOMIC_SEQ_CST) < started && !pool->cancel)
+			usleep(100);
+	}
+}
+
+/* caller is TS thread or worker (called from hook) */
+static int ts_hook_thread(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	int i = 0;
+
+	if (pthread_equal(pthread_self(), pool->threading->ts_thread))
+		return 1;
+
+	for (i = 0; ws && i < ws->count; i++)
+		if (ws->w[i].running && pthread_equal(pthread_self(), ws->w[i].thread))
+			return 1;
+
+	return 0;
+}
+
+static void ts_workers_free(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	struct ts_worker_t *w = NULL;
+	int i = 0, j = 0;
+
+	if (!ws)
+		return;
+
+	for (i = 0; i < ws->count; i++) {
+		w = &ws->w[i];
+		joker_queue_free(w->todo);
+		joker_queue_free(w->free);
+		for (j = 0; j < TS_WORKER_JOBS; j++)
+			ts_batch_free(&w->jobs[j]);
+		free(w->group.grouped);
+	}
+	free(ws->w);
+	free(ws);
+	pool->workers = NULL;
+}
+
+/* start batch hooks workers (see ts_workers)
+ * workers allocated on first start and kept till pool_uninit */
+static int ts_workers_start(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	struct ts_worker_t *w = NULL;
+	int i = 0, j = 0, rc = 0;
+
+	if (!ws && pool->ts_workers > 0) {
+		ws = calloc(1, sizeof(*ws));
+		if (!ws)
+			return -ENOMEM;
+		ws->count = pool->ts_workers > TS_WORKERS_MAX ? TS_WORKERS_MAX : pool->ts_workers;
+		ws->w = calloc(ws->count, sizeof(*ws->w));
+		pool->workers = ws;
+		if (!ws->w) {
+			ws->count = 0;
+			ts_workers_free(pool);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < ws->count; i++) {
+			w = &ws->w[i];
+			w->pool = pool;
+			w->todo = joker_queue_alloc(TS_WORKER_JOBS);
+			w->free = joker_queue_alloc(TS_WORKER_JOBS);
+			if (!w->todo || !w->free) {
+				ts_workers_free(pool);
+				return -ENOMEM;
+			}
+			for (j = 0; j < TS_WORKER_JOBS; j++)
+				joker_queue_push(w->free, &w->jobs[j]);
+		}
+	}
+
+	for (i = 0; ws && i < ws->count; i++) {
+		w = &ws->w[i];
+		if ((rc = pthread_create(&w->thread, NULL, ts_worker, (void *)w))) {
+			printf("ERROR: can't start TS worker thread. code=%d\n", rc);
+			return -rc;
+		}
+		w->running = 1;
+	}
+
+	return 0;
+}
+
+/* stop workers. Called after TS thread stopped
+ * jobs not processed yet are discarded */
+static void ts_workers_stop(struct big_pool_t *pool)
+{
+	struct ts_workers_t *ws = pool->workers;
+	struct ts_worker_t *w = NULL;
+	struct ts_batch_t *job = NULL;
+	int i = 0;
+
+	for (i = 0; ws && i < ws->count; i++) {
+		w = &ws->w[i];
+		if (w->running) {
+			joker_queue_wakeup(w->todo);
+			pthread_join(w->thread, NULL);
+			w->running = 0;
+		}
+
+		// all jobs back to TS thread side
+		if (w->job) {
+			w->job->count = 0;
+			joker_queue_push(w->todo, w->job);
+			w->job = NULL;
+		}
+		while ((job = joker_queue_pop(w->todo))) {
+			job->count = 0;
+			joker_queue_push(w->free, job);
+		}
+	}
+}
+
+/* all workers finished jobs started before 'seq' snapshot */
+static int ts_workers_passed(struct big_pool_t *pool, uint64_t *seq)
+{
+	struct ts_workers_t *ws = pool->workers;
+	int i = 0;
+
+	for (i = 0; ws && i < ws->count; i++)
+		if (__atomic_load_n(&ws->w[i].finished, __ATOMIC_SEQ_CST) < seq[i])
+			return 0;
+
+	return 1;
+}
+
+static void ts_subs_list_free(struct ts_pid_subs_t *p)
+{
+	struct ts_pid_subs_t *next = NULL;
+
+	for (; p; p = next) {
+		next = p->next;
+		free(p);
+	}
+}
+
+/* free replaced subscribers arrays
+ * called by TS thread between nodes (old arrays not used anymore
+ * by TS thread. Workers checked by jobs counters) */
+static void ts_subs_reclaim(struct big_pool_t *pool)
+{
+	struct ts_subs_t *subs = pool->subs;
+	struct ts_workers_t *ws = pool->workers;
+	struct ts_pid_subs_t *p = NULL;
+	int i = 0;
+
+	if (subs->pending && ts_workers_passed(pool, subs->pending_seq)) {
+		ts_subs_list_free(subs->pending);
+		subs->pending = NULL;
+	}
+
+	if (subs->pending || !__atomic_load_n(&subs->retired, __ATOMIC_ACQUIRE))
+		return;
+
+	p = __atomic_exchange_n(&subs->retired, NULL, __ATOMIC_ACQ_REL);
+	if (!ws) {
+		ts_subs_list_free(p);
+		return;
+	}
+
+	// workers could use them in jobs started till now
+	subs->pending = p;
+	for (i = 0; i < ws->count; i++)
+		subs->pending_seq[i] = __atomic_load_n(&ws->w[i].started, __ATOMIC_SEQ_CST);
+}
+
+static void ts_subs_free(struct big_pool_t *pool)
+{
+	int pid = 0;
+
+	if (!pool->subs)
+		return;
+
+	ts_subs_list_free(pool->subs->pending);
+	ts_subs_list_free(pool->subs->retired);
+	for (pid = 0; pid < 8192; pid++)
+		free(pool->subs->pids[pid]);
+	ts_batch_free(&pool->subs->batch);
+	free(pool->subs->group.grouped);
+	pthread_mutex_destroy(&pool->subs->mux);
+	free(pool->subs);
+	pool->subs = NULL;
+	memset(&pool->subs_bitmap, 0, sizeof(pool->subs_bitmap));
+}
+
+/* publish new subscribers array for PID. called under subs->mux */
+static void ts_subs_replace(struct big_pool_t *pool, int pid, struct ts_pid_subs_t *p)
+{
+	struct ts_subs_t *subs = pool->subs;
+	struct ts_pid_subs_t *old = subs->pids[pid];
+
+	if (p)
+		__atomic_or_fetch(&pool->subs_bitmap[pid >> 6], 1ULL << (pid & 63), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&subs->pids[pid], p, __ATOMIC_SEQ_CST);
+	if (!p)
+		__atomic_and_fetch(&pool->subs_bitmap[pid >> 6], ~(1ULL << (pid & 63)), __ATOMIC_SEQ_CST);
+
+	// TS thread could use old array till end of node
+	if (old) {
+		do {
+			old->next = __atomic_load_n(&subs->retired, __ATOMIC_RELAXED);
+		} while (!__atomic_compare_exchange_n(&subs->retired, &old->next, old,
+					0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
+
+static int ts_subs_add(struct big_pool_t *pool, int pid, ts_hook_t hook,
+		ts_batch_hook_t batch, void *opaque)
+{
+	struct ts_pid_subs_t *old = NULL, *p = NULL;
+	int i = 0, count = 0, at = 0;
+
+	if (!pool || !pool->subs || (!hook == !batch) || pid < 0 || pid >= 8192)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pool->subs->mux);
+	old = pool->subs->pids[pid];
+	count = old ? old->count : 0;
+	for (i = 0; i < count; i++) {
+		if (old->subs[i].hook == hook && old->subs[i].batch == batch &&
+				old->subs[i].opaque == opaque) {
+			pthread_mutex_unlock(&pool->subs->mux);
+			return -EEXIST;
+		}
+	}
+
+	p = malloc(sizeof(*p) + (count + 1) * sizeof(p->subs[0]));
+	if (!p) {
+		pthread_mutex_unlock(&pool->subs->mux);
+		return -ENOMEM;
+	}
+	// per packet hooks first
+	at = hook ? (old ? old->hooks : 0) : count;
+	p->count = count + 1;
+	p->hooks = (old ? old->hooks : 0) + (hook ? 1 : 0);
+	p->next = NULL;
+	if (at)
+		memcpy(p->subs, old->subs, at * sizeof(p->subs[0]));
+	if (count > at)
+		memcpy(p->subs + at + 1, old->subs + at, (count - at) * sizeof(p->subs[0]));
+	p->subs[at].hook = hook;
+	p->subs[at].batch = batch;
+	p->subs[at].opaque = opaque;
+	if (batch)
+		__atomic_add_fetch(&pool->subs->batch_subs, 1, __ATOMIC_RELAXED);
+	ts_subs_replace(pool, pid, p);
+	pthread_mutex_unlock(&pool->subs->mux);
+
+	return 0;
+}
+
+static int ts_subs_remove(struct big_pool_t *pool, int pid, ts_hook_t hook,
+		ts_batch_hook_t batch, void *opaque)
+{
+	struct ts_pid_subs_t *old = NULL, *p = NULL;
+	int i = 0, j = 0;
+
+	if (!pool || !pool->subs || pid < 0 || pid >= 8192)
+		return -EINVAL;
+
+	pthread_mutex_lock(&pool->subs->mux);
+	old = pool->subs->pids[pid];
+	for (i = 0; old && i < old->count; i++)
+		if (old->subs[i].hook == hook && old->subs[i].batch == batch &&
+				old->subs[i].opaque == opaque)
+			break;
+	if (!old || i == old->count) {
+		pthread_mutex_unlock(&pool->subs->mux);
+		return -ENOENT;
+	}
+
+	if (old->count > 1) {
+		p = malloc(sizeof(*p) + (old->count - 1) * sizeof(p->subs[0]));
+		if (!p) {
+			pthread_mutex_unlock(&pool->subs->mux);
+			return -ENOMEM;
+		}
+		p->count = 0;
+		p->hooks = old->hooks - (hook ? 1 : 0);
+		p->next = NULL;
+		for (j = 0; j < old->count; j++)
+			if (j != i)
+				p->subs[p->count++] = old->subs[j];
+	}
+	if (batch)
+		__atomic_sub_fetch(&pool->subs->batch_subs, 1, __ATOMIC_RELAXED);
+	ts_subs_replace(pool, pid, p);
+	pthread_mutex_unlock(&pool->subs->mux);
+
+	// hook could be running right now. wait till TS thread finish node
+	// (and workers finish jobs)
+	if (!ts_hook_thread(pool)) {
+		ts_wait_node(pool);
+		if (batch)
+			ts_workers_wait(pool);
+	}
+
+	return 0;
+}
+
+int ts_subscribe(struct big_pool_t *pool, int pid, ts_hook_t hook, void *opaque)
+{
+	return ts_subs_add(pool, pid, hook, NULL, opaque);
+}
+
+int ts_unsubscribe(struct big_pool_t *pool, int pid, ts_hook_t hook, void *opaque)
+{
+	return ts_subs_remove(pool, pid, hook, NULL, opaque);
+}
+
+int ts_subscribe_batch(struct big_pool_t *pool, int pid, ts_batch_hook_t hook, void *opaque)
+{
+	return ts_subs_add(pool, pid, NULL, hook, opaque);
+}
+
+int ts_unsubscribe_batch(struct big_pool_t *pool, int pid, ts_batch_hook_t hook, void *opaque)
+{
+	return ts_subs_remove(pool, pid, NULL, hook, opaque);
+}
+
 /* init pool */
 int pool_init(struct joker_t *joker, struct big_pool_t * pool)
 {
@@ -61,293 +779,1587 @@ int pool_init(struct joker_t *joker, struct big_pool_t * pool)
 	joker->pool = pool;
 	pool->node_counter = 0;
 	pool->tail_size = 0;
-	pool->ts_list_size = 0;
 	if (pool->ts_list_size_max <= TS_LIST_SIZE_DEFAULT)
 		pool->ts_list_size_max = TS_LIST_SIZE_DEFAULT;
 
-	INIT_LIST_HEAD(&pool->ts_list);
-	INIT_LIST_HEAD(&pool->ts_list_all);
 	INIT_LIST_HEAD(&pool->programs_list);
+	INIT_LIST_HEAD(&pool->ready_list);
+	pool->ready_count = 0;
+	INIT_LIST_HEAD(&pool->readers);
 	INIT_LIST_HEAD(&pool->ca_list);
 	INIT_LIST_HEAD(&pool->nit_list);
 
 	if (!pool->selected_programs_list.next)
 		INIT_LIST_HEAD(&pool->selected_programs_list);
 
-	// alloc threading stuff
-	pool->threading = malloc(sizeof(struct thread_opaq_t));
-	if (!pool->threading)
-		return -ENOMEM;
+	// alloc threading stuff
+	pool->threading = malloc(sizeof(struct thread_opaq_t));
+	if (!pool->threading)
+		return -ENOMEM;
+
+	pthread_mutex_init(&pool->threading->mux_all, NULL);
+	pthread_cond_init(&pool->threading->cond_all, NULL);
+	pthread_cond_init(&pool->threading->cond_space, NULL);
+	pthread_mutex_init(&pool->threading->mux_usb, NULL);
+	pool->threading->refs = 1;
+
+	// read_ts_data reader
+	pool->reader = calloc(1, sizeof(struct ts_reader_t));
+	if (!pool->reader)
+		goto fail;
+	pool->reader->pool = pool;
+	pool->reader->threading = pool->threading;
+	pool->reader->attached = 1;
+	pool->reader->hold = -1;
+	list_add_tail(&pool->reader->list, &pool->readers);
+
+	pool->rewrite = calloc(1, sizeof(struct ts_rewrite_t));
+	if (!pool->rewrite)
+		goto fail;
+
+	pool->subs = calloc(1, sizeof(struct ts_subs_t));
+	if (!pool->subs)
+		goto fail;
+	pthread_mutex_init(&pool->subs->mux, NULL);
+	memset(&pool->subs_bitmap, 0, sizeof(pool->subs_bitmap));
+	memset(&pool->transfers, 0, sizeof(pool->transfers));
+
+	pool->initialized = BIG_POOL_MAGIC;
+
+	jdebug("%s: pool %p initialized \n", __func__, pool);
+
+	return 0;
+fail:
+	free(pool->rewrite);
+	pool->rewrite = NULL;
+	if (pool->reader) {
+		list_del(&pool->reader->list);
+		free(pool->reader);
+		pool->reader = NULL;
+	}
+	pthread_mutex_destroy(&pool->threading->mux_usb);
+	pthread_cond_destroy(&pool->threading->cond_space);
+	pthread_cond_destroy(&pool->threading->cond_all);
+	pthread_mutex_destroy(&pool->threading->mux_all);
+	free(pool->threading);
+	pool->threading = NULL;
+	return -ENOMEM;
+}
+
+static void slab_uninit(struct big_pool_t * pool)
+{
+	joker_queue_free(pool->ts_queue);
+	pool->ts_queue = NULL;
+
+	if (!pool->slab)
+		return;
+
+	free(pool->slab->nodes);
+	free(pool->slab->arena);
+	free(pool->slab->segs_arena);
+	free(pool->slab);
+	pool->slab = NULL;
+}
+
+/* allocate all nodes at once
+ * block sized to hold one full ISOC transfer (plus tail)
+ * in zero-copy mode block holds only packets straddling ISOC packets
+ * nodes only travel from record_callback to process_ts
+ * (TS data retained in ring buffer or in ready list if zero-copy) */
+static int slab_init(struct joker_t *joker, struct big_pool_t * pool)
+{
+	struct ts_slab_t *slab = NULL;
+	struct ts_node *node = NULL;
+	int i = 0;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return -ENOMEM;
+
+	if (pool->zero_copy)
+		slab->block_size = (joker->max_isoc_packets_count + 1) * TS_SIZE;
+	else
+		slab->block_size = joker->max_isoc_packets_count * joker->max_isoc_packets_size + TS_SIZE;
+	// every ISOC packet gives straddling packet and aligned run at most
+	slab->segs_size = 2 * joker->max_isoc_packets_count + 1;
+	slab->count = TS_NODES_IN_FLIGHT;
+	slab->nodes = calloc(slab->count, sizeof(struct ts_node));
+	slab->arena = malloc((size_t)slab->count * slab->block_size);
+	slab->segs_arena = calloc((size_t)slab->count * slab->segs_size, sizeof(struct ts_seg));
+	if (!slab->nodes || !slab->arena || !slab->segs_arena) {
+		printf("%s: can't alloc %d nodes (%d bytes each)\n",
+				__func__, slab->count, slab->block_size);
+		free(slab->nodes);
+		free(slab->arena);
+		free(slab->segs_arena);
+		free(slab);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < slab->count; i++) {
+		node = &slab->nodes[i];
+		node->pool = pool;
+		node->data = slab->arena + (size_t)i * slab->block_size;
+		node->segs = slab->segs_arena + (size_t)i * slab->segs_size;
+		node->next_free = slab->free_head;
+		slab->free_head = node;
+	}
+	slab->free_count = slab->count;
+	pool->slab = slab;
+
+	// queue can hold all nodes. push never fails
+	pool->ts_queue = joker_queue_alloc(slab->count);
+	if (!pool->ts_queue) {
+		slab_uninit(pool);
+		return -ENOMEM;
+	}
+
+	jdebug("%s: %d nodes by %d bytes allocated\n", __func__, slab->count, slab->block_size);
+
+	return 0;
+}
+
+/* get free node. return NULL if all nodes in use
+ * only one thread at a time can call this (no ABA problem) */
+static struct ts_node * slab_get(struct ts_slab_t *slab)
+{
+	struct ts_node *node = NULL, *next = NULL;
+
+	node = __atomic_load_n(&slab->free_head, __ATOMIC_ACQUIRE);
+	while (node) {
+		next = node->next_free;
+		if (__atomic_compare_exchange_n(&slab->free_head, &node, next,
+					1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	if (node)
+		__atomic_sub_fetch(&slab->free_count, 1, __ATOMIC_RELAXED);
+
+	return node;
+}
+
+/* return node back to slab. can be called from any thread */
+static void slab_put(struct ts_slab_t *slab, struct ts_node *node)
+{
+	struct ts_node *head = __atomic_load_n(&slab->free_head, __ATOMIC_RELAXED);
+
+	do {
+		node->next_free = head;
+	} while (!__atomic_compare_exchange_n(&slab->free_head, &head, node,
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_add_fetch(&slab->free_count, 1, __ATOMIC_RELAXED);
+}
+
+#ifdef __linux__
+/* map same memory twice (ptr ... ptr + 2*size)
+ * return 0 if success */
+static int ring_mirror_alloc(struct big_pool_t * pool)
+{
+	unsigned char *addr = NULL;
+	int fd = -1;
+
+	fd = memfd_create("jokertv-ring", 0);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, pool->size)) {
+		close(fd);
+		return -EIO;
+	}
+
+	// reserve address space for both copies
+	addr = mmap(NULL, 2 * pool->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	if (mmap(addr, pool->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			mmap(addr + pool->size, pool->size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(addr, 2 * pool->size);
+		close(fd);
+		return -ENOMEM;
+	}
+	close(fd); // mappings keep memory alive
+
+	pool->ptr = addr;
+	pool->mirrored = 1;
+
+	return 0;
+}
+#endif
+
+/* allocate ring buffer for TS data
+ * size rounded to TS_SIZE (and to page size if mirrored) */
+static int ring_init(struct big_pool_t * pool)
+{
+	int64_t unit = TS_SIZE;
+
+	pool->mirrored = 0;
+	pool->ptr = NULL;
+#ifdef __linux__
+	// 188 = 4 * 47. page size is multiple of 4
+	unit = sysconf(_SC_PAGESIZE) * 47;
+	pool->size = (pool->ts_list_size_max + unit - 1) / unit * unit;
+	if (ring_mirror_alloc(pool))
+		jdebug("%s: can't mirror ring buffer. fallback to plain memory\n", __func__);
+#endif
+
+	if (!pool->ptr) {
+		unit = TS_SIZE;
+		pool->size = (pool->ts_list_size_max + unit - 1) / unit * unit;
+		pool->ptr = malloc(pool->size);
+		if (!pool->ptr)
+			return -ENOMEM;
+	}
+
+	pool->ptr_end = pool->ptr + pool->size;
+	pool->read_ptr = pool->ptr;
+	pool->write_ptr = pool->ptr;
+	pool->fill = 0;
+
+	jdebug("%s: ring %p size=%lld mirrored=%d\n",
+			__func__, pool->ptr, (long long)pool->size, pool->mirrored);
+
+	return 0;
+}
+
+static void ring_uninit(struct big_pool_t * pool)
+{
+	if (!pool->ptr)
+		return;
+
+#ifdef __linux__
+	if (pool->mirrored)
+		munmap(pool->ptr, 2 * pool->size);
+	else
+#endif
+		free(pool->ptr);
+
+	pool->ptr = pool->ptr_end = NULL;
+	pool->read_ptr = pool->write_ptr = NULL;
+	pool->fill = 0;
+}
+
+/* move ring pointer forward */
+static unsigned char * ring_advance(struct big_pool_t * pool, unsigned char *p, int64_t len)
+{
+	p += len;
+	if (p >= pool->ptr_end)
+		p -= pool->size;
+	return p;
+}
+
+/* copy from ring buffer. caller guarantee that 'len' bytes available */
+static void ring_copy_from(struct big_pool_t * pool, unsigned char *src,
+		unsigned char *dst, int64_t len)
+{
+	int64_t part = pool->ptr_end - src;
+
+	if (pool->mirrored || len <= part) {
+		memcpy(dst, src, len);
+	} else {
+		memcpy(dst, src, part);
+		memcpy(dst + part, pool->ptr, len - part);
+	}
+}
+
+/* account retention overflow and notify pool owner
+ * policy - what was done with data (dropped or spilled)
+ * called by TS thread outside of lock */
+static void ts_overflow(struct big_pool_t * pool, int policy, int64_t bytes)
+{
+	if (bytes <= 0)
+		return;
+
+	STAT_ADD(pool, overflows, 1);
+	if (policy == TS_OVERFLOW_SPILL)
+		STAT_ADD(pool, bytes_spilled, bytes);
+	else
+		STAT_ADD(pool, bytes_dropped, bytes);
+
+	if (pool->overflow_callback)
+		pool->overflow_callback(pool->overflow_opaque ? pool->overflow_opaque : pool,
+				policy, bytes);
+}
+
+/* no space for 'len' bytes (or one more node in zero-copy mode)
+ * caller holds mux_all */
+static int ts_full(struct big_pool_t * pool, int64_t len)
+{
+	if (pool->zero_copy)
+		return pool->ready_count >= __atomic_load_n(&pool->usb_bufs, __ATOMIC_RELAXED) -
+			__atomic_load_n(&pool->usb_target, __ATOMIC_RELAXED);
+
+	return pool->fill + len > pool->size;
+}
+
+/* absolute time for pthread_cond_timedwait */
+static void ts_deadline(struct timespec *deadline, int timeout_ms)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	deadline->tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline->tv_nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* TS_OVERFLOW_BLOCK: wait until readers free space
+ * caller holds mux_all. Return on timeout or cancel as well */
+static void ts_wait_space(struct big_pool_t * pool, int64_t len)
+{
+	struct timespec deadline;
+
+	ts_deadline(&deadline, pool->overflow_timeout_ms > 0 ?
+			pool->overflow_timeout_ms : TS_OVERFLOW_TIMEOUT_DEFAULT);
+
+	pool->space_waiters++;
+	while (ts_full(pool, len) && !pool->cancel) {
+		if (pthread_cond_timedwait(&pool->threading->cond_space,
+					&pool->threading->mux_all, &deadline) == ETIMEDOUT)
+			break;
+	}
+	pool->space_waiters--;
+}
+
+/* readers consumed data. caller holds mux_all */
+static void ts_space_freed(struct big_pool_t * pool)
+{
+	if (pool->space_waiters)
+		pthread_cond_signal(&pool->threading->cond_space);
+}
+
+/* data available for reader (ring buffer or ready list and spill file)
+ * caller holds mux_all */
+static int64_t ts_reader_avail(struct ts_reader_t *reader)
+{
+	struct big_pool_t *pool = reader->pool;
+
+	return pool->stream_head + pool->spill_ready_off - reader->off;
+}
+
+/* forget retained data before 'off' (overflow)
+ * readers behind 'off' skip data. caller holds mux_all */
+static void ts_drop_to(struct big_pool_t * pool, int64_t off)
+{
+	struct ts_reader_t *reader = NULL;
+
+	list_for_each_entry(reader, &pool->readers, list) {
+		if (reader->off < off) {
+			reader->dropped += off - reader->off;
+			reader->off = off;
+		}
+	}
+
+	if (!pool->zero_copy)
+		pool->read_ptr = ring_advance(pool, pool->read_ptr, off - pool->stream_tail);
+	pool->stream_tail = off;
+	pool->fill = pool->stream_head - pool->stream_tail;
+}
+
+/* oldest ring buffer data borrowed by readers (ts_reader_borrow)
+ * caller holds mux_all */
+static int64_t ts_hold_min(struct big_pool_t * pool)
+{
+	struct ts_reader_t *reader = NULL;
+	int64_t min = INT64_MAX;
+
+	list_for_each_entry(reader, &pool->readers, list)
+		if (reader->hold >= 0 && reader->hold < min)
+			min = reader->hold;
+
+	return min;
+}
+
+/* release data passed by all readers
+ * zero-copy nodes moved to 'done' (drop them outside of lock)
+ * caller holds mux_all */
+static void ts_release(struct big_pool_t * pool, struct list_head *done)
+{
+	struct ts_reader_t *reader = NULL;
+	struct ts_node *node = NULL;
+	int64_t min = pool->stream_head + pool->spill_ready_off; // no readers
+
+	list_for_each_entry(reader, &pool->readers, list) {
+		if (reader->off < min)
+			min = reader->off;
+		if (reader->hold >= 0 && reader->hold < min)
+			min = reader->hold;
+	}
+
+	// all readers got spilled data. Reuse file from beginning
+	if (pool->spill_write_off && min == pool->stream_head + pool->spill_write_off) {
+		pool->stream_head += pool->spill_write_off;
+		pool->spill_write_off = pool->spill_ready_off = 0;
+	}
+	if (min > pool->stream_head)
+		min = pool->stream_head;
+
+	if (pool->zero_copy) {
+		while (!list_empty(&pool->ready_list)) {
+			node = list_first_entry(&pool->ready_list, struct ts_node, list);
+			if (node->pos + node->size > min)
+				break;
+			list_del(&node->list);
+			list_add_tail(&node->list, done);
+			pool->ready_count--;
+		}
+		pool->stream_tail = list_empty(&pool->ready_list) ? pool->stream_head :
+			list_first_entry(&pool->ready_list, struct ts_node, list)->pos;
+	} else {
+		// ring pointers follow stream offsets
+		// head moved without ring data if spill file reused
+		if (min - pool->stream_tail > pool->fill)
+			pool->read_ptr = pool->write_ptr;
+		else
+			pool->read_ptr = ring_advance(pool, pool->read_ptr, min - pool->stream_tail);
+		pool->stream_tail = min;
+	}
+	pool->fill = pool->stream_head - pool->stream_tail;
+
+	ts_space_freed(pool);
+}
+
+/* drop released zero-copy nodes (transfers resubmitted) */
+static void ts_release_done(struct list_head *done)
+{
+	struct ts_node *node = NULL, *tmp = NULL;
+
+	list_for_each_entry_safe(node, tmp, done, list) {
+		list_del(&node->list);
+		drop_ts_data(node);
+	}
+}
+
+/* open spill file (TS_OVERFLOW_SPILL) on first overflow */
+static int spill_open(struct big_pool_t * pool)
+{
+#ifdef __WIN32__
+	printf("%s: spill to disk not supported. dropping data \n", __func__);
+	pool->overflow_policy = TS_OVERFLOW_DROP_NEWEST;
+	return -EOPNOTSUPP;
+#else
+	if (pool->spill_file)
+		return 0;
+
+	if (pool->overflow_spill_filename)
+		pool->spill_file = fopen(pool->overflow_spill_filename, "w+b");
+	else
+		pool->spill_file = tmpfile();
+	if (!pool->spill_file) {
+		printf("Can't open spill file '%s' error=%s (%d). dropping data \n",
+				pool->overflow_spill_filename ? pool->overflow_spill_filename : "tmp",
+				strerror(errno), errno);
+		pool->overflow_policy = TS_OVERFLOW_DROP_NEWEST;
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	pool->spill_write_off = pool->spill_ready_off = 0;
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	return 0;
+#endif
+}
+
+static void spill_close(struct big_pool_t * pool)
+{
+	if (!pool->spill_file)
+		return;
+
+	fclose(pool->spill_file);
+	pool->spill_file = NULL;
+	pool->spill_write_off = pool->spill_ready_off = 0;
+}
+
+/* append data to spill file. Only TS thread writes
+ * file written outside of lock. Readers see data after it written
+ * return 0 if success */
+static int spill_write(struct big_pool_t * pool, unsigned char *data, int64_t len)
+{
+#ifdef __WIN32__
+	return -EOPNOTSUPP;
+#else
+	int64_t off = 0;
+	ssize_t ret = 0;
+
+	if (spill_open(pool))
+		return -EIO;
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	off = pool->spill_write_off;
+	pool->spill_write_off += len;
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	ret = pwrite(fileno(pool->spill_file), data, len, off);
+	pthread_mutex_lock(&pool->threading->mux_all);
+	if (ret == len)
+		pool->spill_ready_off = pool->spill_write_off;
+	else
+		pool->spill_write_off = off; // nobody else reserves space
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	if (ret != len) {
+		printf("%s: spill file write failed. error=%s (%d)\n",
+				__func__, strerror(errno), errno);
+		return -EIO;
+	}
+
+	pthread_cond_broadcast(&pool->threading->cond_all); // wakeup read threads
+	return 0;
+#endif
+}
+
+/* read spilled data from file offset 'off'. caller holds mux_all
+ * return copied bytes */
+static int spill_read(struct big_pool_t * pool, int64_t off, unsigned char *dst, int64_t len)
+{
+#ifdef __WIN32__
+	return 0;
+#else
+	ssize_t ret = 0;
+
+	if (len > pool->spill_ready_off - off)
+		len = pool->spill_ready_off - off;
+	if (len <= 0)
+		return 0;
+
+	ret = pread(fileno(pool->spill_file), dst, len, off);
+	if (ret <= 0) {
+		printf("%s: spill file read failed. error=%s (%d)\n",
+				__func__, strerror(errno), errno);
+		return 0;
+	}
+
+	return ret;
+#endif
+}
+
+/* append TS to ring buffer
+ * if no space left then overflow_policy applied:
+ * drop oldest (O(1), no loops over data), drop newest, wait for readers
+ * or spill to file (order kept: all data goes to file until readers get it)
+ * data copied outside of lock. readers never touch free space */
+static void ring_write(struct big_pool_t * pool, unsigned char *data, int64_t len)
+{
+	unsigned char *dst = NULL;
+	int64_t part = 0, drop = 0;
+	int policy = pool->overflow_policy;
+
+	if (len <= 0)
+		return;
+
+	// keep only newest data if chunk is bigger than whole ring
+	if (len > pool->size && policy != TS_OVERFLOW_SPILL) {
+		data += len - pool->size;
+		len = pool->size;
+	}
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	if (policy == TS_OVERFLOW_BLOCK && ts_full(pool, len))
+		ts_wait_space(pool, len);
+
+	if (pool->spill_write_off || (policy == TS_OVERFLOW_SPILL && ts_full(pool, len))) {
+		pthread_mutex_unlock(&pool->threading->mux_all);
+		if (spill_write(pool, data, len))
+			ts_overflow(pool, TS_OVERFLOW_DROP_NEWEST, len);
+		else
+			ts_overflow(pool, TS_OVERFLOW_SPILL, len);
+		return;
+	}
+
+	drop = pool->fill + len - pool->size;
+	// borrowed data can't be overwritten. drop new data instead
+	if (drop > 0 && pool->stream_tail + pool->fill -
+			(pool->size - len) / TS_SIZE * TS_SIZE > ts_hold_min(pool))
+		policy = TS_OVERFLOW_DROP_NEWEST;
+	if (drop > 0 && policy == TS_OVERFLOW_DROP_NEWEST) {
+		// keep whole packets which fit
+		drop = len - (pool->size - pool->fill) / TS_SIZE * TS_SIZE;
+		len -= drop;
+	} else if (drop > 0) {
+		// reader can stop in the middle of packet. keep packets aligned
+		drop = pool->fill - (pool->size - len) / TS_SIZE * TS_SIZE;
+		jdebug("Memory limit: dropping %lld bytes. fill=%lld\n",
+				(long long)drop, (long long)pool->fill);
+		ts_drop_to(pool, pool->stream_tail + drop);
+		policy = TS_OVERFLOW_DROP_OLDEST;
+	}
+	dst = pool->write_ptr;
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	if (drop > 0)
+		ts_overflow(pool, policy, drop);
+	if (len <= 0)
+		return;
+
+	part = pool->ptr_end - dst;
+	if (pool->mirrored || len <= part) {
+		memcpy(dst, data, len);
+	} else {
+		memcpy(dst, data, part);
+		memcpy(pool->ptr, data + part, len - part);
+	}
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	pool->write_ptr = ring_advance(pool, pool->write_ptr, len);
+	pool->stream_head += len;
+	ts_release(pool, NULL); // nobody reads. nothing to keep
+	pthread_mutex_unlock(&pool->threading->mux_all);
+	pthread_cond_broadcast(&pool->threading->cond_all); // wakeup read threads
+}
+
+static void ts_reader_free(struct ts_reader_t *reader)
+{
+	if (!reader)
+		return;
+
+	free(reader->held);
+	free(reader->bounce);
+	free(reader);
+}
 
-	pthread_mutex_init(&pool->threading->mux_all, NULL);
-	pthread_mutex_init(&pool->threading->mux, NULL);
-	pthread_cond_init(&pool->threading->cond_all, NULL);
-	pthread_cond_init(&pool->threading->cond, NULL);
+/* drop threading reference and unlock mux_all. Last one frees it */
+static void ts_threading_put(struct thread_opaq_t *threading)
+{
+	int last = !--threading->refs;
 
-	memset(&pool->hooks, 0, sizeof(pool->hooks));
-	memset(&pool->hooks_opaque, 0, sizeof(pool->hooks_opaque));
-	memset(&pool->transfers, 0, sizeof(pool->transfers));
+	pthread_mutex_unlock(&threading->mux_all);
+	if (!last)
+		return;
 
-	pool->initialized = BIG_POOL_MAGIC;
+	pthread_mutex_destroy(&threading->mux_all);
+	pthread_mutex_destroy(&threading->mux_usb);
+	pthread_cond_destroy(&threading->cond_all);
+	pthread_cond_destroy(&threading->cond_space);
+	free(threading);
+}
 
-	jdebug("%s: pool %p initialized \n", __func__, pool);
+/* detach readers from pool. Their calls return without data after this,
+ * ts_reader_close only frees reader. Borrowed data released */
+static void ts_readers_detach(struct big_pool_t *pool)
+{
+	struct ts_reader_t *reader = NULL, *tmp = NULL;
+	int i = 0;
 
-	return 0;
+	pthread_mutex_lock(&pool->threading->mux_all);
+	// readers leave read calls
+	pool->cancel = 1;
+	pthread_cond_broadcast(&pool->threading->cond_all);
+	while (pool->readers_active)
+		pthread_cond_wait(&pool->threading->cond_all, &pool->threading->mux_all);
+
+	list_for_each_entry_safe(reader, tmp, &pool->readers, list) {
+		list_del(&reader->list);
+		reader->attached = 0;
+		// TS processing stopped. Nodes not resubmitted to USB
+		if (reader->borrowed) {
+			for (i = 0; i < reader->held_count; i++)
+				drop_ts_data(reader->held[i]);
+			reader->held_count = 0;
+			reader->borrowed = 0;
+			reader->hold = -1;
+		}
+		if (reader != pool->reader)
+			__atomic_store_n(&reader->pool, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool->threading->mux_all);
 }
 
 int pool_uninit(struct big_pool_t * pool)
 {
+
 	// sanity check
 	if (pool && pool->initialized != BIG_POOL_MAGIC)
 		return -EINVAL;
 
 	// TODO: clean programs_list, ts_list*
 
-	free(pool->threading);
+	ts_readers_detach(pool);
+	slab_uninit(pool);
+	ring_uninit(pool);
+	spill_close(pool);
+	ts_reader_free(pool->reader);
+	pool->reader = NULL;
+	if (pool->rewrite)
+		free(pool->rewrite->sdt);
+	free(pool->rewrite);
+	pool->rewrite = NULL;
+	joker_timeshift_close(pool->timeshift);
+	pool->timeshift = NULL;
+	joker_shm_close(pool->shm);
+	pool->shm = NULL;
+	ts_workers_free(pool);
+	ts_subs_free(pool);
+	// opened readers keep it till ts_reader_close
+	pthread_mutex_lock(&pool->threading->mux_all);
+	ts_threading_put(pool->threading);
 	pool->threading = NULL;
 	pool->initialized = 0;
+
+	return 0;
+}
+
+/* get PAT/SDT replacement for next node. NULL if disabled
+ * tables copied only when changed (PAT generated, new SDT added)
+ * called by TS thread */
+static struct ts_rewrite_t * ts_rewrite_prepare(struct big_pool_t *pool)
+{
+	struct ts_rewrite_t *rewrite = pool->rewrite;
+	char *pat = pool->generated_pat_pkt;
+	int sdt_count = pool->sdt_count;
+	unsigned char *sdt = NULL;
+
+	if (!pat)
+		return NULL;
+
+	if (rewrite->pat_src != pat) {
+		memcpy(rewrite->pat, pat, TS_SIZE);
+		rewrite->pat_src = pat;
+	}
+
+	if (rewrite->sdt_count != sdt_count) {
+		sdt = realloc(rewrite->sdt, sdt_count * TS_SIZE);
+		if (sdt || !sdt_count) {
+			if (sdt_count)
+				memcpy(sdt, pool->sdt_pkt_array, sdt_count * TS_SIZE);
+			rewrite->sdt = sdt;
+			rewrite->sdt_count = sdt_count;
+			rewrite->sdt_cur = 0;
+		}
+	}
+
+	return rewrite;
+}
+
+/* replace PAT or SDT packet. Continuity counters kept by pool */
+static void ts_rewrite(struct big_pool_t *pool, struct ts_rewrite_t *rewrite,
+		unsigned char *pkt, int pid)
+{
+	if (pid == 0x0 /* PAT */) {
+		memcpy(pkt, rewrite->pat, TS_SIZE);
+		pkt[3] = (pkt[3] & 0xf0) | (pool->pat_counter++ & 0x0f);
+	} else if (!rewrite->sdt_count) {
+		// no SDT generated yet. replace to null packet
+		pkt[1] = 0x1F;
+		pkt[2] = 0xFF;
+		pkt[3] = 0;
+	} else {
+		memcpy(pkt, rewrite->sdt + rewrite->sdt_cur * TS_SIZE, TS_SIZE);
+		pkt[3] = (pkt[3] & 0xf0) | (pool->sdt_counter++ & 0x0f);
+		if (++rewrite->sdt_cur >= rewrite->sdt_count)
+			rewrite->sdt_cur = 0;
+	}
 }
 
 /* thread for processing Transport Stream packets
  */
 void* process_ts(void * data) {
 	struct big_pool_t * pool = (struct big_pool_t *)data;
-	struct ts_node * node = NULL;
+	struct ts_node * node = NULL, *old = NULL;
+	struct ts_seg * seg = NULL;
+	struct ts_rewrite_t *rewrite = NULL;
+	struct joker_demux_t *demux = NULL;
+	struct list_head done;
 	unsigned char * pkt = NULL;
-	int pid = 0, i = 0;
+	int64_t drop = 0;
+	int pid = 0, i = 0, j = 0, batch = 0;
+
+	INIT_LIST_HEAD(&done);
+
+	joker_thread_setup(pool->joker, JOKER_THREAD_TS);
 
 	while(!pool->cancel) {
-		// get node from the list with locking (safe)
-		pthread_mutex_lock(&pool->threading->mux);
-		if(list_empty(&pool->ts_list))
-			pthread_cond_wait(&pool->threading->cond, &pool->threading->mux);
-		if(!list_empty(&pool->ts_list)) {
-			node = list_first_entry(&pool->ts_list, struct ts_node, list);
-			list_del(&node->list);
-		} else {
-			node = NULL;
+		// get node from the queue (lock-free). park if queue is empty
+		node = joker_queue_pop_wait(pool->ts_queue, 100 /* ms */);
+		if (!node) {
+			// source finished and everything processed. wakeup readers
+			if (__atomic_load_n(&pool->source_done, __ATOMIC_ACQUIRE) &&
+					!joker_queue_count(pool->ts_queue) && !pool->eof) {
+				pthread_mutex_lock(&pool->threading->mux_all);
+				pool->eof = 1;
+				pthread_mutex_unlock(&pool->threading->mux_all);
+				pthread_cond_broadcast(&pool->threading->cond_all);
+			}
+			continue;
 		}
-		pthread_mutex_unlock(&pool->threading->mux);
 
-		if (!node)
-			continue;
+		// replace PAT (and SDT) to our own
+		rewrite = ts_rewrite_prepare(pool);
+		// ts_unsubscribe and joker_demux_free wait for this node
+		__atomic_add_fetch(&pool->ts_started, 1, __ATOMIC_SEQ_CST);
+		demux = __atomic_load_n(&pool->demux, __ATOMIC_SEQ_CST);
+		batch = ts_batch_prepare(pool, node);
 
-		// process hooks
-		for (i = 0; i < node->size; i += TS_SIZE) {
-			pkt = node->data + i;
-			pid = (pkt[1]&0x1f) << 8 | pkt[2];
+		for (j = 0; j < node->segs_count; j++) {
+			seg = &node->segs[j];
 
-			if(pool->hooks[pid]) {
-				jdebug("calling hook pid=0x%x pool=%p pkt=%p\n", pid, pool, pkt);
-				pool->hooks[pid]( pool->hooks_opaque [ pid ] ?
-						pool->hooks_opaque[pid] : pool, pkt);
+			// process subscribers
+			for (i = 0; i < seg->size; i += TS_SIZE) {
+				pkt = seg->data + i;
+				pid = (pkt[1]&0x1f) << 8 | pkt[2];
+
+				// most PIDs have no subscribers. one bit test
+				if (__atomic_load_n(&pool->subs_bitmap[pid >> 6], __ATOMIC_RELAXED) &
+						(1ULL << (pid & 63)))
+					ts_dispatch(pool, pkt, pid, batch);
+
+				// single program streams from original packets
+				if (demux)
+					joker_demux_packet(demux, pkt, pid);
+
+				if (rewrite && (pid == 0x0 /* PAT */ || pid == 0x11 /* SDT */))
+					ts_rewrite(pool, rewrite, pkt, pid);
 			}
+
+			// keep history on disk. not affected by slow readers
+			if (pool->timeshift)
+				joker_timeshift_write(pool->timeshift, seg->data, seg->size);
+
+			// other processes. never waits for them
+			if (pool->shm)
+				joker_shm_write(pool->shm, seg->data, seg->size);
+
+			// save TS to ring buffer
+			if (!pool->zero_copy)
+				ring_write(pool, seg->data, seg->size);
+		}
+
+		// one call per node and PID
+		ts_batch_flush(pool);
+
+		// one sink call per node and program
+		if (demux)
+			joker_demux_flush(demux);
+		__atomic_add_fetch(&pool->ts_finished, 1, __ATOMIC_SEQ_CST);
+		ts_subs_reclaim(pool);
+
+		if (!pool->zero_copy) {
+			// node not needed anymore
+			drop_ts_data(node);
+			continue;
 		}
 
-		// save node to list 
+		// zero-copy: pass node to readers as is
+		// apply overflow_policy if readers are too slow. Otherwise all
+		// transfers will be lent and USB stalls
 		pthread_mutex_lock(&pool->threading->mux_all);
-		list_add_tail(&node->list, &pool->ts_list_all);
-		pool->ts_list_size += node->size;
-
-		// keep list in desired memory limit (remove old nodes)
-		jdebug("TS:all: ts_list_size=%d\n", pool->ts_list_size);
-		while (pool->ts_list_size > pool->ts_list_size_max && !list_empty(&pool->ts_list_all)) {
-			node = list_first_entry(&pool->ts_list_all, struct ts_node, list);
-			pool->ts_list_size -= node->size;
-			jdebug("Memory limit: dropping TS node %p. ts_list_size=%d\n", node, pool->ts_list_size);
+		if (pool->overflow_policy == TS_OVERFLOW_BLOCK && ts_full(pool, node->size))
+			ts_wait_space(pool, node->size);
+
+		if (pool->spill_write_off ||
+				(pool->overflow_policy == TS_OVERFLOW_SPILL && ts_full(pool, node->size))) {
+			// keep order. Spilled data read after ready list
+			pthread_mutex_unlock(&pool->threading->mux_all);
+			for (j = 0; j < node->segs_count; j++)
+				if (spill_write(pool, node->segs[j].data, node->segs[j].size))
+					break;
+			if (j < node->segs_count) {
+				STAT_ADD(pool, nodes_dropped, 1);
+				ts_overflow(pool, TS_OVERFLOW_DROP_NEWEST, node->size);
+			} else {
+				ts_overflow(pool, TS_OVERFLOW_SPILL, node->size);
+			}
+			drop_ts_data(node);
+			continue;
+		}
+
+		if (pool->overflow_policy == TS_OVERFLOW_DROP_NEWEST && ts_full(pool, node->size)) {
+			pthread_mutex_unlock(&pool->threading->mux_all);
+			jdebug("Transfers limit: dropping %d bytes\n", node->size);
+			STAT_ADD(pool, nodes_dropped, 1);
+			ts_overflow(pool, TS_OVERFLOW_DROP_NEWEST, node->size);
 			drop_ts_data(node);
+			continue;
 		}
 
-		jdebug("TS:all: node %p inserted. ts_list_size=%d\n", node, pool->ts_list_size);
+		drop = 0;
+		if (ts_full(pool, node->size) && !list_empty(&pool->ready_list)) {
+			old = list_first_entry(&pool->ready_list, struct ts_node, list);
+			drop = old->pos + old->size - pool->stream_tail;
+			jdebug("Transfers limit: dropping %lld bytes\n", (long long)drop);
+			STAT_ADD(pool, nodes_dropped, 1);
+			ts_drop_to(pool, old->pos + old->size);
+		}
+		node->pos = pool->stream_head;
+		list_add_tail(&node->list, &pool->ready_list);
+		pool->ready_count++;
+		pool->stream_head += node->size;
+		ts_release(pool, &done); // also oldest node if dropped
 		pthread_mutex_unlock(&pool->threading->mux_all);
-		pthread_cond_signal(&pool->threading->cond_all); // wakeup read threads
+		pthread_cond_broadcast(&pool->threading->cond_all); // wakeup read threads
+
+		ts_overflow(pool, TS_OVERFLOW_DROP_OLDEST, drop);
+		ts_release_done(&done);
 	}
 }
 
 /* thread for 'kicking' libusb polling 
- * TODO: not only default libusb context polling
+ * every device polls own libusb context
  * */
 void* process_usb(void * data) {
 	int completed = 0;
 	struct big_pool_t * pool = (struct big_pool_t *)data;
+	struct libusb_context *ctx = (struct libusb_context *)pool->joker->libusb_ctx_opaque;
+
+	joker_thread_setup(pool->joker, JOKER_THREAD_USB);
 
 	while(!pool->cancel) {
 		struct timeval tv = {
 			.tv_sec = 0,
 			.tv_usec = 1000
 		};
-		libusb_handle_events_timeout_completed(NULL, &tv, &completed);
+		libusb_handle_events_timeout_completed(ctx, &tv, &completed);
 	}
 }
 
-/* callback called by libusb when USB ISOC transfer completed */
-void record_callback(struct libusb_transfer *transfer)
+/* add TS data to node. merge with previous segment if contiguous */
+static void node_add_seg(struct ts_node *node, unsigned char *data, int len)
 {
-	struct libusb_iso_packet_descriptor pkt;
-	struct big_pool_t * pool = (struct big_pool_t *)transfer->user_data;
-	int i;
-	unsigned char * buf = 0;
-	int remain = 0, to_write = 0;
-	int err_counter = 0;
-	int ret = 0;
-	struct ts_node * node = NULL;
-	int total_len = 0;
-	int off = 0, cnt = 0, ts_off = 0, len = 0;
-	struct joker_t *joker = NULL;
-        
-	// free this transfer
-	if (!transfer->user_data) {
-		jdebug("%s: no user data\n", __func__);
-		transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
-		libusb_free_transfer(transfer);
+	struct ts_seg *seg = NULL;
+
+	if (len <= 0)
 		return;
+
+	if (node->segs_count)
+		seg = &node->segs[node->segs_count - 1];
+
+	if (seg && seg->data + seg->size == data) {
+		seg->size += len;
+	} else {
+		seg = &node->segs[node->segs_count++];
+		seg->data = data;
+		seg->size = len;
 	}
-    joker = pool->joker;
+	node->size += len;
+}
 
-	// looks like we stopping TS processing. do not submit this transfer
-	if(transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		printf("%s: LIBUSB_TRANSFER_CANCELLED\n", __func__);
+/* copy TS data to node own storage */
+static void node_copy(struct ts_node *node, unsigned char *data, int len)
+{
+	if (len <= 0)
 		return;
+
+	memcpy(node->data + node->data_size, data, len);
+	node_add_seg(node, node->data + node->data_size, len);
+	node->data_size += len;
+}
+
+/* keep transfer aside. mux_usb locked */
+static void usb_park(struct big_pool_t *pool, struct libusb_transfer *transfer)
+{
+	pool->usb_idle[pool->usb_idle_count++] = transfer;
+}
+
+/* transfer not submitted anymore. mux_usb locked */
+static void usb_landed(struct big_pool_t *pool, struct libusb_transfer *transfer)
+{
+	int i = 0;
+
+	for (i = 0; i < pool->usb_inflight; i++) {
+		if (pool->usb_flying[i] == transfer) {
+			pool->usb_flying[i] = pool->usb_flying[pool->usb_inflight - 1];
+			__atomic_sub_fetch(&pool->usb_inflight, 1, __ATOMIC_RELAXED);
+			break;
+		}
 	}
+}
 
-	if(transfer->status == LIBUSB_TRANSFER_ERROR) {
-		printf("%s: LIBUSB_TRANSFER_ERROR\n", __func__);
+/* TS processing stopped. transfer owner frees it */
+static void usb_free(struct libusb_transfer *transfer)
+{
+	transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
+	libusb_free_transfer(transfer);
+}
+
+/* apply current ISOC packets per transfer */
+static void usb_set_packets(struct big_pool_t *pool, struct libusb_transfer *transfer)
+{
+	int packets = __atomic_load_n(&pool->isoc_packets, __ATOMIC_RELAXED);
+
+	if (!packets || transfer->num_iso_packets == packets)
 		return;
+
+	transfer->num_iso_packets = packets;
+	transfer->length = packets * pool->joker->max_isoc_packets_size;
+	libusb_set_iso_packet_lengths(transfer, pool->joker->max_isoc_packets_size);
+}
+
+/* return transfer back to libusb
+ * transfer parked if enough transfers submitted
+ * and freed if TS processing stopped (see stop_ts) */
+static void usb_resubmit(struct big_pool_t *pool, struct libusb_transfer *transfer)
+{
+	int err_counter = 0;
+	int ret = 0;
+
+	while(1) {
+		pthread_mutex_lock(&pool->threading->mux_usb);
+		if (!transfer->user_data) {
+			pthread_mutex_unlock(&pool->threading->mux_usb);
+			usb_free(transfer);
+			return;
+		}
+		if (pool->usb_inflight >= __atomic_load_n(&pool->usb_target, __ATOMIC_RELAXED)) {
+			usb_park(pool, transfer);
+			pthread_mutex_unlock(&pool->threading->mux_usb);
+			return;
+		}
+		usb_set_packets(pool, transfer);
+		if (!(ret = libusb_submit_transfer(transfer))) {
+			pool->usb_flying[pool->usb_inflight] = transfer;
+			__atomic_add_fetch(&pool->usb_inflight, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&pool->threading->mux_usb);
+		if (!ret)
+			break;
+
+		STAT_ADD(pool, resubmit_errors, 1);
+		if(!(err_counter%1000))
+			printf("CALLBACK: ERROR: libusb_submit_transfer failed ret=%d. err_counter=%d\n", 
+					ret, err_counter);
+		err_counter++;
+		usleep(100);
+		if (err_counter > 10000) {
+			// TODO: reinit usb device
+			printf("too much errors. exiting ... \n");
+			return;
+		}
 	}
+}
 
-	/* update statistics */
-	if ( (getus() - pool->start_time) > 2000000 ) {
+void record_callback(struct libusb_transfer *transfer);
+
+/* allocate one more transfer (depth growing). new transfer is idle
+ * return NULL if no memory, all slots used or stopping */
+static struct libusb_transfer * usb_alloc(struct big_pool_t *pool)
+{
+	struct joker_t *joker = pool->joker;
+	struct libusb_transfer *transfer = NULL;
+	uint8_t *buf = NULL;
+	int index = 0;
+	int size = pool->isoc_packets_max * joker->max_isoc_packets_size;
+
+	if (pool->usb_bufs >= NUM_USB_BUFS_MAX)
+		return NULL;
+
+	buf = (uint8_t*)calloc(1, size);
+	transfer = libusb_alloc_transfer(pool->isoc_packets_max);
+	if (!buf || !transfer) {
+		free(buf);
+		libusb_free_transfer(transfer);
+		return NULL;
+	}
+
+	libusb_fill_iso_transfer(transfer, (struct libusb_device_handle *)joker->libusb_opaque,
+			USB_EP3_IN, buf, size, pool->isoc_packets_max,
+			record_callback, (void *)pool, 1000);
+	libusb_set_iso_packet_lengths(transfer, joker->max_isoc_packets_size);
+
+	// stop_ts walks transfers under same lock
+	pthread_mutex_lock(&pool->threading->mux_usb);
+	if (pool->usb_stop) {
+		pthread_mutex_unlock(&pool->threading->mux_usb);
+		usb_free(transfer);
+		return NULL;
+	}
+	index = pool->usb_bufs;
+	pool->usb_buffers[index] = buf;
+	pool->transfers[index] = transfer;
+	__atomic_store_n(&pool->usb_bufs, index + 1, __ATOMIC_RELAXED);
+	usb_park(pool, transfer);
+	pthread_mutex_unlock(&pool->threading->mux_usb);
+
+	return transfer;
+}
+
+/* submit idle transfers until target depth reached
+ * rotation grows if needed (zero-copy mode keeps NUM_USB_BUFS_LENT extra)
+ * USB events thread only */
+static void usb_refill(struct big_pool_t *pool)
+{
+	struct libusb_transfer *transfer = NULL;
+	int target = __atomic_load_n(&pool->usb_target, __ATOMIC_RELAXED);
+
+	while (pool->usb_bufs < target + (pool->zero_copy ? NUM_USB_BUFS_LENT : 0))
+		if (!usb_alloc(pool))
+			break;
+
+	while (__atomic_load_n(&pool->usb_inflight, __ATOMIC_RELAXED) < target &&
+			__atomic_load_n(&pool->usb_idle_count, __ATOMIC_RELAXED)) {
+		transfer = NULL;
+		pthread_mutex_lock(&pool->threading->mux_usb);
+		if (pool->usb_idle_count)
+			transfer = pool->usb_idle[--pool->usb_idle_count];
+		pthread_mutex_unlock(&pool->threading->mux_usb);
+		if (!transfer)
+			break;
+		usb_resubmit(pool, transfer);
+	}
+}
+
+static void stats_snapshot(struct big_pool_t * pool, struct joker_capture_stats_t *st)
+{
+	st->transfers = __atomic_load_n(&pool->stats.transfers, __ATOMIC_RELAXED);
+	st->isoc_ok = __atomic_load_n(&pool->stats.isoc_ok, __ATOMIC_RELAXED);
+	st->isoc_error = __atomic_load_n(&pool->stats.isoc_error, __ATOMIC_RELAXED);
+	st->isoc_empty = __atomic_load_n(&pool->stats.isoc_empty, __ATOMIC_RELAXED);
+	st->bytes = __atomic_load_n(&pool->stats.bytes, __ATOMIC_RELAXED);
+	st->resyncs = __atomic_load_n(&pool->stats.resyncs, __ATOMIC_RELAXED);
+	st->tails_dropped = __atomic_load_n(&pool->stats.tails_dropped, __ATOMIC_RELAXED);
+	st->nodes_dropped = __atomic_load_n(&pool->stats.nodes_dropped, __ATOMIC_RELAXED);
+	st->bytes_dropped = __atomic_load_n(&pool->stats.bytes_dropped, __ATOMIC_RELAXED);
+	st->resubmit_errors = __atomic_load_n(&pool->stats.resubmit_errors, __ATOMIC_RELAXED);
+	st->overflows = __atomic_load_n(&pool->stats.overflows, __ATOMIC_RELAXED);
+	st->bytes_spilled = __atomic_load_n(&pool->stats.bytes_spilled, __ATOMIC_RELAXED);
+	st->time = getus();
+	st->usb_bufs = __atomic_load_n(&pool->usb_target, __ATOMIC_RELAXED);
+	st->isoc_packets = __atomic_load_n(&pool->isoc_packets, __ATOMIC_RELAXED);
+}
+
+int joker_get_capture_stats(struct joker_t *joker, struct joker_capture_stats_t *stats)
+{
+	if (!joker || !stats || !joker->pool)
+		return -EINVAL;
+
+	if (joker->pool->initialized != BIG_POOL_MAGIC)
+		return -EINVAL;
+
+	stats_snapshot(joker->pool, stats);
+
+	return 0;
+}
+
+/* print statistics every 2 seconds
+ * only record_callback calls this (stats_last not shared) */
+static void stats_print(struct big_pool_t * pool)
+{
+	struct joker_capture_stats_t now, *last = &pool->stats_last;
+	double us = 0;
+
+	if ((getus() - last->time) <= 2000000)
+		return;
+
+	stats_snapshot(pool, &now);
+	us = (double)(now.time - last->time);
+
+	if (!pool->stats_quiet) {
 		printf("USB ISOC: all/complete=%f/%f transfer/sec %.2f MBytes %f mbits/sec, %f calls/sec\n", 
-				(double)((int64_t)1000000*pool->pkt_count)/(getus() - pool->start_time),
-				(double)((int64_t)1000000*pool->pkt_count_complete)/(getus() - pool->start_time),
-				(double)pool->bytes/1024/1024,
-				(double)((int64_t)1000000*8*pool->bytes/1048576)/(getus() - pool->start_time),
-				(double)((int64_t)1000000*pool->calls_count)/(getus() - pool->start_time)
+				1000000*(double)(now.isoc_ok + now.isoc_error + now.isoc_empty -
+					last->isoc_ok - last->isoc_error - last->isoc_empty)/us,
+				1000000*(double)(now.isoc_ok - last->isoc_ok)/us,
+				(double)(now.bytes - last->bytes)/1024/1024,
+				1000000*8*(double)(now.bytes - last->bytes)/1048576/us,
+				1000000*(double)(now.transfers - last->transfers)/us
 				);
 		fflush(stdout);
-		pool->calls_count = 0;
-		pool->pkt_count = 0;
-		pool->pkt_count_complete = 0;
-		pool->bytes = 0;
-		pool->start_time = getus();
 	}
-	pool->calls_count++;
+
+	*last = now;
+}
+
+int ts_capture_transfer(struct big_pool_t *pool, struct libusb_transfer *transfer)
+{
+	struct libusb_iso_packet_descriptor pkt;
+	int i;
+	unsigned char * buf = 0;
+	struct ts_node * node = NULL;
+	int total_len = 0;
+	int cnt = 0, ts_off = 0, len = 0, lent = 0;
+	int isoc_error = 0, isoc_empty = 0, resyncs = 0, tails_dropped = 0;
+
+	/* update statistics */
+	stats_print(pool);
 
 	// fill TS list with received data
 	for(i = 0; i < transfer->num_iso_packets; i++) {
 		pkt = transfer->iso_packet_desc[i];
-		if (pkt.status == LIBUSB_TRANSFER_COMPLETED)
-			total_len += transfer->iso_packet_desc[i].actual_length;
+		if (pkt.status != LIBUSB_TRANSFER_COMPLETED)
+			isoc_error++;
+		else if (!pkt.actual_length)
+			isoc_empty++;
+		else
+			total_len += pkt.actual_length;
 	}
-
-	node = malloc(sizeof(*node));
+	STAT_ADD(pool, transfers, 1);
+	STAT_ADD(pool, isoc_ok, transfer->num_iso_packets - isoc_error - isoc_empty);
+	STAT_ADD(pool, isoc_error, isoc_error);
+	STAT_ADD(pool, isoc_empty, isoc_empty);
+	STAT_ADD(pool, bytes, total_len);
+
+	// no heap allocations here. node comes from preallocated slab
+	node = slab_get(pool->slab);
 	if(!node) {
-		printf("%s: can't alloc mem for node \n", __func__);
-		return;
-	}
-	memset(node, 0, sizeof(*node));
-
-	node->data = malloc(total_len + TS_SIZE);
-	if (!node->data) {
-		printf("%s: can't alloc mem for data \n", __func__);
-		return;
+		jdebug("%s: no free nodes. transfer dropped \n", __func__);
+		STAT_ADD(pool, nodes_dropped, 1);
+		STAT_ADD(pool, bytes_dropped, total_len);
+		pool->tail_size = 0;
+		return 0;
 	}
 
 	node->size = 0;
+	node->data_size = 0;
+	node->segs_count = 0;
+	node->pos = 0;
+	node->transfer = NULL;
+	node->refs = 1;
 	node->counter = pool->node_counter++;
 
 	// traversal of ISOC packets and copy data to TS list
 	// data may be not aligned to TS_SIZE so we use "tail"
+	// in zero-copy mode aligned data not copied (just referenced)
 	for(i = 0; i < transfer->num_iso_packets; i++) {
 		pkt = transfer->iso_packet_desc[i];
 		len = transfer->iso_packet_desc[i].actual_length;
 		jdebug("ISO pkt length=%d actual_length=%d status=0x%x\n",
 				transfer->iso_packet_desc[i].length,
 				transfer->iso_packet_desc[i].actual_length, pkt.status);
-		pool->pkt_count++;
 
 		if (pkt.status == LIBUSB_TRANSFER_COMPLETED && len > 0) {
-			pool->pkt_count_complete++;
-			pool->bytes += len;
 			if ((buf = libusb_get_iso_packet_buffer(transfer, i))) {
-				if (joker->raw_data_filename_fd > 0)
-					fwrite(buf, len, 1, joker->raw_data_filename_fd);
+				// never touch filesystem here. writer thread does it
+				if (pool->raw_writer)
+					joker_writer_write(pool->raw_writer, buf, len);
 
-				if (buf[TS_SIZE - pool->tail_size] == TS_SYNC)
+				if (!pool->tail_size && buf[0] == TS_SYNC)
+					ts_off = 0; // packet aligned. no tail
+				else if (buf[TS_SIZE - pool->tail_size] == TS_SYNC)
 					ts_off = TS_SIZE - pool->tail_size; // tail is ok. use it
-				else
+				else {
 					ts_off = next_ts_off(buf, len);
-				jdebug("	foff=%lld ts_off=%d tail_size=%d len=%d\n",
-						ftell(joker->raw_data_filename_fd),
+					resyncs++;
+				}
+				jdebug("	ts_off=%d tail_size=%d len=%d\n",
 						ts_off, pool->tail_size, len);
 				if (ts_off < 0)
 					continue;
 
-				if ((ts_off + pool->tail_size) == TS_SIZE) {
-					jdebug("	 tail OK\n");
-					// tail from previous round is ok
-					// use it
-					memcpy(node->data + off, pool->tail, pool->tail_size);
-					off += pool->tail_size;
+				if ((ts_off + pool->tail_size) == TS_SIZE) {
+					jdebug("	 tail OK\n");
+					// tail from previous round is ok
+					// use it. packet straddling ISOC packets always copied
+					node_copy(node, pool->tail, pool->tail_size);
+					node_copy(node, buf, ts_off);
+					pool->tail_size = 0;
+				} else {
+					// just drop useless tail
+					jdebug("	 tail size=%d DROP\n", pool->tail_size);
+					if (pool->tail_size)
+						tails_dropped++;
+					pool->tail_size = 0;
+				}
+
+				// process rest of the buffer
+				cnt = (len - ts_off)/TS_SIZE;
+				jdebug("	 cnt=%d\n", cnt);
+
+				if (pool->zero_copy)
+					node_add_seg(node, buf + ts_off, cnt * TS_SIZE);
+				else
+					node_copy(node, buf + ts_off, cnt * TS_SIZE);
+
+				// copy tail if exist
+				if ( (ts_off + cnt * TS_SIZE) < len) {
+					pool->tail_size = len - (ts_off + cnt * TS_SIZE);
+					memcpy(pool->tail, buf + (ts_off + cnt * TS_SIZE), pool->tail_size);
+					jdebug("tail=0x%x tailoff=0x%x\n", pool->tail[0], (ts_off + cnt * TS_SIZE));
+				}
+
+			}
+		}
+	}
+
+	// lend transfer to TS pipeline. It will be resubmitted
+	// when node released (drop_ts_data)
+	lent = pool->zero_copy && node->data_size < node->size;
+	node->transfer = lent ? transfer : NULL;
+
+	// pass node to ts processing thread (lock-free)
+	// ts thread will be woken up only if it's sleeping
+	if (!node->size || joker_queue_push(pool->ts_queue, node)) {
+		if (node->size) {
+			jdebug("%s: TS queue full. node dropped \n", __func__);
+			STAT_ADD(pool, nodes_dropped, 1);
+			STAT_ADD(pool, bytes_dropped, node->size);
+		}
+		slab_put(pool->slab, node);
+		lent = 0;
+	}
+	jdebug("TSLIST:added to ts queue. total_len=%d \n", total_len);
+
+	if (resyncs)
+		STAT_ADD(pool, resyncs, resyncs);
+	if (tails_dropped)
+		STAT_ADD(pool, tails_dropped, tails_dropped);
+
+	return lent;
+}
+
+/* adaptive USB depth controller. called for every completed transfer
+ * looks at completion interval, average callback duration and ISOC errors
+ * every second and adjusts submitted transfers and ISOC packets per transfer
+ * queued time (transfers * packets * 125usec) should cover worst
+ * completion interval with margin */
+static void usb_adapt(struct big_pool_t *pool, uint64_t start, uint64_t end)
+{
+	struct joker_t *joker = pool->joker;
+	struct joker_capture_stats_t now, *last = &pool->adapt_last;
+	int64_t errors = 0, empty = 0, all = 0;
+	int target = pool->usb_target, packets = pool->isoc_packets;
+	int min = joker->usb_bufs_min, max = joker->usb_bufs_max;
+	int packets_min = joker->isoc_packets_min;
+	uint64_t urb_us = 0, queued_us = 0, callback_us = 0;
+
+	// stopping (see stop_ts)
+	if (!target || __atomic_load_n(&pool->usb_stop, __ATOMIC_RELAXED))
+		return;
+
+	if (pool->adapt_completion && start - pool->adapt_completion > pool->adapt_max_interval)
+		pool->adapt_max_interval = start - pool->adapt_completion;
+	pool->adapt_completion = start;
+	pool->adapt_callback_us += end - start;
+	pool->adapt_callbacks++;
+
+	// at least one second window
+	if (end - pool->adapt_time < 1000000)
+		goto refill;
+
+	stats_snapshot(pool, &now);
+	errors = now.isoc_error - last->isoc_error + now.resubmit_errors - last->resubmit_errors;
+	empty = now.isoc_empty - last->isoc_empty;
+	all = now.isoc_ok + now.isoc_error + now.isoc_empty -
+		last->isoc_ok - last->isoc_error - last->isoc_empty;
+	urb_us = (uint64_t)packets * USB_MICROFRAME_US;
+	queued_us = (uint64_t)target * urb_us;
+	callback_us = pool->adapt_callback_us / pool->adapt_callbacks;
+
+	if (min < max) {
+		if (errors || pool->adapt_max_interval > queued_us / 2) {
+			// hiccup or data lost. queue more transfers
+			target = target * 2;
+			pool->adapt_quiet = 0;
+		} else if (pool->adapt_max_interval < queued_us / 8 &&
+				++pool->adapt_quiet >= 10) {
+			// quiet for 10 seconds. release slowly
+			target = target - (target / 4 ? target / 4 : 1);
+			pool->adapt_quiet = 0;
+		}
+	}
+
+	if (callback_us > urb_us / 2 && packets / 2 >= packets_min) {
+		// heavy callbacks. split work to smaller transfers, same queued time
+		packets /= 2;
+		target *= 2;
+	} else if ((callback_us < urb_us / 8 ||
+				(empty * 2 > all && callback_us < urb_us / 4)) &&
+			packets * 2 <= pool->isoc_packets_max && target / 2 >= min) {
+		// cheap callbacks or low bitrate. less callbacks, same queued time
+		packets *= 2;
+		target /= 2;
+	}
+
+	if (target < min)
+		target = min;
+	if (target > max)
+		target = max;
+
+	if (target != pool->usb_target || packets != pool->isoc_packets) {
+		if (!pool->stats_quiet)
+			printf("USB: %d transfers by %d ISOC packets (max completion interval %lld usec, %lld errors)\n",
+					target, packets, (long long)pool->adapt_max_interval, (long long)errors);
+		__atomic_store_n(&pool->isoc_packets, packets, __ATOMIC_RELAXED);
+		__atomic_store_n(&pool->usb_target, target, __ATOMIC_RELAXED);
+	}
+
+	*last = now;
+	pool->adapt_time = end;
+	pool->adapt_max_interval = 0;
+	pool->adapt_callback_us = 0;
+	pool->adapt_callbacks = 0;
+
+refill:
+	usb_refill(pool);
+}
+
+/* callback called by libusb when USB ISOC transfer completed */
+void record_callback(struct libusb_transfer *transfer)
+{
+	struct big_pool_t * pool = (struct big_pool_t *)__atomic_load_n(&transfer->user_data, __ATOMIC_ACQUIRE);
+	uint64_t start = 0;
+	int stopped = 1;
+
+	// stop_ts clears user data under mux_usb
+	if (pool) {
+		pthread_mutex_lock(&pool->threading->mux_usb);
+		if ((stopped = !transfer->user_data) == 0)
+			usb_landed(pool, transfer);
+		pthread_mutex_unlock(&pool->threading->mux_usb);
+	}
+
+	// free this transfer
+	if (stopped) {
+		jdebug("%s: no user data\n", __func__);
+		usb_free(transfer);
+		return;
+	}
+
+	// looks like we stopping TS processing. do not submit this transfer
+	if(transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		printf("%s: LIBUSB_TRANSFER_CANCELLED\n", __func__);
+		return;
+	}
+
+	if(transfer->status == LIBUSB_TRANSFER_ERROR) {
+		printf("%s: LIBUSB_TRANSFER_ERROR\n", __func__);
+		return;
+	}
+
+	// return USB ISOC ASAP !
+	start = getus();
+	if (!ts_capture_transfer(pool, transfer))
+		usb_resubmit(pool, transfer);
+	usb_adapt(pool, start, getus());
+}
+
+int ts_pipeline_start(struct joker_t *joker, struct big_pool_t *pool)
+{
+	struct ts_reader_t *reader = NULL;
+	int rc = 0, ret = 0;
+
+	if (!joker || !pool)
+		return EINVAL;
+
+	// sanity check
+	if (pool->initialized != BIG_POOL_MAGIC) {
+		if (pool_init(joker, pool)) {
+            printf("Can't init pool ! Stop TS processing ... \n");
+            return EINVAL;
+        }
+    }
+
+	// preallocate nodes for record_callback
+	if (!pool->slab && (ret = slab_init(joker, pool))) {
+		printf("Can't alloc TS nodes ! Stop TS processing ... \n");
+		return ret;
+	}
 
-					memcpy(node->data + off, buf, ts_off);
-					off += ts_off;
+	// ring buffer for collected TS
+	if (!pool->ptr && (ret = ring_init(pool))) {
+		printf("Can't alloc TS ring buffer ! Stop TS processing ... \n");
+		return ret;
+	}
 
-					node->size = node->size + pool->tail_size + ts_off;
-					pool->tail_size = 0;
-				} else {
-					// just drop useless tail
-					jdebug("	 tail size=%d DROP\n", pool->tail_size);
-					pool->tail_size = 0;
-				}
+	// TS history on disk
+	if (pool->timeshift_filename && !pool->timeshift) {
+		pool->timeshift = joker_timeshift_open(pool->timeshift_filename,
+				pool->timeshift_size, pool->timeshift_interval);
+		if (!pool->timeshift) {
+			printf("Can't open timeshift file ! Stop TS processing ... \n");
+			return -EIO;
+		}
+	}
 
-				// process rest of the buffer
-				cnt = (len - ts_off)/TS_SIZE;
-				jdebug("	 cnt=%d\n", cnt);
+	// TS for other processes
+	if (pool->shm_name && !pool->shm) {
+		pool->shm = joker_shm_open(pool->shm_name, pool->shm_size);
+		if (!pool->shm) {
+			printf("Can't create shared memory ring ! Stop TS processing ... \n");
+			return -EIO;
+		}
+	}
 
-				memcpy(node->data + off, buf + ts_off, cnt * TS_SIZE); 
-				off += cnt * TS_SIZE;
-				node->size += cnt * TS_SIZE;
+	// lent transfers not available for USB. use bigger rotation
+	pool->usb_bufs = pool->zero_copy ? NUM_USB_BUFS_ZC : NUM_USB_BUFS;
+	pool->usb_target = NUM_USB_BUFS;
+	pool->usb_inflight = 0;
+	pool->usb_idle_count = 0;
+	pool->usb_stop = 0;
+
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	memset(&pool->stats_last, 0, sizeof(pool->stats_last));
+	pool->stats_last.time = getus();
+	pool->source_done = 0;
+	pool->eof = 0;
+	pool->cancel = 0;
 
-				// copy tail if exist
-				if ( (ts_off + cnt * TS_SIZE) < len) {
-					pool->tail_size = len - (ts_off + cnt * TS_SIZE);
-					memcpy(pool->tail, buf + (ts_off + cnt * TS_SIZE), pool->tail_size);
-					jdebug("tail=0x%x tailoff=0x%x\n", pool->tail[0], (ts_off + cnt * TS_SIZE));
-				}
+	// readers start from beginning of stream
+	pool->stream_head = pool->stream_tail = 0;
+	list_for_each_entry(reader, &pool->readers, list)
+		reader->off = 0;
 
-			}
-		}
+	// batch hooks workers. before TS thread
+	if ((ret = ts_workers_start(pool))) {
+		printf("Can't start TS workers ! Stop TS processing ... \n");
+		pool->cancel = 1;
+		ts_workers_stop(pool);
+		return ret;
 	}
 
-	// add node to the list with locking (safe)
-	pthread_mutex_lock(&pool->threading->mux);
-	list_add_tail(&node->list, &pool->ts_list);
-	pthread_mutex_unlock(&pool->threading->mux);
-	pthread_cond_signal(&pool->threading->cond); // wakeup ts procesing thread
-	jdebug("TSLIST:added to tslist. total_len=%d \n", total_len);
+	// start TS processing thread
+	rc = pthread_create(&pool->threading->ts_thread, NULL, process_ts, (void *)pool);
+	if (rc){
+		printf("ERROR: can't start TS processing thread. code=%d\n", rc);
+		pool->cancel = 1;
+		ts_workers_stop(pool);
+		return rc;
+	}
 
-	// TODO: delete old nodes in TS list
+	return 0;
+}
 
+void ts_pipeline_eof(struct big_pool_t *pool)
+{
+	__atomic_store_n(&pool->source_done, 1, __ATOMIC_RELEASE);
+	joker_queue_wakeup(pool->ts_queue);
+}
 
-	// return USB ISOC ASAP !
-	while(1) {
-		if ((ret = libusb_submit_transfer(transfer))) {
-			if(!(err_counter%1000))
-				printf("CALLBACK: ERROR: libusb_submit_transfer failed ret=%d. err_counter=%d\n", 
-						ret, err_counter);
-			err_counter++;
-			usleep(100);
-			if (err_counter > 10000) {
-				// TODO: reinit usb device
-				printf("too much errors. exiting ... \n");
-				return;
-			}
-		}else{
-			// printf("transfer return back done \n");
-			break;
-		}
+void ts_pipeline_stop(struct big_pool_t *pool)
+{
+	struct ts_node * node = NULL;
+	struct ts_reader_t *reader = NULL;
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	pool->cancel = 1;
+	pthread_mutex_unlock(&pool->threading->mux_all);
+	pthread_cond_broadcast(&pool->threading->cond_space); // TS thread can wait for readers
+	pthread_cond_broadcast(&pool->threading->cond_all); // wakeup readers
+	joker_queue_wakeup(pool->ts_queue); // wakeup TS procesing thread
+	pthread_join(pool->threading->ts_thread, NULL);
+	ts_workers_stop(pool);
+
+	// release nodes (and lent transfers) not processed yet
+	while ((node = joker_queue_pop(pool->ts_queue)))
+		drop_ts_data(node);
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	while (!list_empty(&pool->ready_list)) {
+		node = list_first_entry(&pool->ready_list, struct ts_node, list);
+		list_del(&node->list);
+		drop_ts_data(node);
 	}
+	pool->ready_count = 0;
+	pool->fill = 0;
+	pool->spill_write_off = pool->spill_ready_off = 0;
+	// nothing left for readers
+	pool->stream_tail = pool->stream_head;
+	pool->read_ptr = pool->write_ptr;
+	list_for_each_entry(reader, &pool->readers, list)
+		reader->off = pool->stream_head;
+	pool->eof = 1;
+	pthread_cond_broadcast(&pool->threading->cond_all);
+
+	// readers leave read calls. pool can be freed after this
+	while (pool->readers_active)
+		pthread_cond_wait(&pool->threading->cond_all, &pool->threading->mux_all);
+	pthread_mutex_unlock(&pool->threading->mux_all);
 }
 
 /* start TS processing thread 
@@ -368,13 +2380,17 @@ int start_ts(struct joker_t *joker, struct big_pool_t *pool)
 	if (!dev)
 		return EINVAL;
 
-	// sanity check
-	if (pool->initialized != BIG_POOL_MAGIC) {
-		if (pool_init(joker, pool)) {
-            printf("Can't init pool ! Stop TS processing ... \n");
-            return EINVAL;
-        }
-    }
+	// raw USB data (see --raw-data)
+	if (joker->raw_data_filename && !pool->raw_writer) {
+		pool->raw_writer = joker_writer_open(joker->raw_data_filename, 0, 0, 0);
+		if (!pool->raw_writer)
+			return -EIO;
+	}
+
+	// nodes, ring buffer and TS processing thread
+	pool->transfer_release = NULL; // lent transfers resubmitted to USB
+	if ((ret = ts_pipeline_start(joker, pool)))
+		return ret;
 
 #ifdef __WIN32__
 	// USB isoch packets can lost under Windows if we do not increase priority
@@ -404,12 +2420,38 @@ int start_ts(struct joker_t *joker, struct big_pool_t *pool)
 	if ((ret = joker_cmd(joker, buf, 2, NULL /* in_buf */, 0 /* in_len */)))
 		return ret;
 	
+	// adaptive depth limits
+	if (joker->usb_bufs_min <= 0)
+		joker->usb_bufs_min = USB_BUFS_MIN_DEFAULT;
+	if (joker->usb_bufs_max <= 0)
+		joker->usb_bufs_max = USB_BUFS_MAX_DEFAULT;
+	if (joker->usb_bufs_max > NUM_USB_BUFS_MAX - (pool->zero_copy ? NUM_USB_BUFS_LENT : 0))
+		joker->usb_bufs_max = NUM_USB_BUFS_MAX - (pool->zero_copy ? NUM_USB_BUFS_LENT : 0);
+	if (joker->usb_bufs_min > joker->usb_bufs_max)
+		joker->usb_bufs_min = joker->usb_bufs_max;
+	if (joker->isoc_packets_min <= 0)
+		joker->isoc_packets_min = ISOC_PACKETS_MIN_DEFAULT;
+	if (pool->usb_target < joker->usb_bufs_min)
+		pool->usb_target = joker->usb_bufs_min;
+	if (pool->usb_target > joker->usb_bufs_max)
+		pool->usb_target = joker->usb_bufs_max;
+	pool->usb_bufs = pool->usb_target + (pool->zero_copy ? NUM_USB_BUFS_LENT : 0);
+	pool->isoc_packets_max = joker->max_isoc_packets_count;
+	memset(&pool->adapt_last, 0, sizeof(pool->adapt_last));
+	pool->adapt_time = getus();
+	pool->adapt_completion = 0;
+	pool->adapt_max_interval = 0;
+	pool->adapt_callback_us = 0;
+	pool->adapt_callbacks = 0;
+	pool->adapt_quiet = 0;
+
 	// create isochronous transfers
 	// USB isoc transfer (DATA_IN token) should be delivered to Joker TV 
 	// every microframe (125usec)
 	// One isoc transfer size is 1024 bytes (max 1024)
 	// Hight bandwidth isoc transfer can support up to 3 DATA token's in one microframe
-	for (index = 0; index < NUM_USB_BUFS; index++) {
+	// only usb_target transfers submitted. rest is idle (zero-copy rotation)
+	for (index = 0; index < pool->usb_bufs; index++) {
 		// iterate number of isoc packets to find maximum allowed on this system
 		// usually it depends on OS available contig. memory
 		allocated = 0;
@@ -424,10 +2466,20 @@ int start_ts(struct joker_t *joker, struct big_pool_t *pool)
 					max_isoc_packets_count_avail, cb, (void *)pool, 1000);
 			libusb_set_iso_packet_lengths(pool->transfers[index], joker->max_isoc_packets_size);
 
+			if (index >= pool->usb_target) {
+				pthread_mutex_lock(&pool->threading->mux_usb);
+				usb_park(pool, pool->transfers[index]);
+				pthread_mutex_unlock(&pool->threading->mux_usb);
+				allocated = 1;
+				break;
+			}
+
 			ret = libusb_submit_transfer(pool->transfers[index]);
 			if (ret) {
 				libusb_free_transfer(pool->transfers[index]);
 				pool->transfers[index] = NULL;
+				free(pool->usb_buffers[index]);
+				pool->usb_buffers[index] = NULL;
 				// try lower 
 				jdebug("%d packets not available. Will try lower \n", 
 						max_isoc_packets_count_avail);
@@ -437,32 +2489,28 @@ int start_ts(struct joker_t *joker, struct big_pool_t *pool)
 			jdebug("%d packets available. usb transfer %d (%p) done\n",
 					max_isoc_packets_count_avail,
 					index, pool->transfers[index]);
+			pthread_mutex_lock(&pool->threading->mux_usb);
+			pool->usb_flying[pool->usb_inflight] = pool->transfers[index];
+			__atomic_add_fetch(&pool->usb_inflight, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&pool->threading->mux_usb);
 			allocated = 1;
 		}
+
+		// all transfers should fit same ISOC packets count
+		if (allocated && max_isoc_packets_count_avail < pool->isoc_packets_max)
+			pool->isoc_packets_max = max_isoc_packets_count_avail;
 	}
+	pool->isoc_packets = pool->isoc_packets_max;
+	if (joker->isoc_packets_min > pool->isoc_packets_max)
+		joker->isoc_packets_min = pool->isoc_packets_max;
 	
 	// start ISOC USB transfers processing thread
-	pool->calls_count = 0;
-	pool->pkt_count = 0;
-	pool->pkt_count_complete = 0;
-	pool->start_time = getus();
-	pool->bytes = 0;
-	pool->cancel = 0;
-
 	rc = pthread_create(&pool->threading->usb_thread, NULL, process_usb, (void *)pool);
 	if (rc){
 		printf("ERROR: can't start USB processing thread. code=%d\n", rc);
 		return rc;
 	}
 
-	// start TS processing thread
-	rc = pthread_create(&pool->threading->ts_thread, NULL, process_ts, (void *)pool);
-	if (rc){
-		printf("ERROR: can't start TS processing thread. code=%d\n", rc);
-		pool->cancel = 1; // will stop usb processing
-		return rc;
-	}
-
 	return 0;
 }
 
@@ -470,9 +2518,9 @@ int start_ts(struct joker_t *joker, struct big_pool_t *pool)
  * TODO*/
 int stop_ts(struct joker_t *joker, struct big_pool_t * pool)
 {
+	struct libusb_transfer *transfer = NULL;
 	int index = 0;
 	int ret = 0;
-	struct ts_node * node = NULL;
 
 	// sanity check
 	if (pool->initialized != BIG_POOL_MAGIC || !joker || pool->cancel)
@@ -480,26 +2528,44 @@ int stop_ts(struct joker_t *joker, struct big_pool_t * pool)
 
 	set_refresh(joker, 0);
 
-	for (index = 0; index < NUM_USB_BUFS; index++) {
-		// signal callback to free this transfer. We can't clean it here
-		// because this cancel is async and transaction actually cancelled later
-		if(pool->transfers[index])
-			pool->transfers[index]->user_data = NULL;
+	// no more resubmits and new transfers (USB thread grows rotation
+	// under same lock). Every transfer freed by its owner:
+	// idle - here, submitted - callback after cancel, lent - drop_ts_data
+	pthread_mutex_lock(&pool->threading->mux_usb);
+	pool->usb_stop = 1;
+	__atomic_store_n(&pool->usb_target, 0, __ATOMIC_RELAXED);
+	for (index = 0; index < pool->usb_bufs; index++) {
+		transfer = pool->transfers[index];
+		pool->transfers[index] = NULL;
+		if (transfer)
+			__atomic_store_n(&transfer->user_data, NULL, __ATOMIC_RELEASE);
+	}
 
-		if(pool->transfers[index] && libusb_cancel_transfer(pool->transfers[index]))
-			printf("can't cancel usb transfer %d (%p) \n", index, pool->transfers[index]);
+	// lent transfers are not in flight. do not cancel them
+	for (index = 0; index < pool->usb_inflight; index++) {
+		transfer = pool->usb_flying[index];
+		// LIBUSB_ERROR_NOT_FOUND: completed, callback waits for lock
+		if ((ret = libusb_cancel_transfer(transfer)) && ret != LIBUSB_ERROR_NOT_FOUND)
+			printf("can't cancel usb transfer %d (%p) \n", index, transfer);
 		else
-			jdebug("cancel usb transfer %d (%p) \n", index, pool->transfers[index]);
-		pool->transfers[index] = NULL;
+			jdebug("cancel usb transfer %d (%p) \n", index, transfer);
 	}
+	pool->usb_inflight = 0;
 
-	// stop USB and TS processing threads
-	pool->cancel = 1;
-	pthread_cond_signal(&pool->threading->cond); // wakeup TS procesing thread
+	while (pool->usb_idle_count)
+		usb_free(pool->usb_idle[--pool->usb_idle_count]);
+	pthread_mutex_unlock(&pool->threading->mux_usb);
 
+	// stop USB and TS processing threads
 	// lock until threads ended
+	pool->cancel = 1;
 	pthread_join(pool->threading->usb_thread, NULL);
-	pthread_join(pool->threading->ts_thread, NULL);
+	ts_pipeline_stop(pool);
+
+	if (pool->raw_writer) {
+		joker_writer_close(pool->raw_writer);
+		pool->raw_writer = NULL;
+	}
 
 	if ((ret = libusb_release_interface((struct libusb_device_handle *)joker->libusb_opaque, 0))) {
 		printf("%s: can't release USB interface ! \n", __func__ );
@@ -511,117 +2577,245 @@ int stop_ts(struct joker_t *joker, struct big_pool_t * pool)
 		return -EIO;
 	}
 
-	// cleanup collected TS data
-	while (!list_empty(&pool->ts_list_all)) {
-		node = list_first_entry(&pool->ts_list_all, struct ts_node, list);
-		pool->ts_list_size -= node->size;
-		drop_ts_data(node);
-		jdebug("TS:all: drop node %p. ts_list_size=%d\n", node, pool->ts_list_size);
-	}
-
 	pool_uninit(pool);
 
 	return 0;
 }
 
+void ts_node_get(struct ts_node * node)
+{
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* drop node reference. last one returns node to the slab
+ * and resubmits lent transfer */
 void drop_ts_data(struct ts_node * node)
 {
-	list_del(&node->list);
-	free(node->data);
-	free(node);
+	struct big_pool_t *pool = node->pool;
+	struct libusb_transfer *transfer = NULL;
+
+	if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	transfer = node->transfer;
+	node->transfer = NULL;
+	slab_put(pool->slab, node);
+
+	if (!transfer)
+		return;
+
+	// transfer not from USB (replay, etc)
+	if (pool->transfer_release) {
+		pool->transfer_release(transfer);
+		return;
+	}
+
+	// freed there if TS processing stopped
+	usb_resubmit(pool, transfer);
 }
 
 /* find next TS packet start
  * 0x47 - sync byte
  * TS packet size hardcoded to 188 bytes
+ * position confirmed by TS_SYNC_LOCK_COUNT following sync bytes
  * return offset of TS packet start 
  * return -1 if no TS packets start found */
 int next_ts_off(unsigned char *buf, size_t size)
 {
-	int off = 0;
+	return ts_sync_find(buf, size, TS_SYNC_LOCK_COUNT);
+}
 
-	if (size < TS_SIZE)
-		return -1;
+/* copy node data (starting from 'off') to 'dst'
+ * return copied bytes */
+static int node_copy_from(struct ts_node *node, int off, unsigned char *dst, int len)
+{
+	struct ts_seg *seg = NULL;
+	int i = 0, part = 0, done = 0;
 
-	for (off = 0; off <= (size - TS_SIZE); )
-	{
-		if (buf[off] == TS_SYNC && (off + TS_SIZE) == size)
-			return off;
-		if (buf[off] == TS_SYNC && buf[off + TS_SIZE] == TS_SYNC)
-			return off;
-		off++;
-	 }
+	for (i = 0; i < node->segs_count && done < len; i++) {
+		seg = &node->segs[i];
+		if (off >= seg->size) {
+			off -= seg->size;
+			continue;
+		}
+		part = seg->size - off;
+		if (part > len - done)
+			part = len - done;
+		memcpy(dst + done, seg->data + off, part);
+		done += part;
+		off = 0;
+	}
 
-	return -1;
+	return done;
 }
 
-int replace_pat(struct big_pool_t *pool, unsigned char *data, int size)
+static int ts_reader_lend(struct ts_reader_t *reader, struct iovec *iov, int iovcnt, int size);
+
+/* lent nodes storage. Every iovec can point to different node
+ * called by reader's thread outside of lock */
+static int ts_reader_reserve(struct ts_reader_t *reader, struct big_pool_t *pool, int iovcnt)
 {
-	int off = 0;
-	int pid = 0;
-	char *pkt = NULL;
-	char *pat = NULL;
-	char *sdt = NULL;
+	struct ts_node **held = NULL;
 
-	if(!pool)
-		return -EINVAL;
-	
-	pat = pool->generated_pat_pkt;
-
-	jdebug("PKT: size:%d \n", size);
-	// data already aligned to TS packets
-	for (off = 0; off <= (size - TS_SIZE); ) {
-		if (data[off] == TS_SYNC) {
-			pid = ((int)data[off+1]&0x1f)<<8 | data[off+2];
-			jdebug(" PKT: off=%d pid=0x%x \n", off, pid);
-			if (pid == 0x0 /* PAT */) {
-				if (pool->pat_counter == 0x10)
-					pool->pat_counter = 0;
-				pat[3] = (pat[3]&0xf0) | (pool->pat_counter&0x0f);
-				pool->pat_counter++;
-				memcpy(&data[off], pat, TS_SIZE);
-				jdebug("	PAT replaced. off=%d pid=0x%x\n", off, pid);
-			} else if (pid == 0x11 /* SDT */) {
-				// current hackish SDT generator disabled
-				// all SDT will be replaced to null packets (hack !)
-				// no SDT info in output stream !
-				// TODO: rework SDT generator ! 
-				sdt = get_next_sdt(pool);
-				if (!sdt) {
-					// hack: replace SDT to null packet !
-					pkt = &data[off];
-					pkt[0] = 0x47;
-					pkt[1] = 0x1F;
-					pkt[2] = 0xFF;
-					pkt[3] = 0;
-					off += TS_SIZE;
-					continue;
-				}
+	if (!pool->zero_copy || reader->held_max >= iovcnt)
+		return 0;
 
-				if (pool->sdt_counter == 0x10)
-					pool->sdt_counter = 0;
-				sdt[3] = (sdt[3]&0xf0) | (pool->sdt_counter&0x0f);
-				pool->sdt_counter++;
-				memcpy(&data[off], sdt, TS_SIZE);
-				printf("	SDT replaced. off=%d pid=0x%x\n", off, pid);
-			}
+	held = realloc(reader->held, iovcnt * sizeof(*held));
+	if (!held)
+		return -ENOMEM;
+	reader->held = held;
+	reader->held_max = iovcnt;
 
-			off += TS_SIZE;
-		} else {
-			off++;
-		}
+	return 0;
+}
+
+/* copy data at reader position. caller holds mux_all
+ * ring buffer (or ready list) data held like borrowed one and copied
+ * outside of lock. Spill file read under lock
+ * return copied bytes */
+static int ts_reader_copy(struct ts_reader_t *reader, unsigned char *data, int size)
+{
+	struct big_pool_t *pool = reader->pool;
+	struct iovec iov[TS_READ_IOV];
+	int64_t len = 0;
+	int res_off = 0, n = 0, i = 0;
+
+	// spilled data is newer than ring buffer
+	if (reader->off >= pool->stream_head) {
+		len = spill_read(pool, reader->off - pool->stream_head, data, size);
+		reader->off += len;
+		return len;
+	}
+
+	n = ts_reader_lend(reader, iov, TS_READ_IOV, size);
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	for (i = 0; i < n; i++) {
+		memcpy(data + res_off, iov[i].iov_base, iov[i].iov_len);
+		res_off += iov[i].iov_len;
+	}
+	for (i = 0; i < reader->held_count; i++)
+		drop_ts_data(reader->held[i]);
+	reader->held_count = 0;
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	reader->hold = -1;
+
+	return res_off;
+}
+
+/* reader enters read call. ts_pipeline_stop waits for readers
+ * caller holds mux_all */
+static void ts_reader_enter(struct big_pool_t *pool)
+{
+	pool->readers_active++;
+}
+
+static void ts_reader_leave(struct big_pool_t *pool)
+{
+	// ts_pipeline_stop waits for last reader
+	if (!--pool->readers_active && pool->cancel)
+		pthread_cond_broadcast(&pool->threading->cond_all);
+}
+
+/* wait for data, eof or cancel. caller holds mux_all
+ * deadline - NULL to wait forever
+ * return 0 if data available, -ETIMEDOUT or -ECANCELED */
+static int ts_reader_wait(struct ts_reader_t *reader, struct timespec *deadline)
+{
+	struct big_pool_t *pool = reader->pool;
+
+	while (!ts_reader_avail(reader)) {
+		if (pool->eof || pool->cancel || reader->cancel)
+			return -ECANCELED;
+		if (!deadline)
+			pthread_cond_wait(&pool->threading->cond_all, &pool->threading->mux_all);
+		else if (pthread_cond_timedwait(&pool->threading->cond_all,
+					&pool->threading->mux_all, deadline) == ETIMEDOUT)
+			return -ETIMEDOUT;
 	}
 
 	return 0;
 }
 
-int read_ts_data(struct big_pool_t *pool, unsigned char *data, int size)
+int ts_reader_read_timeout(struct ts_reader_t *reader, unsigned char *data, int size,
+		int min_bytes, int timeout_ms)
 {
-	struct ts_node *node = NULL, *tmp = NULL;
-	int off = 0, len = 0, res_off = 0, pid = 0;
-	unsigned char * ptr = NULL, *ts_pkt = NULL, *res = NULL;
-	int remain = size;
+	struct big_pool_t *pool = NULL;
+	struct timespec deadline;
+	struct list_head done;
+	int res_off = 0, ret = 0;
+
+	if (!reader || !data || size < 0)
+		return -EINVAL;
+
+	// data held while copied
+	if (reader->borrowed)
+		return -EBUSY;
+
+	// pool uninitialized. nothing to read
+	pool = __atomic_load_n(&reader->pool, __ATOMIC_ACQUIRE);
+	if (!pool)
+		return 0;
+	if (ts_reader_reserve(reader, pool, TS_READ_IOV))
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&done);
+	if (min_bytes > size)
+		min_bytes = size;
+	if (timeout_ms >= 0)
+		ts_deadline(&deadline, timeout_ms);
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	if (!reader->pool) {
+		pthread_mutex_unlock(&reader->threading->mux_all);
+		return 0;
+	}
+	ts_reader_enter(pool);
+	do {
+		ret = ts_reader_wait(reader, timeout_ms >= 0 ? &deadline : NULL);
+		res_off += ts_reader_copy(reader, data + res_off, size - res_off);
+		ts_release(pool, &done);
+
+		if (!list_empty(&done)) {
+			// resubmit transfers outside of lock
+			pthread_mutex_unlock(&pool->threading->mux_all);
+			ts_release_done(&done);
+			pthread_mutex_lock(&pool->threading->mux_all);
+		}
+	} while (!ret && res_off < min_bytes);
+	ts_reader_leave(pool);
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	return res_off;
+}
+
+int ts_reader_read(struct ts_reader_t *reader, unsigned char *data, int size)
+{
+	return ts_reader_read_timeout(reader, data, size, size, -1);
+}
 
+/* read_ts_data reader. attach it if detached by ts_reader_open */
+static struct ts_reader_t * ts_default_reader(struct big_pool_t *pool)
+{
+	struct ts_reader_t *reader = pool->reader;
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	if (!reader->attached) {
+		// start from oldest data
+		reader->off = pool->stream_tail;
+		reader->attached = 1;
+		list_add_tail(&reader->list, &pool->readers);
+	}
+	reader->used = 1;
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	return reader;
+}
+
+int read_ts_data_timeout(struct big_pool_t *pool, unsigned char *data, int size,
+		int min_bytes, int timeout_ms)
+{
 	if (!data)
 		return -EINVAL;
 
@@ -631,50 +2825,288 @@ int read_ts_data(struct big_pool_t *pool, unsigned char *data, int size)
 	if (pool->initialized != BIG_POOL_MAGIC)
 		return -EINVAL;
 
-	while(remain) {
-		// get node from the list with locking (safe)
-		pthread_mutex_lock(&pool->threading->mux_all);
-		if(list_empty(&pool->ts_list_all))
-			pthread_cond_wait(&pool->threading->cond_all, &pool->threading->mux_all);
-		
-		if(!list_empty(&pool->ts_list_all)) {
-			jdebug("req:%d \n", size);
-			list_for_each_entry_safe(node, tmp, &pool->ts_list_all, list)
-			{
-				if (pool->generated_pat_pkt && !node->pat_replaced) {
-					// replace PAT to our own
-					// this hackish way should be refactored (regenerate TS ?)
-					replace_pat(pool, node->data, node->size);
-					node->pat_replaced = 1;
-				} else {
-					jdebug("Do not replace PAT \n");
-				}
+	return ts_reader_read_timeout(ts_default_reader(pool), data, size,
+			min_bytes, timeout_ms);
+}
 
-				jdebug("	node=%d size:%d read_off=%d\n", node->counter, node->size, node->read_off);
-				if (remain > (node->size - node->read_off)) {
-					// copy all node to output
-					memcpy(data + res_off, node->data + node->read_off, node->size - node->read_off);
-					// node fully processed. drop it
-					remain -= (node->size - node->read_off);
-					res_off += (node->size - node->read_off);
-					pool->ts_list_size -= node->size;
-					drop_ts_data(node);
-				} else {
-					memcpy(data + res_off, node->data + node->read_off, remain);
-					node->read_off += remain;
-					res_off += remain;
-					remain = 0;
-				}
+int read_ts_data(struct big_pool_t *pool, unsigned char *data, int size)
+{
+	return read_ts_data_timeout(pool, data, size, size, -1);
+}
 
-				if(!remain)
-					break;
+/* fill iovecs with data at reader position. Only one source used
+ * (ready list, ring buffer or spill file). caller holds mux_all
+ * return iovecs filled */
+static int ts_reader_lend(struct ts_reader_t *reader, struct iovec *iov, int iovcnt, int size)
+{
+	struct big_pool_t *pool = reader->pool;
+	struct ts_node *node = NULL;
+	struct ts_seg *seg = NULL;
+	unsigned char *src = NULL;
+	int64_t off = 0, len = 0, part = 0;
+	int n = 0, first = 0, i = 0, done = 0;
+
+	if (reader->off < pool->stream_head && pool->zero_copy) {
+		// point to lent transfers. node reference keeps transfer
+		// even if node dropped from ready list (overflow)
+		list_for_each_entry(node, &pool->ready_list, list) {
+			if (node->pos + node->size <= reader->off)
+				continue;
+			off = reader->off - node->pos;
+			first = n;
+			for (i = 0; i < node->segs_count && n < iovcnt && done < size; i++) {
+				seg = &node->segs[i];
+				if (off >= seg->size) {
+					off -= seg->size;
+					continue;
+				}
+				len = seg->size - off;
+				if (len > size - done)
+					len = size - done;
+				iov[n].iov_base = seg->data + off;
+				iov[n].iov_len = len;
+				n++;
+				done += len;
+				reader->off += len;
+				off = 0;
+			}
+			if (n > first) {
+				ts_node_get(node);
+				reader->held[reader->held_count++] = node;
 			}
+			if (n >= iovcnt || done >= size)
+				break;
+		}
+	} else if (reader->off < pool->stream_head) {
+		// ring buffer. kept until release (see ts_hold_min)
+		len = pool->stream_head - reader->off;
+		if (len > size)
+			len = size;
+		src = ring_advance(pool, pool->read_ptr, reader->off - pool->stream_tail);
+		part = pool->ptr_end - src;
+		iov[n].iov_base = src;
+		iov[n].iov_len = pool->mirrored || len <= part ? len : part;
+		n++;
+		if (!pool->mirrored && len > part && n < iovcnt) {
+			iov[n].iov_base = pool->ptr;
+			iov[n].iov_len = len - part;
+			n++;
+		}
+		reader->hold = reader->off;
+		reader->off += iov[0].iov_len + (n > 1 ? iov[1].iov_len : 0);
+	} else if (reader->bounce) {
+		// spill file. no memory to point to
+		len = spill_read(pool, reader->off - pool->stream_head, reader->bounce,
+				size < reader->bounce_size ? size : reader->bounce_size);
+		if (len > 0) {
+			iov[n].iov_base = reader->bounce;
+			iov[n].iov_len = len;
+			n++;
+			reader->off += len;
 		}
-		pthread_mutex_unlock(&pool->threading->mux_all);
 	}
 
+	return n;
+}
 
-	return res_off;
+int ts_reader_borrow_timeout(struct ts_reader_t *reader, struct iovec *iov, int iovcnt,
+		int size, int timeout_ms)
+{
+	struct big_pool_t *pool = NULL;
+	struct timespec deadline;
+	struct list_head done;
+	int n = 0;
+
+	if (!reader || !iov || iovcnt <= 0 || size < TS_SIZE)
+		return -EINVAL;
+
+	if (reader->borrowed)
+		return -EBUSY;
+
+	// pool uninitialized. nothing to borrow
+	pool = __atomic_load_n(&reader->pool, __ATOMIC_ACQUIRE);
+	if (!pool)
+		return 0;
+	INIT_LIST_HEAD(&done);
+	size = size / TS_SIZE * TS_SIZE;
+
+	// allocate outside of lock
+	if (ts_reader_reserve(reader, pool, iovcnt))
+		return -ENOMEM;
+	if (pool->overflow_policy == TS_OVERFLOW_SPILL && reader->bounce_size < size) {
+		free(reader->bounce);
+		reader->bounce = malloc(size);
+		reader->bounce_size = reader->bounce ? size : 0;
+	}
+
+	if (timeout_ms >= 0)
+		ts_deadline(&deadline, timeout_ms);
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	if (!reader->pool) {
+		pthread_mutex_unlock(&reader->threading->mux_all);
+		return 0;
+	}
+	ts_reader_enter(pool);
+	ts_reader_wait(reader, timeout_ms >= 0 ? &deadline : NULL);
+
+	n = ts_reader_lend(reader, iov, iovcnt, size);
+	reader->borrowed = n > 0;
+	ts_release(pool, &done);
+	ts_reader_leave(pool);
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	ts_release_done(&done);
+
+	return n;
+}
+
+int ts_reader_borrow(struct ts_reader_t *reader, struct iovec *iov, int iovcnt, int size)
+{
+	return ts_reader_borrow_timeout(reader, iov, iovcnt, size, -1);
+}
+
+int ts_reader_release(struct ts_reader_t *reader)
+{
+	struct big_pool_t *pool = NULL;
+	struct list_head done;
+	int i = 0;
+
+	if (!reader)
+		return -EINVAL;
+
+	if (!reader->borrowed)
+		return 0;
+
+	INIT_LIST_HEAD(&done);
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	// released by pool_uninit already
+	pool = reader->pool;
+	if (!pool || !reader->borrowed) {
+		pthread_mutex_unlock(&reader->threading->mux_all);
+		return 0;
+	}
+	reader->borrowed = 0;
+	if (reader->hold >= 0) {
+		reader->hold = -1;
+		ts_release(pool, &done);
+	}
+	// pool_uninit waits till held nodes dropped
+	if (reader->held_count)
+		ts_reader_enter(pool);
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	ts_release_done(&done);
+
+	if (!reader->held_count)
+		return 0;
+
+	// resubmit transfers outside of lock
+	for (i = 0; i < reader->held_count; i++)
+		drop_ts_data(reader->held[i]);
+	reader->held_count = 0;
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	ts_reader_leave(pool);
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	return 0;
+}
+
+int ts_read_borrow(struct big_pool_t *pool, struct iovec *iov, int iovcnt, int size)
+{
+	if (!pool || pool->initialized != BIG_POOL_MAGIC)
+		return -EINVAL;
+
+	return ts_reader_borrow(ts_default_reader(pool), iov, iovcnt, size);
+}
+
+int ts_read_release(struct big_pool_t *pool)
+{
+	if (!pool || pool->initialized != BIG_POOL_MAGIC)
+		return -EINVAL;
+
+	return ts_reader_release(pool->reader);
+}
+
+struct ts_reader_t * ts_reader_open(struct big_pool_t *pool, int from_oldest)
+{
+	struct ts_reader_t *reader = NULL;
+
+	if (!pool || pool->initialized != BIG_POOL_MAGIC)
+		return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->pool = pool;
+	reader->threading = pool->threading;
+	reader->attached = 1;
+	reader->used = 1;
+	reader->hold = -1;
+
+	pthread_mutex_lock(&pool->threading->mux_all);
+	pool->threading->refs++;
+	// nobody calls read_ts_data. do not keep data for it
+	if (pool->reader->attached && !pool->reader->used) {
+		list_del(&pool->reader->list);
+		pool->reader->attached = 0;
+	}
+	reader->off = from_oldest ? pool->stream_tail : pool->stream_head + pool->spill_ready_off;
+	list_add_tail(&reader->list, &pool->readers);
+	pthread_mutex_unlock(&pool->threading->mux_all);
+
+	return reader;
+}
+
+void ts_reader_wakeup(struct ts_reader_t *reader)
+{
+	if (!reader)
+		return;
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	reader->cancel = 1;
+	pthread_mutex_unlock(&reader->threading->mux_all);
+	pthread_cond_broadcast(&reader->threading->cond_all);
+}
+
+int64_t ts_reader_dropped(struct ts_reader_t *reader)
+{
+	int64_t dropped = 0;
+
+	if (!reader)
+		return -EINVAL;
+
+	pthread_mutex_lock(&reader->threading->mux_all);
+	dropped = reader->dropped;
+	pthread_mutex_unlock(&reader->threading->mux_all);
+
+	return dropped;
+}
+
+void ts_reader_close(struct ts_reader_t *reader)
+{
+	struct big_pool_t *pool = NULL;
+	struct list_head done;
+
+	if (!reader)
+		return;
+
+	INIT_LIST_HEAD(&done);
+	ts_reader_release(reader);
+
+	// data kept for this reader released
+	pthread_mutex_lock(&reader->threading->mux_all);
+	pool = reader->pool;
+	if (pool) {
+		list_del(&reader->list);
+		ts_release(pool, &done);
+	}
+	ts_threading_put(reader->threading);
+	ts_release_done(&done);
+
+	ts_reader_free(reader);
 }
 
 /* TS loopback thread */
@@ -45,6 +45,7 @@ typedef unsigned int            uint32_t;
 #include "joker_fpga.h"
 #include "u_drv_tune.h"
 #include "joker_blind_scan.h"
+#include "joker_utils.h"
 
 static int joker_i2c_gate_ctrl(struct dvb_frontend *fe, int enable);
 
@@ -74,6 +75,7 @@ void* process_service(void * data) {
 	}
 
 	printf("process_service started \n");
+	joker_thread_setup(joker, JOKER_THREAD_SERVICE);
 	while(!joker->service_threading->cancel) {
 		// wait until refresh not enabled
 		pthread_mutex_lock(&joker->service_threading->mux);